@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "io_helpers.h"
+
+
+/* Moves arena->cur to a chunk with at least size free bytes, reusing chunks
+ * left over from earlier lines before allocating a new one.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int arena_next_chunk(Arena *arena, size_t size) {
+    while (arena->cur != NULL && arena->cur->next != NULL) {
+        arena->cur = arena->cur->next;
+        arena->cur->used = 0;
+        if (arena->cur->cap >= size) {
+            return 0;
+        }
+    }
+
+    size_t cap = size > ARENA_CHUNK_LEN ? size : ARENA_CHUNK_LEN;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + cap);
+    if (chunk == NULL) {
+        display_error("ERROR: Memory allocation failed for arena", "");
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->cap = cap;
+    chunk->used = 0;
+
+    if (arena->cur == NULL) {
+        arena->head = chunk;
+    } else {
+        arena->cur->next = chunk;
+    }
+    arena->cur = chunk;
+    return 0;
+}
+
+/* Return: pointer to size bytes aligned to ARENA_ALIGN, or NULL on failure
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *chunk = arena->cur;
+    if (chunk == NULL || chunk->cap - chunk->used < size) {
+        if (arena_next_chunk(arena, size) == -1) {
+            return NULL;
+        }
+        chunk = arena->cur;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/* Return: NULL terminated copy of the first n bytes of s, or NULL on failure
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+    char *copy = arena_alloc(arena, n + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, n);
+        copy[n] = '\0';
+    }
+    return copy;
+}
+
+/* Grows the allocation ptr from old_size to new_size bytes. The block is
+ * extended in place when it is the most recent allocation and fits.
+ * Return: pointer to the (possibly moved) block, or NULL on failure
+ */
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    ArenaChunk *chunk = arena->cur;
+    old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    new_size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (ptr != NULL && chunk != NULL && (char *)ptr + old_size == chunk->data + chunk->used &&
+        chunk->cap - chunk->used >= new_size - old_size) {
+        chunk->used += new_size - old_size;
+        return ptr;
+    }
+
+    void *new_ptr = arena_alloc(arena, new_size);
+    if (new_ptr != NULL && ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+/* Releases every allocation at once. Default-sized chunks are kept for
+ * reuse, and later ones are rewound lazily as arena_alloc reaches them.
+ * Larger chunks were made for one big request (a captured command output,
+ * say) and are returned to the system rather than pinned for good.
+ */
+void arena_reset(Arena *arena) {
+    ArenaChunk **link = &arena->head;
+    while (*link != NULL) {
+        ArenaChunk *chunk = *link;
+        if (chunk->cap > ARENA_CHUNK_LEN) {
+            *link = chunk->next;
+            free(chunk);
+        } else {
+            link = &chunk->next;
+        }
+    }
+    arena->cur = arena->head;
+    if (arena->cur != NULL) {
+        arena->cur->used = 0;
+    }
+}
+
+/* Returns all chunks to the system.
+ */
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->cur = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+
+#define ARENA_CHUNK_LEN 65536  // Default chunk size; larger requests get their own chunk
+#define ARENA_ALIGN 16
+
+
+/* Bump allocator for everything that lives for a single command line
+ * (expanded tokens, argv arrays, pipeline structures). Default-sized
+ * chunks are kept across resets, so steady-state allocation never reaches
+ * malloc; larger ones are freed on reset.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t cap;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+    ArenaChunk *cur;
+} Arena;
+
+
+/* Return: pointer to size bytes aligned to ARENA_ALIGN, or NULL on failure
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/* Return: NULL terminated copy of the first n bytes of s, or NULL on failure
+ */
+char *arena_strndup(Arena *arena, const char *s, size_t n);
+
+/* Grows the allocation ptr from old_size to new_size bytes. The block is
+ * extended in place when it is the most recent allocation and fits.
+ * Return: pointer to the (possibly moved) block, or NULL on failure
+ */
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/* Releases every allocation at once. Default-sized chunks are kept for
+ * reuse; larger ones are returned to the system.
+ */
+void arena_reset(Arena *arena);
+
+/* Returns all chunks to the system.
+ */
+void arena_free(Arena *arena);
+
+
+#endif
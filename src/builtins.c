@@ -1,75 +1,55 @@
+#define _GNU_SOURCE  // For execvpe()
 #include <string.h>
 #include "builtins.h"
+#include "commands.h"
+#include "dirscan.h"
+#include "grep.h"
 #include "io_helpers.h"
+#include "jobs.h"
+#include "launch.h"
+#include "pattern.h"
+#include "procstat.h"
+#include "sort.h"
+#include "stream.h"
+#include "trace.h"
+#include "uniq.h"
+#include "variables.h"
+#include "walk.h"
+#include "wc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <netdb.h>        // For gethostbyname()
 #include <arpa/inet.h>    // For inet_ntoa() and htons()
 #include <netinet/in.h>
 
-#define MAX_BG_PROCESSES 1024
 
 static pid_t server_pid = 0;
 
-int execute_system_command(char **cmd);
-
-// Structure to track background processes.
-typedef struct {
-    int job_number;
-    pid_t pid;
-    char command[1024];
-} BackgroundProcess;
-
+int execute_system_command(Command *cmd);
 
-BackgroundProcess bg_processes[MAX_BG_PROCESSES];
-int bg_count = 0;
-
-void sigchld_handler(int signum) {
-    (void)signum; // Suppress unused parameter warning
-
-    int status;
-    pid_t pid;
-    char msg[1024];
-
-    // Process all finished children without blocking.
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // Find the corresponding background job.
-        for (int i = 0; i < bg_count; i++) {
-            if (bg_processes[i].pid == pid) {
-                if (WIFSIGNALED(status)) {
-                    // Process was terminated by a signal.
-                    snprintf(msg, sizeof(msg), "[%d]+  Done: %.900s\n",
-                             bg_processes[i].job_number, bg_processes[i].command);
-                } else {
-                    // Process exited normally.
-                    snprintf(msg, sizeof(msg), "[%d]+  Done\n",
-                             bg_processes[i].job_number);
-                }
-                // Write the message directly (async-signal–safe).
-                write(STDOUT_FILENO, msg, strlen(msg));
+// ====== Command execution =====
 
-                // Remove the finished job from the list.
-                for (int j = i; j < bg_count - 1; j++) {
-                    bg_processes[j] = bg_processes[j + 1];
-                }
-                bg_count--;
-                break;
-            }
-        }
-    }
+/* Return: environment for a spawned command (the shell's exported variables)
+ * Prereq: called in the parent before fork(), so the cached table is built
+ * there once and reused by every later command
+ */
+static char **child_envp(void) {
+    char **envp = variables_envp();
+    return envp != NULL ? envp : environ;
 }
 
-
-// ====== Command execution =====
-
 /* Return: index of builtin or -1 if cmd doesn't match a builtin
  */
 bn_ptr check_builtin(const char *cmd) {
@@ -109,73 +89,47 @@ ssize_t bn_echo(char **tokens) {
 }
 
 
-// Forward declarations for helper functions
-void ls_list(const char *path, const char *filter);
-void ls_recursive(const char *path, int current_depth, int max_depth, int use_depth_limit, const char *filter);
-
+/* Prints name if there is no filter or name matches it.
+ */
+static void ls_print(const char *name, const Pattern *filter) {
+    size_t len = strlen(name);
+    if (filter == NULL || pattern_match(filter, name, len)) {
+        out_write(io_out_fd, name, len);
+        out_write(io_out_fd, "\n", 1);
+    }
+}
 
 /*
  * ls_list - Lists all entries in a single directory.
- * If a filter is provided, only entries containing the substring are printed.
- * This version does not print "." and ".." unless they match the filter.
+ * If a filter is provided (the compiled --f glob or substring, or --re
+ * regex), only entries it matches are printed. "." and ".." are listed
+ * like any other entry, so with a filter they appear only if they match it.
  */
-void ls_list(const char *path, const char *filter) {
-    DIR *d = opendir(path);
-    if (!d) {
-        return;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(d)) != NULL) {
-        // Apply filtering if needed.
-        if (filter != NULL && strstr(entry->d_name, filter) == NULL)
-            continue;
-        
+static void ls_list(DirReader *dir, const Pattern *filter) {
+    DirEntry entry;
+    while (dir_next(dir, &entry) == 1) {
         // Print the directory entry (including "." and "..").
-        display_message(entry->d_name);
-        display_message("\n");
+        ls_print(entry.name, filter);
     }
-    
-    closedir(d);
 }
 
-
-
-
-
 /*
  * ls_recursive - Recursively lists directory contents.
  *
  * Parameters:
- *   path           - Current directory to list.
+ *   dir            - Open directory to list.
  *   current_depth  - Current recursion depth.
  *   max_depth      - Maximum recursion depth limit.
- *   use_depth_limit- If non-zero, the recursion is limited by max_depth.
  *   filter         - If provided, only entries matching the filter are printed.
+ *
+ * Subdirectories are found from d_type (fstatat() only for DT_UNKNOWN) and
+ * opened relative to their parent's descriptor, so no paths are built and
+ * nothing is stat()ed per entry. Symlinks to directories are not followed.
  */
-
-void ls_recursive(const char *path, int current_depth, int max_depth, int use_depth_limit, const char *filter) {
-    // If we somehow exceed the depth (should not happen because recursion is
-    // guarded), then return.
-    if (use_depth_limit && current_depth > max_depth) {
-        return;
-    }
-
-    DIR *d = opendir(path);
-    if (!d)
-        return;
-
-    struct dirent *entry;
-    while ((entry = readdir(d)) != NULL) {
-        /*
-          Print the entry if:
-          - No filter was provided, or
-          - The entry's name contains the filter substring.
-        */
-        if (filter == NULL || strstr(entry->d_name, filter) != NULL) {
-            display_message(entry->d_name);
-            display_message("\n");
-        }
+static void ls_recursive(DirReader *dir, int current_depth, int max_depth, const Pattern *filter) {
+    DirEntry entry;
+    while (dir_next(dir, &entry) == 1) {
+        ls_print(entry.name, filter);
 
         /* 
           For recursion:
@@ -186,27 +140,31 @@ void ls_recursive(const char *path, int current_depth, int max_depth, int use_de
           passed the filter because inner entries might match even if its parent's
           name does not.
         */
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        if (current_depth >= max_depth || dir_is_dot(entry.name) || !dir_entry_is_dir(dir, &entry)) {
             continue;
         }
-
-        // Build full path for the entry.
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-        struct stat statbuf;
-        if (stat(full_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-            if (!use_depth_limit || current_depth < max_depth) {
-                ls_recursive(full_path, current_depth + 1, max_depth, use_depth_limit, filter);
-            }
+        DirReader sub;
+        if (dir_open(&sub, dir->fd, entry.name, 1) == 0) {
+            ls_recursive(&sub, current_depth + 1, max_depth, filter);
+            dir_close(&sub);
         }
     }
-    closedir(d);
+}
+
+// walk_list match callback for the --f / --re filter
+static int ls_match(const WalkEntry *entry, void *ctx) {
+    return ctx == NULL || pattern_match(ctx, entry->name, strlen(entry->name));
 }
 
 /*
   bn_ls: the built-in ls command.
-  Usage: ls [path] [--f substring] [--rec] [--d depth]
-  If recursive mode is on, use ls_recursive starting at depth 1.
+  Usage: ls [path] [--f pattern] [--re regex] [--rec] [--d depth] [--j threads] [--unordered]
+  --f keeps the names containing pattern, or with "*", "?" or "[" in it,
+  the names the glob matches as a whole; --re keeps those a regex matches.
+  The filter is compiled once (see pattern.h).
+  If recursive mode is on, use ls_recursive starting at depth 1, or with
+  --j, walk_list on that many threads: in the same order as ls_recursive,
+  or with --unordered, streamed as directories are read.
   A supplied depth of 1 means only the top-level directory (depth 1) is listed.
 */
 ssize_t bn_ls(char **tokens) {
@@ -214,12 +172,30 @@ ssize_t bn_ls(char **tokens) {
     int recursive = 0;
     int max_depth = -1;  // -1 indicates no limit.
     const char *filter = NULL;
+    int regex = 0;
+    int threads = 0;     // 0: walk on this thread
+    int ordered = 1;
 
     int i = 1;
     while (tokens[i] != NULL) {
         if (strcmp(tokens[i], "--rec") == 0) {
             recursive = 1;
             i++;
+        } else if (strcmp(tokens[i], "--unordered") == 0) {
+            ordered = 0;
+            i++;
+        } else if (strcmp(tokens[i], "--j") == 0) {
+            i++;
+            if (tokens[i] == NULL) {
+                display_error("ERROR: --j requires a thread count", "");
+                return -1;
+            }
+            threads = atoi(tokens[i]);
+            if (threads < 1 || threads > WALK_MAX_THREADS) {
+                display_error("ERROR: Invalid thread count: ", tokens[i]);
+                return -1;
+            }
+            i++;
         } else if (strcmp(tokens[i], "--d") == 0) {
             i++;
             if (tokens[i] == NULL) {
@@ -233,10 +209,11 @@ ssize_t bn_ls(char **tokens) {
                 return -1;
             }
             i++;
-        } else if (strcmp(tokens[i], "--f") == 0) {
+        } else if (strcmp(tokens[i], "--f") == 0 || strcmp(tokens[i], "--re") == 0) {
+            regex = tokens[i][2] == 'r';
             i++;
             if (tokens[i] == NULL) {
-                display_error("ERROR: --f requires a substring filter", "");
+                display_error("ERROR: A pattern must follow ", tokens[i - 1]);
                 return -1;
             }
             filter = tokens[i];
@@ -247,26 +224,53 @@ ssize_t bn_ls(char **tokens) {
         }
     }
 
-    DIR *d = opendir(dir_path);
-    if (!d) {
-        display_error("ERROR: Invalid path: ", dir_path);
-        return -1;
+    Pattern pattern;
+    if (filter != NULL) {
+        int ret = regex ? pattern_regex(&pattern, filter, 0)
+                : pattern_is_glob(filter) ? pattern_glob(&pattern, filter, 0)
+                : pattern_substr(&pattern, filter, 0);
+        if (ret == -1) {
+            display_error("ERROR: Invalid filter: ", (char *)filter);
+            return -1;
+        }
     }
-    closedir(d);
-
-    if (recursive) {
-        if (max_depth == -1)
-            ls_recursive(dir_path, 1, 999, 1, filter); // Use a large number when no limit.
-        else
-            ls_recursive(dir_path, 1, max_depth, 1, filter);
+    const Pattern *match = filter ? &pattern : NULL;
+
+    int ret = 0;
+    if (recursive && (threads > 0 || !ordered)) {
+        WalkOpts opts = {
+            .threads = threads > 0 ? threads : 1,
+            .max_depth = max_depth == -1 ? 999 : max_depth,
+            .ordered = ordered,
+            .match = ls_match,
+            .ctx = (void *)match,
+        };
+        if (walk_list(dir_path, &opts, io_out_fd) == -1) {
+            display_error("ERROR: Invalid path: ", dir_path);
+            ret = -1;
+        }
+    } else {
+        DirReader dir;
+        if (dir_open(&dir, AT_FDCWD, dir_path, 0) == -1) {
+            display_error("ERROR: Invalid path: ", dir_path);
+            ret = -1;
+        } else {
+            if (recursive) {
+                if (max_depth == -1)
+                    ls_recursive(&dir, 1, 999, match); // Use a large number when no limit.
+                else
+                    ls_recursive(&dir, 1, max_depth, match);
+            }
+            else {
+                ls_list(&dir, match);
+            }
+            dir_close(&dir);
+        }
     }
-    else {
-        // Assume ls_list is defined elsewhere for non-recursive listing.
-	ls_list(dir_path, filter);
+    if (filter != NULL) {
+        pattern_free(&pattern);
     }
-
-    fflush(stdout);
-    return 0;
+    return ret;
 }
 
 
@@ -288,115 +292,338 @@ ssize_t bn_ls(char **tokens) {
 
 
 
+/* Writes the rest of fd to io_out_fd: inside the kernel when kernel_copy
+ * can (into a file, socket or pipe), otherwise from a mapping of a regular
+ * file or with large reads, handed to the output layer in
+ * STREAM_CHUNK_LEN pieces that bypass its buffer.
+ * Return: 0 on success (including a reader that went away), -1 on a read
+ * error
+ */
+static int cat_fd(int fd) {
+    if (out_flush(io_out_fd) == -1) {
+        return 0;   // Reader went away
+    }
+    if (kernel_copy(fd, io_out_fd) >= 0) {
+        return 0;
+    }
+
+    // kernel_copy may have copied part of the file: carry on from its offset
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off != -1 && st.st_size > off) {
+        size_t size = st.st_size;
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            for (size_t pos = off; pos < size; pos += STREAM_CHUNK_LEN) {
+                size_t len = size - pos < STREAM_CHUNK_LEN ? size - pos : STREAM_CHUNK_LEN;
+                if (out_write(io_out_fd, map + pos, len) == -1) {
+                    break;  // Reader went away
+                }
+            }
+            munmap(map, size);
+            return 0;
+        }
+    }
+
+    char *buffer = malloc(STREAM_CHUNK_LEN);
+    if (buffer == NULL) {
+        display_error("ERROR: Memory allocation failed for cat", "");
+        return -1;
+    }
+    int ret = 0;
+    while (1) {
+        ssize_t n = read(fd, buffer, STREAM_CHUNK_LEN);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = n == 0 ? 0 : -1;
+            break;
+        }
+        if (out_write(io_out_fd, buffer, n) == -1) {
+            break;  // Reader went away
+        }
+    }
+    free(buffer);
+    return ret;
+}
+
 /*
  * bn_cat - Builtin function for the "cat" command.
  *
- * Usage: cat [file]
+ * Usage: cat [file ...]
  *
- * Displays the contents of the file to stdout.
- * If no file is provided, report:
+ * Displays the contents of each file in turn to stdout; with no file (or
+ * for "-") stdin is copied instead.
+ * If no file is provided and stdin is a terminal, report:
  *    ERROR: No input source provided
  *
- * If the file cannot be opened, report:
+ * If a file cannot be opened, report (and continue with the next one):
  *    ERROR: Cannot open file: [file]
  *
  * Returns 0 on success and -1 on error.
  */
 ssize_t bn_cat(char **tokens) {
-    // Check if a file name is provided
     if (tokens[1] == NULL) {
         // Read from stdin if no file name is given
-        if (isatty(STDIN_FILENO)) { // Check if stdin is coming from terminal or a pipe
+        if (isatty(io_in_fd)) { // Check if stdin is coming from terminal or a pipe
             display_error("ERROR: No input source provided", "");
             return -1;
-        } else {
-            // Read and display from stdin
-            char buffer[1024];
-            while (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-                display_message(buffer);
-            }
-            return 0;
         }
+        return cat_fd(io_in_fd);
     }
 
-    // Open the file for reading
-    FILE *fp = fopen(tokens[1], "r");
-    if (fp == NULL) {
-        display_error("ERROR: Cannot open file: ", tokens[1]);
-        return -1;
-    }
-
-    // Read and display the file line by line
-    char line[1024];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        display_message(line);
+    ssize_t ret = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        if (strcmp(tokens[i], "-") == 0) {
+            ret |= cat_fd(io_in_fd);
+            continue;
+        }
+        int fd = open(tokens[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", tokens[i]);
+            ret = -1;
+            continue;
+        }
+        if (cat_fd(fd) == -1) {
+            display_error("ERROR: Cannot read file: ", tokens[i]);
+            ret = -1;
+        }
+        close(fd);
     }
+    return ret;
+}
 
-    fclose(fp);
-    return 0;
+// Output sink for helpers that produce text in pieces
+static int emit_output(void *ctx, const char *text, size_t len) {
+    (void)ctx;
+    return out_write(io_out_fd, text, len);
 }
 
+/*
+ * bn_wc - Builtin function for the "wc" command.
+ *
+ * Usage: wc [-l] [-w] [-c] [file ...]
+ *
+ * Prints the word, character and newline counts of the file (or of stdin),
+ * or only those selected with -w, -c and -l. Regular files are mapped and
+ * counted by vector kernels on several threads. Several files are counted
+ * concurrently and shown as one row each, followed by a total row.
+ *
+ * Returns 0 on success and -1 on error.
+ */
 ssize_t bn_wc(char **tokens) {
-    FILE *fp = NULL;
+    unsigned what;
+    int operand = wc_parse_flags(tokens, &what);
+    if (operand == -1) {
+        return -1;
+    }
+    const char *path = tokens[operand];
+    if (path != NULL && tokens[operand + 1] != NULL) {
+        size_t count = 0;
+        while (tokens[operand + count] != NULL) {
+            count++;
+        }
+        return wc_files(tokens + operand, count, what, emit_output, NULL);
+    }
+    int fd;
 
     // Determine input source
-    if (tokens[1] == NULL) {
+    if (path == NULL) {
         // Use stdin if no file name is provided
-        if (isatty(STDIN_FILENO)) { // Check if stdin is coming from terminal or a pipe
+        if (isatty(io_in_fd)) { // Check if stdin is coming from terminal or a pipe
             display_error("ERROR: No input source provided", "");
             return -1;
-        } else {
-            fp = stdin;
         }
+        fd = io_in_fd;
     } else {
         // Open the file for reading
-        fp = fopen(tokens[1], "r");
-        if (fp == NULL) {
-            display_error("ERROR: Cannot open file: ", tokens[1]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", (char *)path);
             return -1;
         }
     }
 
-    // Initialize counters
-    unsigned long word_count = 0;
-    unsigned long char_count = 0;
-    unsigned long newline_count = 0;
-    int in_word = 0;
-    int c;
+    WcCounts counts = {0};
+    int ret = wc_count_fd(&counts, fd, what);
+    if (fd != io_in_fd) {
+        close(fd);
+    }
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", path ? (char *)path : "stdin");
+        return -1;
+    }
 
-    // Read input character by character
-    while ((c = fgetc(fp)) != EOF) {
-        char_count++;  // Count every character
+    // Display results
+    char buffer[256];
+    wc_format(buffer, sizeof(buffer), &counts, what);
+    display_message(buffer);
 
-        if (c == '\n') {
-            newline_count++;
-        }
+    return 0;
+}
 
-        // Determine if the character is whitespace
-        if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
-            in_word = 0;
-        } else {
-            if (!in_word) { // Transition into a new word
-                word_count++;
-                in_word = 1;
-            }
+
+/*
+ * bn_grep - Builtin function for the "grep" command.
+ *
+ * Usage: grep [-c] [-l] [-v] [-i] [-n] [-F] pattern [file ...]
+ *
+ * Prints the lines of the files (or of stdin) that contain the extended
+ * regex pattern (-F: the literal string), or with -v those that do not.
+ * -c prints how many lines were selected, -l the names of the inputs with
+ * any, -n numbers the lines and -i ignores case. Each line is prefixed by
+ * its file's name when there are several files, which are searched
+ * concurrently and printed in order.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_grep(char **tokens) {
+    GrepQuery q;
+    int operand = grep_parse(tokens, &q);
+    if (operand == -1) {
+        return -1;
+    }
+    const char *path = tokens[operand];
+    if (path != NULL && tokens[operand + 1] != NULL) {
+        size_t count = 0;
+        while (tokens[operand + count] != NULL) {
+            count++;
+        }
+        int ret = grep_files(tokens + operand, count, &q, emit_output, NULL);
+        grep_free(&q);
+        return ret;
+    }
+    int fd;
+    if (path == NULL) {
+        if (isatty(io_in_fd)) {
+            display_error("ERROR: No input source provided", "");
+            grep_free(&q);
+            return -1;
+        }
+        fd = io_in_fd;
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", (char *)path);
+            grep_free(&q);
+            return -1;
         }
     }
 
-    // Close the file if reading from a file
-    if (fp != stdin) {
-        fclose(fp);
+    GrepScan s;
+    grep_scan_init(&s, &q, path, 0, emit_output, NULL);
+    int ret = grep_fd(&s, fd);
+    if (fd != io_in_fd) {
+        close(fd);
+    }
+    grep_free(&q);
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", path ? (char *)path : "stdin");
+        return -1;
     }
+    return 0;
+}
 
-    // Display results
-    char buffer[256];
-    sprintf(buffer, "word count %lu\n", word_count);
-    display_message(buffer);
-    sprintf(buffer, "character count %lu\n", char_count);
-    display_message(buffer);
-    sprintf(buffer, "newline count %lu\n", newline_count);
-    display_message(buffer);
 
+/*
+ * bn_sort - Builtin function for the "sort" command.
+ *
+ * Usage: sort [-r] [-n] [-u] [-k N[,M]] [-t C] [-S size] [-j N] [file ...]
+ *
+ * Prints the lines of the files (or of stdin) in byte order, or by the
+ * leading number with -n, reversed with -r. -k sorts on fields N to M
+ * (separated by blanks, or by C with -t) and -u keeps only the first line
+ * of each key. Input beyond the -S memory budget is sorted in runs that
+ * are spilled to temporary files and merged at the end.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_sort(char **tokens) {
+    SortOpts opts;
+    int operand = sort_parse(tokens, &opts);
+    if (operand == -1) {
+        return -1;
+    }
+    if (tokens[operand] == NULL && isatty(io_in_fd)) {
+        display_error("ERROR: No input source provided", "");
+        return -1;
+    }
+    Sorter s;
+    sort_init(&s, &opts);
+    int ret = 0;
+    if (tokens[operand] == NULL) {
+        ret = sort_fd(&s, io_in_fd);
+        if (ret == -1) {
+            display_error("ERROR: Cannot read input: ", "stdin");
+        }
+    }
+    for (int i = operand; tokens[i] != NULL && ret == 0; i++) {
+        int fd = open(tokens[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", tokens[i]);
+            ret = -1;
+            break;
+        }
+        ret = sort_fd(&s, fd);
+        close(fd);
+        if (ret == -1) {
+            display_error("ERROR: Cannot read input: ", tokens[i]);
+        }
+    }
+    if (ret == 0) {
+        ret = sort_finish(&s, emit_output, NULL);
+    }
+    sort_free(&s);
+    return ret;
+}
+
+
+/*
+ * bn_uniq - Builtin function for the "uniq" command.
+ *
+ * Usage: uniq [-c] [-d] [-u] [-i] [file]
+ *
+ * Prints the lines of the file (or of stdin), dropping lines equal to the
+ * one before them. -c prefixes each line with how many times it occurred,
+ * -d prints only repeated lines and -u only lines that are not repeated;
+ * -i ignores case.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_uniq(char **tokens) {
+    unsigned flags;
+    int operand = uniq_parse(tokens, &flags);
+    if (operand == -1) {
+        return -1;
+    }
+    const char *path = tokens[operand];
+    int fd;
+    if (path == NULL) {
+        if (isatty(io_in_fd)) {
+            display_error("ERROR: No input source provided", "");
+            return -1;
+        }
+        fd = io_in_fd;
+    } else {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", (char *)path);
+            return -1;
+        }
+    }
+
+    UniqScan s;
+    uniq_init(&s, flags, emit_output, NULL);
+    int ret = uniq_fd(&s, fd);
+    if (fd != io_in_fd) {
+        close(fd);
+    }
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", path ? (char *)path : "stdin");
+        return -1;
+    }
     return 0;
 }
 
@@ -447,154 +674,355 @@ ssize_t bn_cd(char **tokens) {
     return 0;
 }
 
-void execute_pipe(char **cmd1, char **cmd2) {
-    int pipe_fd[2];
-    if (pipe(pipe_fd) == -1) {
-        perror("pipe");
-        exit(1);
+// One stage of a pipeline run by execute_pipeline
+typedef struct {
+    Command *cmd;
+    size_t index;
+    bn_ptr builtin;         // NULL for an external command
+    int fds[3];             // The stage's stdin, stdout and stderr; those above 2 are owned
+    pid_t pid;              // External stage: child pid, or -1
+    pthread_t thread;       // Builtin stage: its worker thread
+    int running;            // Thread or child started and not yet collected
+    ssize_t result;
+} PipeStage;
+
+static void close_stage_fds(PipeStage *stage) {
+    for (int i = 0; i < 3; i++) {
+        if (stage->fds[i] > STDERR_FILENO) {
+            close(stage->fds[i]);
+        }
+        stage->fds[i] = -1;
     }
+}
 
-    pid_t pid1 = fork();
-    if (pid1 == -1) {
-        perror("fork");
-        exit(1);
-    }
-
-    if (pid1 == 0) { // First child process
-        close(pipe_fd[0]); // Close unused read end
-        dup2(pipe_fd[1], STDOUT_FILENO); // Redirect stdout to write end of the pipe
-        close(pipe_fd[1]);
-	
-	if (strchr(cmd1[0], '=') != NULL) {
-    		exit(0);
-	}
-
-
-        // Check if the first command is a built-in
-        bn_ptr builtin_fn = check_builtin(cmd1[0]);
-        if (builtin_fn != NULL) {
-            // Call the built-in function
-            ssize_t err = builtin_fn(cmd1);
-            if (err == -1){
-            	display_error("ERROR: Builtin failed: ", cmd1[0]);
-	    }
-            exit(0); // Exit after built-in execution
-        }
-	else if (builtin_fn == NULL){
-	    if (execute_system_command(cmd1) == -1) {
-		display_error("ERROR: Unknown command: ", cmd1[0]);
-        	}
-	}
-    }
-
-    pid_t pid2 = fork();
-    if (pid2 == -1) {
+/* Worker thread for a builtin stage: runs it with the stage's descriptors
+ * as its stdio, then closes them so neighbouring stages see EOF / EPIPE.
+ */
+static void *run_builtin_stage(void *arg) {
+    PipeStage *stage = arg;
+    char **argv = stage->cmd->argv;
+    io_in_fd = stage->fds[0];
+    io_out_fd = stage->fds[1];
+    io_err_fd = stage->fds[2];
+
+    struct timespec started;
+    struct rusage before;
+    if (exec_profile != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        getrusage(RUSAGE_THREAD, &before);
+    }
+    TRACE_BEGIN(builtin_span);
+    stage->result = stage->builtin(argv);
+    TRACE_END(builtin_span, "builtin", argv[0]);
+    if (exec_profile != NULL) {
+        profile_builtin(stage->index, stage->result, RUSAGE_THREAD, &before, &started);
+    }
+    if (stage->result == -1) {
+        display_error("ERROR: Builtin failed: ", argv[0]);
+    }
+    out_flush_all();
+    close_stage_fds(stage);
+    return NULL;
+}
+
+/* Return: 1 if builtin changes the shell's own state (its cwd or
+ * variables), 0 otherwise
+ */
+static int changes_shell_state(bn_ptr builtin) {
+    return builtin == bn_cd || builtin == bn_export;
+}
+
+/* Runs a builtin stage that changes the shell's state in a forked child, as
+ * a subshell would: from inside a pipeline it must not move the shell's cwd
+ * or variables, least of all from a worker thread.
+ * Return: pid of the child, or -1 if fork failed
+ */
+static pid_t fork_builtin_stage(PipeStage *stage) {
+    out_flush_all();    // The child must not write out what is buffered again
+    pid_t pid = fork();
+    if (pid < 0) {
         perror("fork");
-        exit(1);
+        return -1;
     }
+    if (pid == 0) {
+        jobs_child_setup();
+        io_in_fd = stage->fds[0];
+        io_out_fd = stage->fds[1];
+        io_err_fd = stage->fds[2];
+        ssize_t result = stage->builtin(stage->cmd->argv);
+        out_flush_all();
+        _exit(result == -1 ? 1 : 0);
+    }
+    return pid;
+}
 
-    if (pid2 == 0) { // Second child process
-        close(pipe_fd[1]); // Close unused write end
-        dup2(pipe_fd[0], STDIN_FILENO); // Redirect stdin to read end of the pipe
-        close(pipe_fd[0]);
-
-        // Check if the second command is a built-in
-        bn_ptr builtin_fn = check_builtin(cmd2[0]);
-        if (builtin_fn != NULL) {
-            // Call the built-in function
-            ssize_t err = builtin_fn(cmd2);
-            if (err == -1){
-                display_error("ERROR: Builtin failed: ", cmd2[0]);
-		}
+/* Starts one stage: builtins on a worker thread in the shell process
+ * (or a forked child, for those that change the shell's state), anything
+ * else in a forked child.
+ * Return: 0 on success, -1 on error (the stage's descriptors are closed)
+ */
+static int start_stage(PipeStage *stage) {
+    char **argv = stage->cmd->argv;
+    if (stage->cmd->assignment) {
+        close_stage_fds(stage);     // An assignment stage does nothing
+        return 0;
+    }
 
-            exit(0); // Exit after built-in execution
+    TRACE_BEGIN(lookup_span);
+    stage->builtin = check_builtin(argv[0]);
+    TRACE_END(lookup_span, "check_builtin", argv[0]);
+    if (stage->builtin != NULL) {
+        if (open_redirects(stage->cmd->redirs, stage->fds) == -1) {
+            close_stage_fds(stage);
+            return -1;
+        }
+        if (changes_shell_state(stage->builtin)) {
+            stage->pid = fork_builtin_stage(stage);
+            stage->builtin = NULL;  // Collected like an external command
+            close_stage_fds(stage);
+            stage->running = stage->pid != -1;
+            return stage->pid == -1 ? -1 : 0;
         }
-	else if (builtin_fn == NULL){
-	    if (execute_system_command(cmd2) == -1) {
-		display_error("ERROR: Unknown command: ", cmd2[0]);
-        	}
-	}
+        if (pthread_create(&stage->thread, NULL, run_builtin_stage, stage) != 0) {
+            display_error("ERROR: Could not start pipeline stage: ", argv[0]);
+            close_stage_fds(stage);
+            return -1;
+        }
+        stage->running = 1;
+        return 0;
     }
 
-    // Parent process closes pipe and waits for both children
-    close(pipe_fd[0]);
-    close(pipe_fd[1]);
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+    struct timespec spawning;
+    clock_gettime(CLOCK_MONOTONIC, &spawning);
+    stage->pid = spawn_command(argv, stage->cmd->redirs, stage->fds[0], stage->fds[1], NULL);
+    profile_add_spawn(&spawning);
+    close_stage_fds(stage);
+    if (stage->pid == -1) {
+        return -1;
+    }
+    stage->running = 1;
+    return 0;
+}
+
+/* Return: fd itself if it is a standard descriptor, otherwise a duplicate
+ * for a stage to own
+ */
+static int stage_end_fd(int fd) {
+    return fd > STDERR_FILENO ? fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1) : fd;
 }
 
+/* Runs every stage of pl concurrently, connected by pipes. Builtin stages
+ * run on threads in the shell process with per-thread stdio, so only
+ * external commands are forked; "cat file | wc" needs no fork at all.
+ */
+void execute_pipeline(Pipeline *pl) {
+    PipeStage stages[pl->count];
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    fflush(stdout);
 
-int start_background_process(char **cmd) {
-    sigset_t mask, prev_mask;
-    // Prepare mask to block SIGCHLD.
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
+    if (stream_fusable(pl)) {
+        // Only streaming builtins: one loop in this thread, no pipes or threads.
+        // The fused loop is measured as a whole, on the first stage.
+        struct rusage before;
+        getrusage(RUSAGE_SELF, &before);
+        TRACE_BEGIN(fused_span);
+        ssize_t err = stream_run(pl);
+        TRACE_END(fused_span, "fused_pipeline", pl->cmds[0].argv[0]);
+        profile_builtin(0, err, RUSAGE_SELF, &before, &started);
+        return;
+    }
 
-    // Block SIGCHLD to prevent race conditions on bg_processes and bg_count.
-    if (sigprocmask(SIG_BLOCK, &mask, &prev_mask) == -1) {
-        perror("sigprocmask");
-        return -1;
+    // Wire up the stages first: stage i writes into the pipe stage i + 1 reads.
+    // The ends are this thread's stdio (a command substitution's pipe, say);
+    // stages close what they are given, so those are passed as duplicates.
+    int in_fd = stage_end_fd(io_in_fd);
+    for (size_t i = 0; i < pl->count; i++) {
+        PipeStage *stage = &stages[i];
+        stage->cmd = &pl->cmds[i];
+        stage->index = i;
+        stage->builtin = NULL;
+        stage->pid = -1;
+        stage->running = 0;
+        stage->result = 0;
+        stage->fds[0] = in_fd;
+        stage->fds[1] = i + 1 < pl->count ? -1 : stage_end_fd(io_out_fd);
+        stage->fds[2] = stage_end_fd(io_err_fd);
+        in_fd = -1;
+        if (i + 1 < pl->count) {
+            int pipe_fd[2];
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                for (size_t j = 0; j <= i; j++) {
+                    close_stage_fds(&stages[j]);
+                }
+                return;
+            }
+            stage->fds[1] = pipe_fd[1];
+            in_fd = pipe_fd[0];
+        }
+    }
+
+    for (size_t i = 0; i < pl->count; i++) {
+        start_stage(&stages[i]);
+    }
+
+    struct timespec waiting;
+    clock_gettime(CLOCK_MONOTONIC, &waiting);
+    for (size_t i = 0; i < pl->count; i++) {
+        PipeStage *stage = &stages[i];
+        if (!stage->running) {
+            continue;
+        }
+        if (stage->builtin != NULL) {
+            pthread_join(stage->thread, NULL);
+            continue;
+        }
+        int status;
+        struct rusage usage;
+        if (wait_child(stage->pid, &status, &usage) != -1) {
+            profile_stage(i, status, &usage, &started);
+        }
     }
+    profile_add_wait(&waiting);
+}
+
 
+/* Forks and execs argv with its redirections applied. When in_fd / out_fd
+ * are not -1 they become the child's stdin / stdout first; launch (if not
+ * NULL) sets the child's affinity, nice value and limits before exec.
+ * Return: pid of the child, or -1 if fork failed
+ */
+pid_t spawn_command(char **argv, const Redirect *redirs, int in_fd, int out_fd,
+                    const LaunchOpts *launch) {
+    char **envp = child_envp();
+    TRACE_BEGIN(fork_span);
     pid_t pid = fork();
 
     if (pid < 0) {
-        // Fork error: restore signal mask and return error.
-        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
         perror("fork");
         return -1;
     }
 
     if (pid == 0) {
-        // Child process: restore the signal mask so that signals are received normally.
-        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
-        execvp(cmd[0], cmd);
+        // Child process: unblock SIGCHLD so the command sees signals normally.
+        jobs_child_setup();
+        if (in_fd != -1 && in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) == -1) {
+            _exit(1);
+        }
+        if (out_fd != -1 && out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) == -1) {
+            _exit(1);
+        }
+        if (apply_redirects(redirs) == -1) {
+            _exit(1);
+        }
+        TRACE_INSTANT("exec", argv[0]);
+        trace_flush();
+        // Limits go last: a memory cap must not starve the shell's own code
+        if (launch != NULL && launch_apply(launch) == -1) {
+            perror("run");
+            _exit(1);
+        }
+        execvpe(argv[0], argv, envp);
         // If execvp returns, there was an error.
         perror("execvp");
         _exit(1);  // Use _exit to avoid flushing the parent's I/O buffers.
-    } else {
-        // Parent process: safely update bg_processes and bg_count.
-        if (bg_count >= MAX_BG_PROCESSES) {
-            fprintf(stderr, "ERROR: Too many background processes\n");
-            sigprocmask(SIG_SETMASK, &prev_mask, NULL);  // Restore signal mask.
-            return -1;
-        }
-
-        int job_number = bg_count + 1;
-        bg_processes[bg_count].job_number = job_number;
-        bg_processes[bg_count].pid = pid;
-
-        // Concatenate tokens to form the full command string.
-        char cmd_str[1024] = {0};
-        for (int i = 0; cmd[i] != NULL; i++) {
-            size_t remaining_space = sizeof(cmd_str) - strlen(cmd_str) - 1;
-            strncat(cmd_str, cmd[i], remaining_space);
-            if (cmd[i + 1] != NULL) {
-                remaining_space--;
-                strncat(cmd_str, " ", remaining_space);
-            }
-        }
-        strncpy(bg_processes[bg_count].command, cmd_str, sizeof(bg_processes[bg_count].command) - 1);
-        bg_count++;
+    }
+    TRACE_END(fork_span, "fork", argv[0]);
+    return pid;
+}
 
-        // Restore the previous signal mask (unblock SIGCHLD).
-        if (sigprocmask(SIG_SETMASK, &prev_mask, NULL) == -1) {
-            perror("sigprocmask");
+int start_background_process(Command *command) {
+    char **cmd = command->argv;
+    LaunchOpts *launch = NULL;
+    if (strcmp(cmd[0], "run") == 0) {
+        // "run [options] -- cmd &": launch cmd itself with the options
+        launch = malloc(sizeof(LaunchOpts));
+        int start = launch != NULL ? launch_parse(cmd, launch) : -1;
+        if (start == -1) {
+            free(launch);
             return -1;
         }
+        cmd += start;
+    }
 
-        // Display the background job creation message.
-        char message[128];
-        snprintf(message, sizeof(message), "[%d] %d\n", job_number, pid);
-        write(STDOUT_FILENO, message, strlen(message));
+    pid_t pid = spawn_command(cmd, command->redirs, -1, -1, launch);
+    if (pid == -1) {
+        free(launch);
+        return -1;
     }
 
+    // Parent process: SIGCHLD is only consumed from the main loop, so the
+    // job can be registered without racing its own exit.
+    Job *job = job_add(pid, cmd, 0);
+    if (job == NULL) {
+        free(launch);
+        return -1;
+    }
+    job->launch = launch;
+
+    // Display the background job creation message.
+    char message[128];
+    snprintf(message, sizeof(message), "[%d] %d\n", job->job_number, pid);
+    display_message(message);
     return 0; // Success.
 }
 
 
 
 
+// Prints one exported variable as name=value (for_each_variable callback)
+static void print_exported(const VarSlot *slot, void *ctx) {
+    (void)ctx;
+    if (slot->exported) {
+        display_message((char *)slot->key);
+        display_message("=");
+        display_message(slot->value != NULL ? slot->value : "");
+        display_message("\n");
+    }
+}
+
+/*
+ * bn_export - Builtin function for the "export" command.
+ *
+ * Usage: export [name[=value] ...]
+ *  - Marks each name as exported so spawned commands see it in their
+ *    environment, assigning value first when one is given.
+ *  - Without arguments, lists the exported variables.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_export(char **tokens) {
+    if (tokens[1] == NULL) {
+        for_each_variable(print_exported, NULL);
+        return 0;
+    }
+
+    for (int i = 1; tokens[i] != NULL; i++) {
+        char *equal_sign = strchr(tokens[i], '=');
+        if (equal_sign != NULL) {
+            *equal_sign = '\0';
+        }
+        size_t name_len = strlen(tokens[i]);
+        int valid = name_len > 0 && !isdigit((unsigned char)tokens[i][0]);
+        for (size_t j = 0; j < name_len; j++) {
+            valid = valid && (isalnum((unsigned char)tokens[i][j]) || tokens[i][j] == '_');
+        }
+        if (!valid) {
+            display_error("ERROR: Invalid variable name: ", tokens[i]);
+            return -1;
+        }
+        if (equal_sign != NULL) {
+            set_variable(tokens[i], equal_sign + 1);
+        }
+        if (export_variable(tokens[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
 // Function to check if a string represents a valid integer
 int is_number(const char *str) {
     for (int i = 0; str[i] != '\0'; i++) {
@@ -607,8 +1035,7 @@ int is_number(const char *str) {
 
 ssize_t handle_kill_command(char **tokens) { 
     if (tokens[1] == NULL) {
-        fprintf(stderr, "ERROR: Invalid usage. Format: kill [pid] [signum]\n");
-	fflush(stderr);
+        display_error("ERROR: Invalid usage. Format: kill [pid] [signum]", "");
         return -1;
     }
 
@@ -633,11 +1060,9 @@ ssize_t handle_kill_command(char **tokens) {
 
     if (kill(pid, signum) == -1) {
         if (errno == ESRCH) {
-            fprintf(stderr, "ERROR: The process does not exist\n");;
-	    fflush(stderr);
+            display_error("ERROR: The process does not exist", "");
         } else if (errno == EPERM) {
-            fprintf(stderr, "ERROR: Permission denied\n");
-	    fflush(stderr);
+            display_error("ERROR: Permission denied", "");
         } else {
             perror("kill");
         }
@@ -647,34 +1072,418 @@ ssize_t handle_kill_command(char **tokens) {
     return 0;
 }
 
+// Formats a size in KiB as e.g. "812K", "3.4M" or "1.2G"
+static void format_kb(char *buf, size_t size, long kb) {
+    if (kb < 1024) {
+        snprintf(buf, size, "%ldK", kb);
+    } else if (kb < 1024 * 1024) {
+        snprintf(buf, size, "%.1fM", kb / 1024.0);
+    } else {
+        snprintf(buf, size, "%.1fG", kb / (1024.0 * 1024.0));
+    }
+}
+
+// Prints one process of a job's tree (proc_sample_tree callback)
+static void print_proc_row(const ProcInfo *info, void *ctx) {
+    Job *job = ctx;
+    char label[16] = "";
+    char rss[24];           // Fits any long in KiB, sign and suffix included
+    char line[128];
+    if (info->depth == 0) {
+        snprintf(label, sizeof(label), "[%d]", job->job_number);
+    }
+    format_kb(rss, sizeof(rss), info->rss_kb);
+    snprintf(line, sizeof(line), "%-5s %7d %7d %c %4ld %6.1f %7s  %*s",
+             label, info->pid, info->ppid, info->state, info->threads, info->cpu, rss,
+             info->depth * 2, "");
+    display_message(line);
+    display_message(info->depth == 0 ? job->command : (char *)info->comm);
+    display_message("\n");
+}
+
+// Prints a background job and its descendants (jobs_for_each callback)
+static void print_job(Job *job, void *ctx) {
+    (void)ctx;
+    if (job->flags & JOB_QUIET) {
+        return;
+    }
+    if (proc_sample_tree(job->pid, print_proc_row, job) == 0) {
+        // Exited, but not reaped yet
+        char line[64];
+        snprintf(line, sizeof(line), "[%d]   %7d       - X    -      -       -  ", job->job_number, job->pid);
+        display_message(line);
+        display_message(job->command);
+        display_message("\n");
+    }
+}
+
+// Samples /proc and prints the table of running jobs
+static void print_job_table(void) {
+    proc_sample_begin();
+    display_message("JOB       PID    PPID S  THR   CPU%     RSS  COMMAND\n");
+    jobs_for_each(print_job, NULL);
+    proc_sample_end();
+}
+
+// Prints one finished job as "command pid <usage>" (jobs_for_each_finished callback)
+static void print_finished_job(Job *job, void *ctx) {
+    (void)ctx;
+    char usage[USAGE_STR_LEN];
+    char line[USAGE_STR_LEN + 64];
+    format_usage(usage, sizeof(usage), job->status, &job->usage);
+    snprintf(line, sizeof(line), " %d %s wall %.3fs\n", job->pid, usage, job->wall);
+    display_message(job->command);
+    display_message(line);
+}
+
 // Function to handle the `ps` command
 ssize_t handle_ps_command(char **tokens) {
-    char message[1100]; 
     (void)tokens; // Suppress unused parameter warning since `ps` has no arguments
 
-    if (bg_count == 0) {
+    if (jobs_count() == 0 && jobs_finished_count() == 0) {
         display_message("No background processes.\n");
         return 0;
     }
 
-    // Iterate over background processes and display their details
-    for (int i = 0; i < bg_count; i++) {
-        snprintf(message, sizeof(message), "%s %d\n", bg_processes[i].command, bg_processes[i].pid);
-        display_message(message);
+    // Iterate over background processes and display their details, then
+    // the resource usage of finished jobs nobody has waited for yet.
+    if (jobs_count() > 0) {
+        print_job_table();
     }
+    jobs_for_each_finished(print_finished_job, NULL);
 
     return 0; // Success
 }
 
+/*
+ * bn_top - Builtin function for the "top" command.
+ *
+ * Usage: top [-d seconds] [-n iterations]
+ *  - Redraws the ps table every -d seconds (default 1), with CPU% measured
+ *    over each interval, until every job has exited, -n refreshes have
+ *    been shown or Ctrl-C is pressed.
+ *  - Jobs that finish are reaped (and reported) as soon as they exit.
+ *
+ * Returns 0 on success and -1 on invalid options.
+ */
+ssize_t bn_top(char **tokens) {
+    double delay = 1.0;
+    long iterations = -1;
+    for (int i = 1; tokens[i] != NULL; i += 2) {
+        if (tokens[i + 1] == NULL) {
+            display_error("ERROR: Missing value for: ", tokens[i]);
+            return -1;
+        }
+        if (strcmp(tokens[i], "-d") == 0) {
+            delay = atof(tokens[i + 1]);
+            if (delay <= 0) {
+                display_error("ERROR: Invalid delay: ", tokens[i + 1]);
+                return -1;
+            }
+        } else if (strcmp(tokens[i], "-n") == 0 && is_number(tokens[i + 1]) && atol(tokens[i + 1]) > 0) {
+            iterations = atol(tokens[i + 1]);
+        } else {
+            display_error("ERROR: Invalid option: ", tokens[i]);
+            return -1;
+        }
+    }
+
+    int clear = isatty(io_out_fd);
+    struct pollfd pfd = {.fd = jobs_event_fd(), .events = POLLIN};
+    jobs_reap();    // Drain stale SIGCHLDs (e.g. from foreground commands)
+    while (jobs_count() > 0 && iterations != 0) {
+        if (clear) {
+            display_message("\033[H\033[J");
+        }
+        char title[64];
+        snprintf(title, sizeof(title), "mysh top: %zu jobs, every %.1fs\n", jobs_count(), delay);
+        display_message(title);
+        print_job_table();
+        out_flush(io_out_fd);
+        if (iterations > 0) {
+            iterations--;
+        }
+        if (iterations == 0) {
+            break;
+        }
+
+        // Sleep until the next refresh; a child exiting refreshes early
+        int ready = poll(&pfd, 1, (int)(delay * 1000));
+        if (ready == -1) {
+            break;  // Interrupted (Ctrl-C)
+        }
+        if (ready > 0) {
+            jobs_reap();
+        }
+    }
+    if (jobs_count() == 0) {
+        display_message("No background processes.\n");
+    }
+    return 0;
+}
+
+// Prints "[N]  Running  command" for a live job (jobs_for_each callback)
+static void print_running_job(Job *job, void *ctx) {
+    (void)ctx;
+    if (job->flags & JOB_QUIET) {
+        return;
+    }
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "[%d]  Running  ", job->job_number);
+    display_message(prefix);
+    display_message(job->command);
+    if (job->launch != NULL) {
+        char launch[CPU_LIST_LEN + 64];
+        format_launch(launch, sizeof(launch), job->launch);
+        display_message("  (");
+        display_message(launch);
+        display_message(")");
+    }
+    display_message("\n");
+}
+
+// Prints "[N]  Done  <usage>  command" for a finished job
+static void print_done_job(Job *job, void *ctx) {
+    (void)ctx;
+    char usage[USAGE_STR_LEN];
+    char line[USAGE_STR_LEN + 64];
+    format_usage(usage, sizeof(usage), job->status, &job->usage);
+    snprintf(line, sizeof(line), "[%d]  Done  %s wall %.3fs  ", job->job_number, usage, job->wall);
+    display_message(line);
+    display_message(job->command);
+    display_message("\n");
+}
+
+/*
+ * bn_jobs - Builtin function for the "jobs" command.
+ *
+ * Usage: jobs
+ * Lists running background jobs, then the finished ones not yet reported
+ * along with their CPU time, max RSS, context switches and block I/O.
+ * Finished jobs are forgotten once listed.
+ */
+ssize_t bn_jobs(char **tokens) {
+    (void)tokens;
+    jobs_for_each(print_running_job, NULL);
+    jobs_for_each_finished(print_done_job, NULL);
+    jobs_clear_finished();
+    return 0;
+}
+
+/*
+ * bn_wait - Builtin function for the "wait" command.
+ *
+ * Usage: wait [%job|pid ...]
+ *  - Without arguments, waits for every background job.
+ *  - Otherwise waits for each given job (by number with %N, or by pid).
+ * Each waited job is reported with its exit status and resource usage.
+ *
+ * Returns 0 on success and -1 if a job is unknown.
+ */
+ssize_t bn_wait(char **tokens) {
+    if (tokens[1] == NULL) {
+        while (jobs_count() > 0) {
+            jobs_wait_event();
+        }
+        jobs_for_each_finished(print_done_job, NULL);
+        jobs_clear_finished();
+        return 0;
+    }
+
+    for (int i = 1; tokens[i] != NULL; i++) {
+        int job_number = -1;
+        pid_t pid = -1;
+        if (tokens[i][0] == '%' && tokens[i][1] != '\0' && is_number(tokens[i] + 1)) {
+            job_number = atoi(tokens[i] + 1);
+        } else if (tokens[i][0] != '\0' && is_number(tokens[i])) {
+            pid = atoi(tokens[i]);
+        } else {
+            display_error("ERROR: Invalid job: ", tokens[i]);
+            return -1;
+        }
+
+        jobs_lock();
+        Job *job = job_number > 0 ? job_find_number(job_number) : job_find_pid(pid);
+        int wait = job != NULL && !(job->flags & JOB_QUIET);
+        if (wait) {
+            pid = job->pid;
+            job_number = -1;    // The number may be recycled once the job finishes
+        }
+        jobs_unlock();
+        while (wait && job_find_pid(pid) != NULL) {
+            jobs_wait_event();
+        }
+
+        // Another thread may list (and forget) finished jobs meanwhile
+        jobs_lock();
+        Job *finished = job_find_finished(pid, job_number);
+        if (finished != NULL) {
+            print_done_job(finished, NULL);
+            job_forget(finished);
+        }
+        jobs_unlock();
+        if (finished == NULL) {
+            display_error("ERROR: No such job: ", tokens[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * bn_run - Builtin function for the "run" command.
+ *
+ * Usage: run [--cpus LIST] [--nice N] [--mem SIZE] [--] command [args...] [&]
+ *  - Runs command pinned to the CPUs in LIST (e.g. "2-5" or "0,3"), at nice
+ *    value N and with its address space limited to SIZE (e.g. 512M, 2G).
+ *  - With a trailing '&' the command becomes a background job that keeps
+ *    these attributes; see jobs and pin.
+ *
+ * Returns 0 if the command succeeded and -1 otherwise.
+ */
+ssize_t bn_run(char **tokens) {
+    LaunchOpts launch;
+    int start = launch_parse(tokens, &launch);
+    if (start == -1) {
+        return -1;
+    }
+    out_flush(io_out_fd);
+    pid_t pid = spawn_command(tokens + start, NULL, io_in_fd, io_out_fd, &launch);
+    if (pid == -1) {
+        return -1;
+    }
+    int status;
+    struct rusage usage;
+    if (wait_child(pid, &status, &usage) == -1) {
+        perror("wait4");
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+typedef struct {
+    cpu_set_t cpus;
+    int failed;
+} PinRequest;
+
+// Re-pins one process of a job's tree (proc_sample_tree callback)
+static void pin_tree_process(const ProcInfo *info, void *ctx) {
+    PinRequest *req = ctx;
+    if (pin_process(info->pid, &req->cpus) == -1) {
+        char pid_str[32];
+        snprintf(pid_str, sizeof(pid_str), "%d", info->pid);
+        display_error("ERROR: Could not pin process: ", pid_str);
+        req->failed = 1;
+    }
+}
+
+/*
+ * bn_pin - Builtin function for the "pin" command.
+ *
+ * Usage: pin %job|pid LIST
+ *  - Moves every thread of a running background job, and of the processes
+ *    it has started, to the CPUs in LIST.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_pin(char **tokens) {
+    if (tokens[1] == NULL || tokens[2] == NULL || tokens[3] != NULL) {
+        display_error("ERROR: Usage: pin %job|pid cpu-list", "");
+        return -1;
+    }
+    PinRequest req = {.failed = 0};
+    if (parse_cpu_list(tokens[2], &req.cpus) == -1) {
+        display_error("ERROR: Invalid CPU list: ", tokens[2]);
+        return -1;
+    }
+
+    // Held throughout, so the job cannot be reaped from under us
+    jobs_lock();
+    Job *job = NULL;
+    if (tokens[1][0] == '%' && tokens[1][1] != '\0' && is_number(tokens[1] + 1)) {
+        job = job_find_number(atoi(tokens[1] + 1));
+    } else if (tokens[1][0] != '\0' && is_number(tokens[1])) {
+        job = job_find_pid(atoi(tokens[1]));
+    }
+    if (job == NULL || (job->flags & JOB_QUIET)) {
+        jobs_unlock();
+        display_error("ERROR: No such job: ", tokens[1]);
+        return -1;
+    }
+
+    proc_sample_begin();
+    size_t pinned = proc_sample_tree(job->pid, pin_tree_process, &req);
+    proc_sample_end();
+    if (pinned == 0 && pin_process(job->pid, &req.cpus) == -1) {
+        jobs_unlock();
+        perror("sched_setaffinity");
+        return -1;
+    }
+    if (!req.failed && job->launch == NULL) {
+        job->launch = calloc(1, sizeof(LaunchOpts));
+    }
+    if (!req.failed && job->launch != NULL) {
+        job->launch->has_cpus = 1;
+        job->launch->cpus = req.cpus;
+    }
+    jobs_unlock();
+    return req.failed ? -1 : 0;
+}
+
+/*
+ * bn_trace - Builtin function for the "trace" command.
+ *
+ * Usage: trace on [file] | trace off | trace
+ *  - "on" appends Chrome trace-event JSON to file (default: $MYSH_TRACE,
+ *    else mysh-trace.json); load it in chrome://tracing or Perfetto.
+ *  - "off" flushes the buffered events and stops tracing.
+ *  - Without arguments, prints whether tracing is on and where to.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+ssize_t bn_trace(char **tokens) {
+    if (tokens[1] == NULL) {
+        const char *path = trace_path();
+        display_message(path != NULL ? "trace: on: " : "trace: off");
+        if (path != NULL) {
+            display_message((char *)path);
+        }
+        display_message("\n");
+        return 0;
+    }
+    if (strcmp(tokens[1], "off") == 0 && tokens[2] == NULL) {
+        trace_stop();
+        return 0;
+    }
+    if (strcmp(tokens[1], "on") != 0 || (tokens[2] != NULL && tokens[3] != NULL)) {
+        display_error("ERROR: Usage: trace on [file] | trace off", "");
+        return -1;
+    }
+
+    const char *path = tokens[2];
+    if (path == NULL) {
+        path = get_variable("MYSH_TRACE");
+    }
+    if (path[0] == '\0') {
+        path = "mysh-trace.json";
+    }
+    return trace_start(path);
+}
+
 
 /**
  * Executes a system command by searching in /bin, /usr/bin, or other
  * directories in the PATH environment variable.
  * 
- * @param cmd Array of command and arguments (e.g., {"ls", "-l", NULL}).
+ * @param command Command to run: argv (e.g., {"ls", "-l", NULL}) and its redirections.
  * @return 0 on success, -1 on failure.
  */
-int execute_system_command(char **cmd) {
+int execute_system_command(Command *command) {
+    char **cmd = command->argv;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    char **envp = child_envp();
+    TRACE_BEGIN(fork_span);
     pid_t pid = fork();
 
     if (pid < 0) {
@@ -684,16 +1493,29 @@ int execute_system_command(char **cmd) {
     }
 
     if (pid == 0) {
-        // In the child process: execute the command
-        execvp(cmd[0], cmd);
+        // In the child process: apply redirections and execute the command
+        jobs_child_setup();
+        if (apply_redirects(command->redirs) == -1) {
+            exit(1);
+        }
+        TRACE_INSTANT("exec", cmd[0]);
+        trace_flush();
+        execvpe(cmd[0], cmd, envp);
         exit(1); // Exit child process on failure
     } else {
         // In the parent process: wait for the child process to finish
+        profile_add_spawn(&started);
+        TRACE_END(fork_span, "fork", cmd[0]);
+        struct timespec waiting;
+        struct rusage usage;
         int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
+        clock_gettime(CLOCK_MONOTONIC, &waiting);
+        if (wait_child(pid, &status, &usage) == -1) {
+            perror("wait4");
             return -1;
         }
+        profile_add_wait(&waiting);
+        profile_stage(0, status, &usage, &started);
         // Check if the child process exited successfully
         if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
             return 0; // Success
@@ -708,7 +1530,7 @@ extern void run_server(int port);
 
 ssize_t start_server_builtin(char **tokens) {
     if (tokens[1] == NULL) {
-        write(STDERR_FILENO, "ERROR: No port provided\n", 24);
+        display_error("ERROR: No port provided", "");
         return -1;
     }
 
@@ -726,6 +1548,7 @@ ssize_t start_server_builtin(char **tokens) {
 
     if (pid == 0) {
         // Child process: detach and run the server.
+        jobs_child_setup();
         setsid();
         signal(SIGINT, SIG_IGN);
         run_server(port);
@@ -733,7 +1556,9 @@ ssize_t start_server_builtin(char **tokens) {
     } else {
         // Save the server's PID to our static variable.
         server_pid = pid;
-        printf("Server started on port %d with PID %d\n", port, pid);
+        char message[128];
+        snprintf(message, sizeof(message), "Server started on port %d with PID %d\n", port, pid);
+        display_message(message);
     }
     return 0;
 }
@@ -750,7 +1575,7 @@ ssize_t close_server_builtin(char **tokens) {
 
     if (server_pid == 0) {
         // No server has been started.
-        write(STDERR_FILENO, "ERROR: No server is running\n", 29);
+        display_error("ERROR: No server is running", "");
         return -1;
     }
 
@@ -760,8 +1585,14 @@ ssize_t close_server_builtin(char **tokens) {
         return -1;
     }
 
-    printf("Server with PID %d terminated.\n", server_pid);
-    // Optionally, you could wait for the process to finish cleanup here.
+    // The server is not a job, so nothing else reaps it
+    int status;
+    struct rusage usage;
+    wait_child(server_pid, &status, &usage);
+
+    char message[128];
+    snprintf(message, sizeof(message), "Server with PID %d terminated.\n", server_pid);
+    display_message(message);
     server_pid = 0;   // Reset the server PID
     return 0;
 }
@@ -783,18 +1614,18 @@ ssize_t close_server_builtin(char **tokens) {
 ssize_t send_builtin(char **tokens) {
     // Error-checking for port number.
     if (tokens[1] == NULL) {
-        write(STDERR_FILENO, "ERROR: No port provided\n", 24);
+        display_error("ERROR: No port provided", "");
         return -1;
     }
     // Error-checking for hostname.
     if (tokens[2] == NULL) {
-        write(STDERR_FILENO, "ERROR: No hostname provided\n", 28);
+        display_error("ERROR: No hostname provided", "");
         return -1;
     }
 
     int port = atoi(tokens[1]);
     if (port <= 0) {
-        fprintf(stderr, "ERROR: Invalid port number: %s\n", tokens[1]);
+        display_error("ERROR: Invalid port number: ", tokens[1]);
         return -1;
     }
 
@@ -802,16 +1633,28 @@ ssize_t send_builtin(char **tokens) {
 
     // Verify that a message is provided.
     if (tokens[3] == NULL) {
-        write(STDERR_FILENO, "ERROR: No message provided\n", 27);
+        display_error("ERROR: No message provided", "");
         return -1;
     }
 
-    // Construct the message by concatenating tokens from index 3 onward.
-    char message[1024] = "";
+    // Construct the message by joining tokens from index 3 onward with
+    // spaces; lines are not length limited, so it is sized to fit.
+    size_t message_len = 0;
     for (int i = 3; tokens[i] != NULL; i++) {
-        strcat(message, tokens[i]);
+        message_len += strlen(tokens[i]) + 1;
+    }
+    char *message = malloc(message_len);
+    if (message == NULL) {
+        display_error("ERROR: Memory allocation failed for message", "");
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 3; tokens[i] != NULL; i++) {
+        size_t n = strlen(tokens[i]);
+        memcpy(message + len, tokens[i], n);
+        len += n;
         if (tokens[i + 1] != NULL) {  // Add a space if this is not the last token.
-            strcat(message, " ");
+            message[len++] = ' ';
         }
     }
 
@@ -819,14 +1662,16 @@ ssize_t send_builtin(char **tokens) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket");
+        free(message);
         return -1;
     }
 
     // Resolve the hostname.
     struct hostent *server = gethostbyname(hostname);
     if (server == NULL) {
-        fprintf(stderr, "ERROR: No such host: %s\n", hostname);
+        display_error("ERROR: No such host: ", hostname);
         close(sockfd);
+        free(message);
         return -1;
     }
 
@@ -842,18 +1687,28 @@ ssize_t send_builtin(char **tokens) {
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         perror("connect");
         close(sockfd);
+        free(message);
         return -1;
     }
 
-    // Send the message.
-    if (send(sockfd, message, strlen(message), 0) < 0) {
-        perror("send");
-        close(sockfd);
-        return -1;
+    // Send the message; a long one may take several sends.
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = send(sockfd, message + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("send");
+            close(sockfd);
+            free(message);
+            return -1;
+        }
+        sent += n;
     }
 
     // Close the socket after sending.
     close(sockfd);
+    free(message);
 
     return 0;
 }
@@ -887,8 +1742,8 @@ static void *receive_thread(void *arg) {
         }
         buffer[n] = '\0';
         // Print any received data.
-        printf("%s", buffer);
-        fflush(stdout);
+        out_write(io_out_fd, buffer, n);
+        out_flush(io_out_fd);
     }
     return NULL;
 }
@@ -911,17 +1766,17 @@ static void *receive_thread(void *arg) {
 ssize_t start_client_builtin(char **tokens) {
     // Error-check parameters.
     if (tokens[1] == NULL) {
-        write(STDERR_FILENO, "ERROR: No port provided\n", 24);
+        display_error("ERROR: No port provided", "");
         return -1;
     }
     if (tokens[2] == NULL) {
-        write(STDERR_FILENO, "ERROR: No hostname provided\n", 28);
+        display_error("ERROR: No hostname provided", "");
         return -1;
     }
 
     int port = atoi(tokens[1]);
     if (port <= 0) {
-        fprintf(stderr, "ERROR: Invalid port number: %s\n", tokens[1]);
+        display_error("ERROR: Invalid port number: ", tokens[1]);
         return -1;
     }
     char *hostname = tokens[2];
@@ -936,7 +1791,7 @@ ssize_t start_client_builtin(char **tokens) {
     // Resolve the hostname.
     struct hostent *server = gethostbyname(hostname);
     if (server == NULL) {
-        fprintf(stderr, "ERROR: No such host: %s\n", hostname);
+        display_error("ERROR: No such host: ", hostname);
         close(sockfd);
         return -1;
     }
@@ -967,7 +1822,8 @@ ssize_t start_client_builtin(char **tokens) {
     }
     welcome[n] = '\0';
     // Print the welcome message.
-    printf("%s", welcome);
+    display_message(welcome);
+    out_flush(io_out_fd);
 
     // Extract the client ID prefix from the welcome message.
     // We expect the welcome message to start with "You are clientX:"
@@ -1002,7 +1858,7 @@ ssize_t start_client_builtin(char **tokens) {
         size_t total_len = client_prefix_len + input_len + 2; // +2 for space and newline.
 
         if (total_len >= CLIENT_BUFFER_SIZE) {
-            fprintf(stderr, "ERROR: Message too long\n");
+            display_error("ERROR: Message too long", "");
             break;
         }
 
@@ -3,6 +3,11 @@
 
 #include <unistd.h>
 
+struct Redirect;
+struct Command;
+struct Pipeline;
+struct LaunchOpts;
+
 
 /* Type for builtin handling functions
  * Input: Array of tokens
@@ -14,11 +19,22 @@ ssize_t bn_ls(char **tokens);
 ssize_t bn_cd(char **tokens);
 ssize_t bn_cat(char **tokens);
 ssize_t bn_wc(char **tokens);
+ssize_t bn_export(char **tokens);
 ssize_t start_server_builtin(char **tokens);
 ssize_t close_server_builtin(char **tokens);
 ssize_t send_builtin(char **tokens);
 ssize_t start_client_builtin(char **tokens);
-void sigchld_handler(int signum);
+ssize_t bn_parallel(char **tokens);
+ssize_t bn_jobs(char **tokens);
+ssize_t bn_wait(char **tokens);
+ssize_t bn_trace(char **tokens);
+ssize_t bn_top(char **tokens);
+ssize_t bn_run(char **tokens);
+ssize_t bn_pin(char **tokens);
+ssize_t bn_find(char **tokens);
+ssize_t bn_grep(char **tokens);
+ssize_t bn_sort(char **tokens);
+ssize_t bn_uniq(char **tokens);
 void sigint_handler(int signum);
 ssize_t handle_kill_command(char **tokens);
 ssize_t handle_ps_command(char **tokens);
@@ -29,11 +45,27 @@ ssize_t handle_ps_command(char **tokens);
 bn_ptr check_builtin(const char *cmd);
 
 
+/* Executors for parsed commands (see run_pipeline)
+ */
+int execute_system_command(struct Command *cmd);
+void execute_pipeline(struct Pipeline *pl);
+int start_background_process(struct Command *cmd);
+
+
+/* Forks and execs argv with its redirections applied. When in_fd / out_fd
+ * are not -1 they become the child's stdin / stdout first; launch (if not
+ * NULL) sets the child's affinity, nice value and limits before exec.
+ * Return: pid of the child, or -1 if fork failed
+ */
+pid_t spawn_command(char **argv, const struct Redirect *redirs, int in_fd, int out_fd,
+                    const struct LaunchOpts *launch);
+
+
 /* BUILTINS and BUILTINS_FN are parallel arrays of length BUILTINS_COUNT
  */
-static const char * const BUILTINS[] = {"echo", "ls", "cd", "cat", "wc", "kill", "ps", "start-server", "close-server", "send", "start-client"};
+static const char * const BUILTINS[] = {"echo", "ls", "cd", "cat", "wc", "kill", "ps", "start-server", "close-server", "send", "start-client", "export", "parallel", "jobs", "wait", "trace", "top", "run", "pin", "find", "grep", "sort", "uniq"};
 
-static const bn_ptr BUILTINS_FN[] = {bn_echo, bn_ls, bn_cd, bn_cat, bn_wc, handle_kill_command,handle_ps_command,start_server_builtin, close_server_builtin,send_builtin, start_client_builtin, NULL}; // Extra null element for 'non-builtin'
+static const bn_ptr BUILTINS_FN[] = {bn_echo, bn_ls, bn_cd, bn_cat, bn_wc, handle_kill_command,handle_ps_command,start_server_builtin, close_server_builtin,send_builtin, start_client_builtin, bn_export, bn_parallel, bn_jobs, bn_wait, bn_trace, bn_top, bn_run, bn_pin, bn_find, bn_grep, bn_sort, bn_uniq, NULL}; // Extra null element for 'non-builtin'
 
 static const ssize_t BUILTINS_COUNT = sizeof(BUILTINS) / sizeof(char *);
 
@@ -0,0 +1,384 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "builtins.h"
+#include "commands.h"
+#include "io_helpers.h"
+#include "trace.h"
+
+
+// ===== Parsing =====
+
+/* Return: open() flags for a redirection token, or -1 if tok is not one
+ */
+static int redirect_flags(TokenType type, int *fd) {
+    switch (type) {
+        case TOK_REDIR_IN:
+            *fd = STDIN_FILENO;
+            return O_RDONLY;
+        case TOK_REDIR_OUT:
+            *fd = STDOUT_FILENO;
+            return O_WRONLY | O_CREAT | O_TRUNC;
+        case TOK_REDIR_APPEND:
+            *fd = STDOUT_FILENO;
+            return O_WRONLY | O_CREAT | O_APPEND;
+        case TOK_REDIR_ERR:
+            *fd = STDERR_FILENO;
+            return O_WRONLY | O_CREAT | O_TRUNC;
+        case TOK_REDIR_ERR_APPEND:
+            *fd = STDERR_FILENO;
+            return O_WRONLY | O_CREAT | O_APPEND;
+        default:
+            return -1;
+    }
+}
+
+/* Prereq: words holds the materialized text of every token in lx
+ * Return: pipeline allocated in arena, or NULL on a syntax error
+ */
+Pipeline *parse_pipeline(Arena *arena, Lexer *lx, char **words) {
+    size_t count = lx->count;
+    Pipeline *pl = arena_alloc(arena, sizeof(Pipeline));
+    if (pl == NULL) {
+        return NULL;
+    }
+    pl->background = 0;
+    if (count > 0 && lx->toks[count - 1].type == TOK_AMP) {
+        pl->background = 1;
+        count--;
+    }
+
+    size_t stages = 1;
+    for (size_t i = 0; i < count; i++) {
+        if (lx->toks[i].type == TOK_PIPE) {
+            stages++;
+        }
+    }
+    pl->cmds = arena_alloc(arena, stages * sizeof(Command));
+    // Every stage's argv is carved out of one array: words plus a NULL per stage.
+    char **argv = arena_alloc(arena, (count + stages) * sizeof(char *));
+    if (pl->cmds == NULL || argv == NULL) {
+        return NULL;
+    }
+    pl->count = stages;
+
+    Command *cmd = pl->cmds;
+    Redirect **redir_tail = &cmd->redirs;
+    cmd->argv = argv;
+    cmd->argc = 0;
+    cmd->redirs = NULL;
+    cmd->assignment = 0;
+    for (size_t i = 0; i < count; i++) {
+        TokenType type = lx->toks[i].type;
+        if (type == TOK_WORD) {
+            // Decided on the raw word: expanded text may hold an '=' of its own
+            cmd->assignment |= cmd->argc == 0 && (lx->toks[i].flags & TOKF_ASSIGN);
+            cmd->argv[cmd->argc++] = words[i];
+            continue;
+        }
+        if (type != TOK_PIPE) {
+            Redirect *r = arena_alloc(arena, sizeof(Redirect));
+            if (r == NULL) {
+                return NULL;
+            }
+            r->flags = redirect_flags(type, &r->fd);
+            if (r->flags == -1 || i + 1 == count || lx->toks[i + 1].type != TOK_WORD) {
+                display_error("ERROR: Syntax error near: ", words[i]);
+                return NULL;
+            }
+            r->path = words[++i];
+            r->next = NULL;
+            *redir_tail = r;
+            redir_tail = &r->next;
+            continue;
+        }
+        if (cmd->argc == 0) {
+            display_error("ERROR: Syntax error near: ", "|");
+            return NULL;
+        }
+        cmd->argv[cmd->argc] = NULL;
+        argv += cmd->argc + 1;
+        cmd++;
+        cmd->argv = argv;
+        cmd->argc = 0;
+        cmd->redirs = NULL;
+        cmd->assignment = 0;
+        redir_tail = &cmd->redirs;
+    }
+    cmd->argv[cmd->argc] = NULL;
+    if (cmd->argc == 0) {
+        display_error("ERROR: Syntax error near: ", pl->count > 1 ? "|" : "&");
+        return NULL;
+    }
+    return pl;
+}
+
+
+// ===== Redirections =====
+
+/* Opens every redirection target and dup2()s it over its descriptor. Meant
+ * for forked children, where nothing has to be restored.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int apply_redirects(const Redirect *redirs) {
+    for (const Redirect *r = redirs; r != NULL; r = r->next) {
+        int fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", (char *)r->path);
+            return -1;
+        }
+        if (fd != r->fd) {
+            if (dup2(fd, r->fd) == -1) {
+                perror("dup2");
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        } else {
+            fcntl(fd, F_SETFD, 0);  // Keep it open across exec
+        }
+    }
+    return 0;
+}
+
+/* Opens every redirection target into fds (indexed by the descriptor it
+ * replaces) without touching the process's own descriptors; used for
+ * builtins running on worker threads. Entries above 2 belong to the
+ * caller, so any that get replaced are closed.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int open_redirects(const Redirect *redirs, int fds[MAX_SAVED_FDS]) {
+    for (const Redirect *r = redirs; r != NULL; r = r->next) {
+        int fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", (char *)r->path);
+            return -1;
+        }
+        if (fds[r->fd] > STDERR_FILENO) {
+            close(fds[r->fd]);
+        }
+        fds[r->fd] = fd;
+    }
+    return 0;
+}
+
+/* Applies redirs in the shell process, remembering the original descriptors
+ * in saved. Must be paired with redirect_end even on failure.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int redirect_begin(const Redirect *redirs, SavedFds *saved) {
+    saved->count = 0;
+    if (redirs == NULL) {
+        return 0;
+    }
+    out_flush_all();
+    fflush(stdout);
+    fflush(stderr);
+
+    for (const Redirect *r = redirs; r != NULL; r = r->next) {
+        int already_saved = 0;
+        for (int i = 0; i < saved->count; i++) {
+            already_saved |= saved->fd[i] == r->fd;
+        }
+        if (!already_saved && saved->count < MAX_SAVED_FDS) {
+            saved->fd[saved->count] = r->fd;
+            saved->saved[saved->count] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+            saved->count++;
+        }
+    }
+    return apply_redirects(redirs);
+}
+
+/* Restores the descriptors saved by redirect_begin.
+ */
+void redirect_end(SavedFds *saved) {
+    out_flush_all();
+    if (saved->count == 0) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = saved->count - 1; i >= 0; i--) {
+        if (saved->saved[i] == -1) {
+            close(saved->fd[i]);  // It was closed before the redirection
+            continue;
+        }
+        dup2(saved->saved[i], saved->fd[i]);
+        close(saved->saved[i]);
+        if (saved->fd[i] == STDIN_FILENO) {
+            clearerr(stdin);  // The builtin may have read the file to EOF
+        }
+    }
+    saved->count = 0;
+}
+
+
+// ===== Execution =====
+
+/* Runs a parsed command line: a background job, a pipeline, a builtin in
+ * the shell process or an external command.
+ */
+void run_pipeline(Pipeline *pl) {
+    if (pl->background) {
+        // Background process detected
+        if (pl->count > 1) {
+            display_error("ERROR: Background pipelines are not supported", "");
+        } else {
+            start_background_process(&pl->cmds[0]);
+        }
+        return;
+    }
+    if (pl->count > 1) {
+        execute_pipeline(pl);
+        return;
+    }
+
+    char **cmd = pl->cmds[0].argv;
+    //check for a built-in function
+    TRACE_BEGIN(lookup_span);
+    bn_ptr builtin_fn = check_builtin(cmd[0]);
+    TRACE_END(lookup_span, "check_builtin", cmd[0]);
+    if (builtin_fn == NULL) {
+        if (execute_system_command(&pl->cmds[0]) == -1) {
+            display_error("ERROR: Unknown command: ", cmd[0]);
+        }
+        return;
+    }
+
+    // Builtins run in the shell, so redirect with an fd swap
+    struct timespec started;
+    struct rusage before;
+    if (exec_profile != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        getrusage(RUSAGE_SELF, &before);
+    }
+    SavedFds saved;
+    ssize_t err = -1;
+    TRACE_BEGIN(builtin_span);
+    if (redirect_begin(pl->cmds[0].redirs, &saved) == 0) {
+        err = builtin_fn(cmd);
+    }
+    redirect_end(&saved);
+    TRACE_END(builtin_span, "builtin", cmd[0]);
+    if (exec_profile != NULL) {
+        profile_builtin(0, err, RUSAGE_SELF, &before, &started);
+    }
+    if (err == -1) {
+        display_error("ERROR: Builtin failed: ", cmd[0]);
+    }
+}
+
+
+// ===== Profiling =====
+
+ExecProfile *exec_profile = NULL;
+
+/* Return: seconds elapsed on CLOCK_MONOTONIC since *since
+ */
+double seconds_since(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Prepares profile to time pl (stage names, zeroed counters) in arena.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int profile_init(ExecProfile *profile, Arena *arena, const Pipeline *pl) {
+    profile->stages = arena_alloc(arena, pl->count * sizeof(StageProfile));
+    if (profile->stages == NULL) {
+        return -1;
+    }
+    memset(profile->stages, 0, pl->count * sizeof(StageProfile));
+    profile->count = pl->count;
+    for (size_t i = 0; i < pl->count; i++) {
+        profile->stages[i].name = pl->cmds[i].argv[0];
+    }
+    profile->spawn = 0;
+    profile->wait = 0;
+    return 0;
+}
+
+void profile_add_spawn(const struct timespec *since) {
+    if (exec_profile != NULL) {
+        exec_profile->spawn += seconds_since(since);
+    }
+}
+
+void profile_add_wait(const struct timespec *since) {
+    if (exec_profile != NULL) {
+        exec_profile->wait += seconds_since(since);
+    }
+}
+
+void profile_stage(size_t index, int status, const struct rusage *usage, const struct timespec *started) {
+    if (exec_profile == NULL || index >= exec_profile->count) {
+        return;
+    }
+    StageProfile *stage = &exec_profile->stages[index];
+    stage->status = status;
+    stage->wall = seconds_since(started);
+    stage->usage = *usage;
+}
+
+void profile_builtin(size_t index, ssize_t err, int who, const struct rusage *before, const struct timespec *started) {
+    if (exec_profile == NULL || index >= exec_profile->count) {
+        return;
+    }
+    struct rusage after;
+    getrusage(who, &after);
+    StageProfile *stage = &exec_profile->stages[index];
+    stage->status = err == -1 ? 1 << 8 : 0;
+    stage->wall = seconds_since(started);
+    stage->usage = after;
+    timersub(&after.ru_utime, &before->ru_utime, &stage->usage.ru_utime);
+    timersub(&after.ru_stime, &before->ru_stime, &stage->usage.ru_stime);
+    stage->usage.ru_nvcsw = after.ru_nvcsw - before->ru_nvcsw;
+    stage->usage.ru_nivcsw = after.ru_nivcsw - before->ru_nivcsw;
+    stage->usage.ru_inblock = after.ru_inblock - before->ru_inblock;
+    stage->usage.ru_oublock = after.ru_oublock - before->ru_oublock;
+}
+
+/* Prints the pipeline totals, every stage and the shell overhead to stderr.
+ */
+void profile_report(ExecProfile *profile) {
+    char line[256];
+    double user = 0, sys = 0;
+    long maxrss = 0;
+    for (size_t i = 0; i < profile->count; i++) {
+        const struct rusage *ru = &profile->stages[i].usage;
+        user += timeval_seconds(&ru->ru_utime);
+        sys += timeval_seconds(&ru->ru_stime);
+        if (ru->ru_maxrss > maxrss) {
+            maxrss = ru->ru_maxrss;
+        }
+    }
+
+    // After the command's own output, buffered like any builtin's
+    out_flush(io_out_fd);
+    snprintf(line, sizeof(line), "real %.6fs  user %.6fs  sys %.6fs  maxrss %ldKB\n",
+             profile->total, user, sys, maxrss);
+    out_write(io_err_fd, line, strlen(line));
+    for (size_t i = 0; i < profile->count; i++) {
+        const StageProfile *stage = &profile->stages[i];
+        snprintf(line, sizeof(line), "  [%zu] %-12.12s real %.6fs  user %.6fs  sys %.6fs  maxrss %ldKB  status %d\n",
+                 i + 1, stage->name, stage->wall,
+                 timeval_seconds(&stage->usage.ru_utime), timeval_seconds(&stage->usage.ru_stime),
+                 stage->usage.ru_maxrss,
+                 WIFSIGNALED(stage->status) ? 128 + WTERMSIG(stage->status) : WEXITSTATUS(stage->status));
+        out_write(io_err_fd, line, strlen(line));
+    }
+    double shell = profile->parse + profile->expand + profile->spawn;
+    snprintf(line, sizeof(line), "shell: parse %.6fs  expand %.6fs  spawn %.6fs  wait %.6fs  (overhead %.6fs)\n",
+             profile->parse, profile->expand, profile->spawn, profile->wait, shell);
+    out_write(io_err_fd, line, strlen(line));
+    out_flush(io_err_fd);
+}
@@ -0,0 +1,140 @@
+#ifndef __COMMANDS_H__
+#define __COMMANDS_H__
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "arena.h"
+#include "io_helpers.h"
+
+
+#define MAX_SAVED_FDS 3  // Redirections only target stdin, stdout and stderr
+
+
+/* An I/O redirection such as "> out" or "2>> log", applied in list order.
+ */
+typedef struct Redirect {
+    int fd;                 // Descriptor being replaced
+    int flags;              // open() flags for path
+    const char *path;
+    struct Redirect *next;
+} Redirect;
+
+/* One stage of a pipeline. argv is NULL terminated and arena allocated.
+ */
+typedef struct Command {
+    char **argv;
+    size_t argc;
+    Redirect *redirs;
+    int assignment;         // argv[0] came from a raw name=value word
+} Command;
+
+/* A parsed command line: count stages separated by '|', optionally run in
+ * the background with a trailing '&'.
+ */
+typedef struct Pipeline {
+    Command *cmds;
+    size_t count;
+    int background;
+} Pipeline;
+
+
+/* Prereq: words holds the materialized text of every token in lx
+ * Return: pipeline allocated in arena, or NULL on a syntax error
+ */
+Pipeline *parse_pipeline(Arena *arena, Lexer *lx, char **words);
+
+
+/* Per-stage measurements collected while a 'time' command runs.
+ */
+typedef struct {
+    const char *name;
+    int status;                 // Wait status (or 0 / 1 << 8 for builtins)
+    double wall;                // Seconds from launch to exit
+    struct rusage usage;        // From wait4(), or a getrusage() delta for builtins
+} StageProfile;
+
+/* Whole-command profile: the shell's own overhead split by phase, and the
+ * measured stages of the pipeline.
+ */
+typedef struct {
+    struct timespec start;      // When the line was read
+    double parse;
+    double expand;
+    double spawn;               // Time spent in fork() in the parent
+    double wait;                // Time spent blocked waiting for children
+    double total;
+    StageProfile *stages;
+    size_t count;
+} ExecProfile;
+
+/* Non-NULL while a command run under 'time' executes; the executors record
+ * into it.
+ */
+extern ExecProfile *exec_profile;
+
+
+/* Descriptors saved by redirect_begin so a builtin's redirections can be undone.
+ */
+typedef struct {
+    int fd[MAX_SAVED_FDS];      // Original descriptor numbers
+    int saved[MAX_SAVED_FDS];   // Duplicates holding the original files
+    int count;
+} SavedFds;
+
+
+/* Opens every redirection target and dup2()s it over its descriptor. Meant
+ * for forked children, where nothing has to be restored.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int apply_redirects(const Redirect *redirs);
+
+/* Opens every redirection target into fds (indexed by the descriptor it
+ * replaces) without touching the process's own descriptors; used for
+ * builtins running on worker threads. Entries above 2 belong to the
+ * caller, so any that get replaced are closed.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int open_redirects(const Redirect *redirs, int fds[MAX_SAVED_FDS]);
+
+/* Applies redirs in the shell process, remembering the original descriptors
+ * in saved. Must be paired with redirect_end even on failure.
+ * Return: 0 on success, -1 if a file could not be opened
+ */
+int redirect_begin(const Redirect *redirs, SavedFds *saved);
+
+/* Restores the descriptors saved by redirect_begin.
+ */
+void redirect_end(SavedFds *saved);
+
+/* Runs a parsed command line: a background job, a pipeline, a builtin in
+ * the shell process or an external command.
+ */
+void run_pipeline(Pipeline *pl);
+
+
+/* Return: seconds elapsed on CLOCK_MONOTONIC since *since
+ */
+double seconds_since(const struct timespec *since);
+
+/* Prepares profile to time pl (stage names, zeroed counters) in arena.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int profile_init(ExecProfile *profile, Arena *arena, const Pipeline *pl);
+
+/* Recorders called by the executors; no-ops unless exec_profile is set.
+ * profile_builtin measures a getrusage(who) delta: RUSAGE_SELF for a builtin
+ * on the main thread, RUSAGE_THREAD (from the thread itself) for a worker.
+ */
+void profile_add_spawn(const struct timespec *since);
+void profile_add_wait(const struct timespec *since);
+void profile_stage(size_t index, int status, const struct rusage *usage, const struct timespec *started);
+void profile_builtin(size_t index, ssize_t err, int who, const struct rusage *before, const struct timespec *started);
+
+/* Prints the pipeline totals, every stage and the shell overhead to stderr.
+ */
+void profile_report(ExecProfile *profile);
+
+
+#endif
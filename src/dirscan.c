@@ -0,0 +1,82 @@
+#define _GNU_SOURCE  // For getdents64()
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dirscan.h"
+
+
+/* Opens name relative to the directory parent_fd (AT_FDCWD for the working
+ * directory), without following a final symlink when nofollow is set.
+ * Return: 0 on success, -1 on error (errno set)
+ */
+int dir_open(DirReader *dir, int parent_fd, const char *name, int nofollow) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (nofollow ? O_NOFOLLOW : 0);
+    dir->fd = openat(parent_fd, name, flags);
+    if (dir->fd == -1) {
+        return -1;
+    }
+    dir->buf = malloc(DIR_BUF_LEN);
+    if (dir->buf == NULL) {
+        close(dir->fd);
+        dir->fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+    dir->len = 0;
+    dir->pos = 0;
+    return 0;
+}
+
+/* Reads the next entry of dir into entry; "." and ".." are included.
+ * Return: 1 for an entry, 0 at the end of the directory, -1 on error
+ */
+int dir_next(DirReader *dir, DirEntry *entry) {
+    if (dir->pos >= dir->len) {
+        ssize_t n;
+        do {
+            n = getdents64(dir->fd, dir->buf, DIR_BUF_LEN);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        dir->len = n;
+        dir->pos = 0;
+    }
+    struct dirent64 *d = (struct dirent64 *)(dir->buf + dir->pos);
+    dir->pos += d->d_reclen;
+    entry->name = d->d_name;
+    entry->ino = d->d_ino;
+    entry->type = d->d_type;
+    return 1;
+}
+
+/* Return: 1 if entry (read from dir) is a directory, 0 otherwise. d_type is
+ * trusted; only DT_UNKNOWN entries cost an fstatat(). Symlinks are not
+ * followed.
+ */
+int dir_entry_is_dir(const DirReader *dir, const DirEntry *entry) {
+    if (entry->type != DT_UNKNOWN) {
+        return entry->type == DT_DIR;
+    }
+    struct stat st;
+    return fstatat(dir->fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Return: 1 if name is "." or "..", 0 otherwise
+ */
+int dir_is_dot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+void dir_close(DirReader *dir) {
+    if (dir->fd != -1) {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+    free(dir->buf);
+    dir->buf = NULL;
+}
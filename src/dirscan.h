@@ -0,0 +1,55 @@
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define DIR_BUF_LEN 32768   // Bytes of entries fetched per getdents64() call
+
+
+/* One directory entry, as returned by getdents64(). name points into the
+ * reader's buffer and is valid until the next dir_next call.
+ */
+typedef struct {
+    const char *name;
+    ino_t ino;
+    unsigned char type;     // DT_DIR, DT_REG, ... or DT_UNKNOWN
+} DirEntry;
+
+/* An open directory read straight from the kernel in DIR_BUF_LEN batches,
+ * with no DIR stream and no per-entry allocation.
+ */
+typedef struct {
+    int fd;
+    size_t len;             // Bytes of entries in buf
+    size_t pos;             // Offset of the next entry in buf
+    char *buf;
+} DirReader;
+
+
+/* Opens name relative to the directory parent_fd (AT_FDCWD for the working
+ * directory), without following a final symlink when nofollow is set.
+ * Return: 0 on success, -1 on error (errno set)
+ */
+int dir_open(DirReader *dir, int parent_fd, const char *name, int nofollow);
+
+/* Reads the next entry of dir into entry; "." and ".." are included.
+ * Return: 1 for an entry, 0 at the end of the directory, -1 on error
+ */
+int dir_next(DirReader *dir, DirEntry *entry);
+
+/* Return: 1 if entry (read from dir) is a directory, 0 otherwise. d_type is
+ * trusted; only DT_UNKNOWN entries cost an fstatat(). Symlinks are not
+ * followed.
+ */
+int dir_entry_is_dir(const DirReader *dir, const DirEntry *entry);
+
+/* Return: 1 if name is "." or "..", 0 otherwise
+ */
+int dir_is_dot(const char *name);
+
+void dir_close(DirReader *dir);
+
+
+#endif
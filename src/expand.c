@@ -0,0 +1,463 @@
+#define _GNU_SOURCE  // For pipe2() and F_SETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "commands.h"
+#include "expand.h"
+#include "io_helpers.h"
+#include "pathexp.h"
+#include "variables.h"
+
+
+#define STRBUF_MIN_CAP 64
+#define CAPTURE_PIPE_LEN (1 << 20)  // Requested pipe size for captured output
+#define CAPTURE_READ_LEN (1 << 16)  // Least free space offered to each read()
+
+
+/* Makes room for n more bytes (plus a terminator) in buf, growing it
+ * geometrically.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int strbuf_reserve(Arena *arena, StrBuf *buf, size_t n) {
+    if (buf->len + n + 1 > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap * 2 : STRBUF_MIN_CAP;
+        while (new_cap < buf->len + n + 1) {
+            new_cap *= 2;
+        }
+        char *new_data = arena_realloc(arena, buf->data, buf->cap, new_cap);
+        if (new_data == NULL) {
+            return -1;
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    return 0;
+}
+
+/* Appends n bytes of s to buf, growing it geometrically.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int strbuf_append(Arena *arena, StrBuf *buf, const char *s, size_t n) {
+    if (strbuf_reserve(arena, buf, n) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    return 0;
+}
+
+/* Return: 1 if c may appear in a variable name, 0 otherwise
+ */
+int is_name_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+/* Return: 1 if the raw word tok has the form name=value, 0 otherwise
+ */
+int is_assignment(const Token *tok) {
+    size_t i = 0;
+    while (i < tok->len && is_name_char(tok->start[i])) {
+        i++;
+    }
+    return tok->type == TOK_WORD && i > 0 && i < tok->len && tok->start[i] == '=';
+}
+
+// A command line run on a worker thread with its stdout in a pipe
+typedef struct {
+    Pipeline *pl;
+    int fds[3];             // The caller's stdin and stderr, and the pipe's write end
+} Capture;
+
+static void *run_capture(void *arg) {
+    Capture *cap = arg;
+    io_in_fd = cap->fds[0];
+    io_out_fd = cap->fds[1];
+    io_err_fd = cap->fds[2];
+    execute_pipeline(cap->pl);
+    close(cap->fds[1]);     // The reader sees EOF once every stage is done too
+    return NULL;
+}
+
+/* Runs the command line text (of length len) and appends its output, less
+ * trailing newlines, to out. The command runs on a worker thread, so
+ * builtins are captured in the shell without a fork, while this thread
+ * reads the pipe straight into out's spare capacity; the pipe is enlarged
+ * so a big output moves in few large reads, and out grows geometrically.
+ * Return: 0 on success, -1 on error
+ */
+static int command_subst(Arena *arena, StrBuf *out, const char *text, size_t len) {
+    char *line = arena_strndup(arena, text, len);
+    if (line == NULL) {
+        return -1;
+    }
+    Lexer lx = {0};
+    int ret = -1;
+    ssize_t lexed = lex_line(&lx, line, len);
+    if (lexed <= 0) {
+        ret = lexed == 0 ? 0 : -1;  // $() is empty
+        goto done;
+    }
+    char **words = expand_tokens(arena, &lx);
+    Pipeline *pl = words != NULL ? parse_pipeline(arena, &lx, words) : NULL;
+    if (pl == NULL) {
+        goto done;
+    }
+    if (pl->background) {
+        display_error("ERROR: Cannot capture a background command", "");
+        goto done;
+    }
+
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        goto done;
+    }
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, CAPTURE_PIPE_LEN);  // Best effort
+    Capture cap = {pl, {io_in_fd, pipe_fd[1], io_err_fd}};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_capture, &cap) != 0) {
+        display_error("ERROR: Could not run command substitution", "");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        goto done;
+    }
+
+    size_t start = out->len;
+    ret = 0;
+    while (1) {
+        // After a failed allocation keep draining, so the command is not
+        // left blocked on a full pipe
+        char discard[4096];
+        char *dst = discard;
+        size_t room = sizeof(discard);
+        if (ret == 0 && strbuf_reserve(arena, out, CAPTURE_READ_LEN) == 0) {
+            dst = out->data + out->len;
+            room = out->cap - out->len - 1;
+        } else {
+            ret = -1;
+        }
+        ssize_t n = read(pipe_fd[0], dst, room);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (ret == 0) {
+            out->len += n;
+        }
+    }
+    close(pipe_fd[0]);
+    pthread_join(thread, NULL);
+
+    while (out->len > start && out->data[out->len - 1] == '\n') {
+        out->len--;
+    }
+
+done:
+    lexer_free(&lx);
+    return ret;
+}
+
+/* Expands the command substitution $(...) or `...` whose opening '(' or
+ * '`' is at src[*pos] and advances *pos past it.
+ * Return: 0 on success, -1 on error
+ */
+static int expand_subst(Arena *arena, StrBuf *out, const char *src, size_t len, size_t *pos) {
+    ssize_t end = subst_end(src, len, *pos);
+    if (end == -1) {
+        display_error("ERROR: Unterminated command substitution", "");
+        return -1;
+    }
+    size_t start = *pos + 1;
+    *pos = end;
+    return command_subst(arena, out, src + start, end - 1 - start);
+}
+
+/* Expands the reference starting at the '$' in src[*pos] and advances *pos
+ * past it. A '$' that does not start a reference is copied literally.
+ * Return: 0 on success, -1 on error
+ */
+static int expand_dollar(Arena *arena, StrBuf *out, const char *src, size_t len, size_t *pos) {
+    size_t i = *pos + 1;
+    const char *name = src + i;
+    size_t name_len = 0;
+
+    if (i < len && src[i] == '(') {
+        *pos = i;
+        return expand_subst(arena, out, src, len, pos);
+    } else if (i < len && src[i] == '{') {
+        const char *close = memchr(src + i + 1, '}', len - i - 1);
+        if (close == NULL) {
+            display_error("ERROR: Bad substitution", "");
+            return -1;
+        }
+        name = src + i + 1;
+        name_len = close - name;
+        for (size_t k = 0; k < name_len; k++) {
+            if (!is_name_char(name[k])) {
+                display_error("ERROR: Bad substitution", "");
+                return -1;
+            }
+        }
+        i = (close - src) + 1;
+    } else {
+        while (i < len && is_name_char(src[i])) {
+            i++;
+        }
+        name_len = i - *pos - 1;
+        if (name_len == 0) {
+            *pos = i;
+            return strbuf_append(arena, out, "$", 1);
+        }
+    }
+
+    *pos = i;
+    size_t value_len = 0;
+    const char *value = lookup_variable(name, name_len, &value_len);
+    return strbuf_append(arena, out, value, value_len);
+}
+
+/* Appends the n bytes of s to the glob pattern pat, escaping the
+ * metacharacters among them with '\\' unless they are live (unquoted text
+ * of the word itself).
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int pattern_append(Arena *arena, StrBuf *pat, const char *s, size_t n, int live) {
+    if (live) {
+        return strbuf_append(arena, pat, s, n);
+    }
+    if (strbuf_reserve(arena, pat, 2 * n) == -1) {
+        return -1;
+    }
+    for (size_t k = 0; k < n; k++) {
+        if (strchr("*?[\\", s[k]) != NULL) {
+            pat->data[pat->len++] = '\\';
+        }
+        pat->data[pat->len++] = s[k];
+    }
+    return 0;
+}
+
+/* Expands a raw word view in one pass: quotes and escapes are removed and
+ * $name, ${name}, embedded references (pre$x.post) and $(...) / `...`
+ * command substitutions are substituted. Single-quoted text is copied
+ * literally. If pattern is not NULL, the word's glob pattern is built
+ * alongside, as glob_pattern does: quoted text and substituted values are
+ * escaped, so only the word's own unquoted metacharacters stay special.
+ * Return: NULL terminated result in arena (its length in *out_len), or NULL on error
+ */
+char *expand_word(Arena *arena, const Token *tok, size_t *out_len, char **pattern) {
+    const char *src = tok->start;
+    size_t len = tok->len;
+    StrBuf out = {0};
+    StrBuf pat = {0};
+    size_t i = 0;
+    int in_double = 0;
+
+    while (i < len) {
+        // Copy the longest run of plain characters in one go.
+        size_t run = i;
+        while (run < len && src[run] != '$' && src[run] != '\\' && src[run] != '"' &&
+               src[run] != '`' && (in_double || src[run] != '\'')) {
+            run++;
+        }
+        if (run > i && strbuf_append(arena, &out, src + i, run - i) == -1) {
+            return NULL;
+        }
+        if (run > i && pattern != NULL &&
+            pattern_append(arena, &pat, src + i, run - i, !in_double) == -1) {
+            return NULL;
+        }
+        i = run;
+        if (i == len) {
+            break;
+        }
+
+        char c = src[i];
+        size_t from = out.len;  // Whatever c appends is never live in the pattern
+        int rc = 0;
+        if (c == '$') {
+            rc = expand_dollar(arena, &out, src, len, &i);
+        } else if (c == '`') {
+            rc = expand_subst(arena, &out, src, len, &i);
+        } else if (c == '"') {
+            in_double = !in_double;
+            i++;
+        } else if (c == '\'') {
+            const char *close = memchr(src + i + 1, '\'', len - i - 1);
+            size_t lit_len = close - (src + i + 1);
+            rc = strbuf_append(arena, &out, src + i + 1, lit_len);
+            i += lit_len + 2;
+        } else if (i + 1 == len) {
+            rc = strbuf_append(arena, &out, "\\", 1);  // Trailing backslash is literal
+            i++;
+        } else if (!in_double || strchr("\"\\$`", src[i + 1]) != NULL) {
+            rc = strbuf_append(arena, &out, src + i + 1, 1);
+            i += 2;
+        } else {
+            rc = strbuf_append(arena, &out, src + i, 2);
+            i += 2;
+        }
+        if (rc == 0 && pattern != NULL && out.len > from) {
+            rc = pattern_append(arena, &pat, out.data + from, out.len - from, 0);
+        }
+        if (rc == -1) {
+            return NULL;
+        }
+    }
+
+    if (strbuf_append(arena, &out, "", 0) == -1 ||
+        (pattern != NULL && strbuf_append(arena, &pat, "", 0) == -1)) {
+        return NULL;
+    }
+    out.data[out.len] = '\0';
+    *out_len = out.len;
+    if (pattern != NULL) {
+        pat.data[pat.len] = '\0';
+        *pattern = pat.data;
+    }
+    return out.data;
+}
+
+/* Builds the glob pattern of a raw word that needs no expansion: quotes
+ * and escapes are removed and the bytes they protected are escaped with
+ * '\', so only the unquoted metacharacters stay special.
+ * Return: NULL terminated pattern in arena, or NULL on allocation failure
+ */
+static char *glob_pattern(Arena *arena, const Token *tok) {
+    const char *src = tok->start;
+    size_t len = tok->len;
+    char *out = arena_alloc(arena, 2 * len + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    int in_double = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = src[i];
+        int quoted = in_double;
+        if (c == '"') {
+            in_double = !in_double;
+            continue;
+        }
+        if (c == '\'' && !in_double) {
+            for (i++; src[i] != '\''; i++) {
+                if (strchr("*?[\\", src[i]) != NULL) {
+                    out[n++] = '\\';
+                }
+                out[n++] = src[i];
+            }
+            continue;
+        }
+        if (c == '\\') {
+            if (i + 1 < len && (!in_double || strchr("\"\\$`", src[i + 1]) != NULL)) {
+                c = src[++i];
+            }
+            quoted = 1;
+        }
+        if (quoted && strchr("*?[\\", c) != NULL) {
+            out[n++] = '\\';
+        }
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/* Materializes every token of lx into an arena allocated argv. Words that
+ * need no expansion are unquoted in place in the line buffer; the rest go
+ * through expand_word. Words with unquoted glob metacharacters (except
+ * redirection targets and a leading assignment) are then replaced by the
+ * sorted paths they match, if any; lx->toks grows to match, each added
+ * token a copy of the word it came from. Words of the form name=value are
+ * flagged TOKF_ASSIGN.
+ * Return: NULL terminated argv with lx->count entries, or NULL on error
+ */
+char **expand_tokens(Arena *arena, Lexer *lx) {
+    char **argv = arena_alloc(arena, (lx->count + 1) * sizeof(char *));
+    if (argv == NULL) {
+        return NULL;
+    }
+
+    char ***matches = NULL;     // Per token: its paths, when a glob matched several
+    size_t *counts = NULL;
+    size_t total = lx->count;
+    for (size_t i = 0; i < lx->count; i++) {
+        Token *tok = &lx->toks[i];
+        if (is_assignment(tok)) {
+            tok->flags |= TOKF_ASSIGN;  // Unquoting below rewrites the raw word
+        }
+        int glob = tok->type == TOK_WORD && (tok->flags & TOKF_GLOB) && !(i == 0 && (tok->flags & TOKF_ASSIGN)) &&
+                   !(i > 0 && lx->toks[i - 1].type != TOK_WORD && lx->toks[i - 1].type != TOK_PIPE &&
+                     lx->toks[i - 1].type != TOK_AMP);
+        char *pattern = NULL;
+        if (tok->type == TOK_WORD && (tok->flags & (TOKF_DOLLAR | TOKF_SUBST))) {
+            size_t len = 0;
+            argv[i] = expand_word(arena, tok, &len, glob ? &pattern : NULL);
+            if (argv[i] == NULL) {
+                return NULL;
+            }
+        } else {
+            if (glob && (pattern = glob_pattern(arena, tok)) == NULL) {
+                return NULL;
+            }
+            argv[i] = token_text(tok);
+        }
+        if (!glob) {
+            continue;
+        }
+
+        char **paths;
+        ssize_t n = path_expand(arena, pattern, &paths);
+        if (n == -1) {
+            display_error("ERROR: Memory allocation failed for glob: ", argv[i]);
+            return NULL;
+        }
+        if (n == 0) {
+            continue;   // No match: the word stays as written
+        }
+        argv[i] = paths[0];
+        if (n > 1) {
+            if (matches == NULL) {
+                matches = arena_alloc(arena, lx->count * sizeof(char **));
+                counts = arena_alloc(arena, lx->count * sizeof(size_t));
+                if (matches == NULL || counts == NULL) {
+                    return NULL;
+                }
+                memset(counts, 0, lx->count * sizeof(size_t));
+            }
+            matches[i] = paths;
+            counts[i] = n;
+            total += n - 1;
+        }
+    }
+    argv[lx->count] = NULL;
+    if (total == lx->count) {
+        return argv;
+    }
+
+    // Spread the expanded words out, back to front so nothing is overwritten early
+    char **out = arena_alloc(arena, (total + 1) * sizeof(char *));
+    if (out == NULL || lexer_reserve(lx, total) == -1) {
+        return NULL;
+    }
+    size_t j = total;
+    for (size_t i = lx->count; i-- > 0;) {
+        size_t n = counts[i] ? counts[i] : 1;
+        for (size_t k = n; k-- > 0;) {
+            j--;
+            lx->toks[j] = lx->toks[i];
+            out[j] = counts[i] ? matches[i][k] : argv[i];
+        }
+    }
+    lx->count = total;
+    out[total] = NULL;
+    return out;
+}
@@ -0,0 +1,59 @@
+#ifndef __EXPAND_H__
+#define __EXPAND_H__
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "io_helpers.h"
+
+
+/* Length-tracked string that grows inside an arena.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+/* Makes room for n more bytes (plus a terminator) in buf, growing it
+ * geometrically.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int strbuf_reserve(Arena *arena, StrBuf *buf, size_t n);
+
+/* Appends n bytes of s to buf, growing it geometrically.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int strbuf_append(Arena *arena, StrBuf *buf, const char *s, size_t n);
+
+/* Return: 1 if c may appear in a variable name, 0 otherwise
+ */
+int is_name_char(char c);
+
+/* Return: 1 if the raw word tok has the form name=value, 0 otherwise
+ */
+int is_assignment(const Token *tok);
+
+/* Expands a raw word view in one pass: quotes and escapes are removed and
+ * $name, ${name}, embedded references (pre$x.post) and $(...) / `...`
+ * command substitutions are substituted. Single-quoted text is copied
+ * literally. If pattern is not NULL, the word's glob pattern is built
+ * alongside: quoted text and substituted values are escaped, so only the
+ * word's own unquoted metacharacters stay special.
+ * Return: NULL terminated result in arena (its length in *out_len), or NULL on error
+ */
+char *expand_word(Arena *arena, const Token *tok, size_t *out_len, char **pattern);
+
+/* Materializes every token of lx into an arena allocated argv. Words that
+ * need no expansion are unquoted in place in the line buffer; the rest go
+ * through expand_word. Words with unquoted glob metacharacters (except
+ * redirection targets and a leading assignment) are then replaced by the
+ * sorted paths they match, if any; lx->toks grows to match, each added
+ * token a copy of the word it came from. Words of the form name=value are
+ * flagged TOKF_ASSIGN.
+ * Return: NULL terminated argv with lx->count entries, or NULL on error
+ */
+char **expand_tokens(Arena *arena, Lexer *lx);
+
+
+#endif
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE  // For memrchr()
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "builtins.h"
+#include "io_helpers.h"
+#include "pattern.h"
+#include "walk.h"
+
+#define FIND_PATH_LEN 4096      // Paths up to this long are built on the stack
+
+
+// Comparison of a -size or -mtime predicate: "+N", "-N" or "N"
+typedef enum { FIND_OFF, FIND_LESS, FIND_EQUAL, FIND_MORE } FindCmp;
+
+// The predicates of one find, all of which an entry must satisfy
+typedef struct {
+    Pattern name;           // -name / -iname, against the entry's own name
+    int has_name;
+    Pattern path;           // -path / -regex, against the whole path
+    int has_path;
+    int type;               // -type as a DT_* value, or -1
+    FindCmp size_cmp;
+    long long size;         // In size_unit bytes
+    long long size_unit;
+    FindCmp mtime_cmp;
+    long long mtime;        // In days
+    time_t now;
+    int max_depth;
+} FindQuery;
+
+
+/* Parses "+N", "-N" or "N" (followed by the units letters in units, if any,
+ * whose multipliers are in scales; the default unit is scales[0]).
+ * Return: 0 on success, -1 on a malformed argument
+ */
+static int find_number(const char *arg, FindCmp *cmp, long long *value, long long *unit,
+                       const char *units, const long long *scales) {
+    *cmp = *arg == '+' ? FIND_MORE : *arg == '-' ? FIND_LESS : FIND_EQUAL;
+    arg += *cmp != FIND_EQUAL;
+    char *end;
+    *value = strtoll(arg, &end, 10);
+    if (end == arg || *value < 0) {
+        return -1;
+    }
+    *unit = scales[0];
+    if (*end != '\0') {
+        const char *u = units ? strchr(units, *end) : NULL;
+        if (u == NULL || end[1] != '\0') {
+            return -1;
+        }
+        *unit = scales[u - units + 1];
+    }
+    return 0;
+}
+
+static int find_compare(FindCmp cmp, long long have, long long want) {
+    return cmp == FIND_LESS ? have < want : cmp == FIND_MORE ? have > want : have == want;
+}
+
+/* walk_list match callback: cheap tests (names, d_type) first, and one
+ * lstat only when -size, -mtime or an unknown d_type needs it.
+ */
+static int find_match(const WalkEntry *entry, void *ctx) {
+    const FindQuery *q = ctx;
+    if (entry->depth > 0 && dir_is_dot(entry->name)) {
+        return 0;
+    }
+    if (entry->depth > q->max_depth) {
+        return 0;
+    }
+    if (q->has_name) {
+        // The top's name is its last component
+        const char *name = entry->name;
+        size_t len = strlen(name);
+        if (entry->depth == 0) {
+            while (len > 1 && name[len - 1] == '/') {
+                len--;
+            }
+            const char *slash = memrchr(name, '/', len > 1 ? len - 1 : 0);
+            if (slash != NULL) {
+                len -= slash + 1 - name;
+                name = slash + 1;
+            }
+        }
+        if (!pattern_match(&q->name, name, len)) {
+            return 0;
+        }
+    }
+    if (q->has_path) {
+        char stack[FIND_PATH_LEN];
+        char *path = stack;
+        size_t dir_len = entry->dir_path ? strlen(entry->dir_path) : 0;
+        size_t name_len = strlen(entry->name);
+        int slash = dir_len > 0 && entry->dir_path[dir_len - 1] != '/';
+        size_t len = dir_len + slash + name_len;
+        if (len > sizeof(stack) && (path = malloc(len)) == NULL) {
+            return 0;
+        }
+        if (dir_len > 0) {
+            memcpy(path, entry->dir_path, dir_len);
+            path[dir_len] = '/';
+        }
+        memcpy(path + dir_len + slash, entry->name, name_len);
+        int matched = pattern_match(&q->path, path, len);
+        if (path != stack) {
+            free(path);
+        }
+        if (!matched) {
+            return 0;
+        }
+    }
+    int type = entry->type;
+    // The top always: it may not exist
+    if ((q->type != -1 && type == DT_UNKNOWN) || entry->depth == 0 ||
+        q->size_cmp != FIND_OFF || q->mtime_cmp != FIND_OFF) {
+        struct stat st;
+        if (fstatat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            return 0;
+        }
+        type = IFTODT(st.st_mode);
+        long long blocks = (st.st_size + q->size_unit - 1) / q->size_unit;
+        if (q->size_cmp != FIND_OFF && !find_compare(q->size_cmp, blocks, q->size)) {
+            return 0;
+        }
+        long long days = (q->now - st.st_mtime) / 86400;
+        if (q->mtime_cmp != FIND_OFF && !find_compare(q->mtime_cmp, days, q->mtime)) {
+            return 0;
+        }
+    }
+    return q->type == -1 || type == q->type;
+}
+
+static void find_query_free(FindQuery *q) {
+    if (q->has_name) {
+        pattern_free(&q->name);
+    }
+    if (q->has_path) {
+        pattern_free(&q->path);
+    }
+}
+
+
+/*
+ * bn_find - Builtin function for the "find" command.
+ *
+ * Usage: find [path] [-name glob] [-iname glob] [-path glob] [-regex re]
+ *             [-type f|d|l|p|s|c|b] [-size [+-]N[ckMG]] [-mtime [+-]N]
+ *             [-maxdepth N] [-j N] [-unordered]
+ *  - Prints the path of every entry under path (default ".") that
+ *    satisfies all the predicates, path itself included.
+ *  - -name matches the entry's name and -path its whole path (where, as in
+ *    find(1), "*" matches '/' too); -regex must match the whole path.
+ *  - -size counts 512-byte blocks unless a unit is given (c: bytes), and
+ *    -mtime whole days, with "+N" meaning more and "-N" less than N.
+ *  - The tree is walked by walk_list on N threads (default: online CPUs);
+ *    output is in depth-first order unless -unordered is given.
+ *
+ * Returns 0 on success and -1 on an invalid predicate or path.
+ */
+ssize_t bn_find(char **tokens) {
+    static const long long size_scales[] = {512, 1, 512, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+    static const long long day_scales[] = {1};
+    FindQuery q = {.type = -1, .size_unit = 512, .max_depth = 999};
+    q.now = time(NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    WalkOpts opts = {
+        .threads = cpus > 0 ? (cpus < WALK_MAX_THREADS ? cpus : WALK_MAX_THREADS) : 1,
+        .ordered = 1,
+        .paths = 1,
+        .top = 1,
+        .match = find_match,
+        .ctx = &q,
+    };
+    const char *path = ".";
+    int i = 1;
+    if (tokens[i] != NULL && tokens[i][0] != '-') {
+        path = tokens[i++];
+    }
+
+    ssize_t ret = 0;
+    for (; tokens[i] != NULL && ret == 0; i++) {
+        char *opt = tokens[i];
+        if (strcmp(opt, "-unordered") == 0) {
+            opts.ordered = 0;
+            continue;
+        }
+        char *arg = tokens[i + 1];
+        if (arg == NULL) {
+            display_error("ERROR: Missing argument to ", opt);
+            ret = -1;
+            break;
+        }
+        i++;
+        long long unit;
+        if (strcmp(opt, "-name") == 0 || strcmp(opt, "-iname") == 0) {
+            if (q.has_name) {
+                pattern_free(&q.name);
+            }
+            q.has_name = pattern_glob(&q.name, arg, opt[1] == 'i' ? PAT_ICASE : 0) == 0;
+            ret = q.has_name ? 0 : -1;
+        } else if (strcmp(opt, "-path") == 0 || strcmp(opt, "-regex") == 0) {
+            if (q.has_path) {
+                pattern_free(&q.path);
+                q.has_path = 0;
+            }
+            if (opt[1] == 'p') {
+                q.has_path = pattern_glob(&q.path, arg, 0) == 0;
+            } else {
+                // find's -regex matches the whole path
+                size_t len = strlen(arg);
+                char *anchored = malloc(len + 5);
+                if (anchored != NULL) {
+                    memcpy(anchored, "^(", 2);
+                    memcpy(anchored + 2, arg, len);
+                    memcpy(anchored + 2 + len, ")$", 3);
+                    q.has_path = pattern_regex(&q.path, anchored, 0) == 0;
+                    free(anchored);
+                }
+            }
+            ret = q.has_path ? 0 : -1;
+        } else if (strcmp(opt, "-type") == 0) {
+            const char *types = "fdlpscb";
+            const int values[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK};
+            const char *t = arg[0] != '\0' && arg[1] == '\0' ? strchr(types, arg[0]) : NULL;
+            q.type = t ? values[t - types] : -1;
+            ret = t ? 0 : -1;
+        } else if (strcmp(opt, "-size") == 0) {
+            ret = find_number(arg, &q.size_cmp, &q.size, &q.size_unit, "cbkMG", size_scales);
+        } else if (strcmp(opt, "-mtime") == 0) {
+            ret = find_number(arg, &q.mtime_cmp, &q.mtime, &unit, NULL, day_scales);
+        } else if (strcmp(opt, "-maxdepth") == 0) {
+            char *end;
+            long depth = strtol(arg, &end, 10);
+            q.max_depth = depth >= 0 && depth <= 999 && *end == '\0' && end != arg ? depth : -1;
+            ret = q.max_depth >= 0 ? 0 : -1;
+        } else if (strcmp(opt, "-j") == 0) {
+            opts.threads = atoi(arg);
+            ret = opts.threads >= 1 && opts.threads <= WALK_MAX_THREADS ? 0 : -1;
+        } else {
+            display_error("ERROR: Unknown predicate: ", opt);
+            ret = -1;
+            break;
+        }
+        if (ret == -1) {
+            display_error("ERROR: Invalid argument to find: ", arg);
+        }
+    }
+
+    if (ret == 0) {
+        opts.max_depth = q.max_depth > 0 ? q.max_depth : 1;
+        if (walk_list(path, &opts, io_out_fd) == -1) {
+            display_error("ERROR: Invalid path: ", (char *)path);
+            ret = -1;
+        }
+    }
+    find_query_free(&q);
+    return ret;
+}
@@ -0,0 +1,545 @@
+#define _GNU_SOURCE  // For memmem() and memrchr()
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "grep.h"
+#include "io_helpers.h"
+#include "wc.h"
+
+#define GREP_STDIN_NAME "(standard input)"
+
+
+// ===== Pattern =====
+
+/* Rough rank of how common byte c is in text (higher: more common), for
+ * picking the needle bytes least likely to give false candidates.
+ */
+static int byte_rank(unsigned char c) {
+    if (c == ' ' || c == 'e' || c == 't' || c == 'a' || c == 'o' || c == 'i' ||
+        c == 'n' || c == 's' || c == 'r') {
+        return 4;
+    }
+    if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+        return 3;
+    }
+    if ((c >= 'A' && c <= 'Z') || strchr(".,:;/-_=\"'()\t", c) != NULL) {
+        return 2;
+    }
+    return 1;
+}
+
+// Picks the two rarest bytes of the needle (distinct offsets, when it has two)
+static void pick_rare(GrepQuery *q) {
+    const unsigned char *n = (const unsigned char *)q->needle;
+    size_t a = 0;
+    for (size_t i = 1; i < q->needle_len; i++) {
+        if (byte_rank(n[i]) < byte_rank(n[a])) {
+            a = i;
+        }
+    }
+    // Prefer a second byte of another value, so the pair filters more
+    size_t b = a == 0 ? q->needle_len - 1 : 0;
+    for (size_t i = 0; i < q->needle_len; i++) {
+        if (i == a) {
+            continue;
+        }
+        int better = n[b] == n[a] ? n[i] != n[a] || byte_rank(n[i]) < byte_rank(n[b])
+                                  : n[i] != n[a] && byte_rank(n[i]) < byte_rank(n[b]);
+        if (better) {
+            b = i;
+        }
+    }
+    q->rare[0] = a;
+    q->rare[1] = b;
+}
+
+// Return: 1 if the extended regex text has no special characters, 0 otherwise
+static int is_plain(const char *text) {
+    return strpbrk(text, "\\^$.[]|()*+?{}") == NULL;
+}
+
+int grep_parse(char **argv, GrepQuery *q) {
+    memset(q, 0, sizeof(GrepQuery));
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = argv[i] + 1; *f != '\0'; f++) {
+            const char *letters = "clvinFE";
+            const unsigned values[] = {GREP_COUNT, GREP_LIST, GREP_INVERT, GREP_ICASE,
+                                       GREP_NUMBER, GREP_FIXED, 0};
+            const char *l = strchr(letters, *f);
+            if (l == NULL) {
+                display_error("ERROR: Invalid option: ", argv[i]);
+                return -1;
+            }
+            q->flags |= values[l - letters];
+        }
+    }
+    if (argv[i] == NULL) {
+        display_error("ERROR: Missing pattern for grep", "");
+        return -1;
+    }
+
+    const char *text = argv[i];
+    int fixed = (q->flags & GREP_FIXED) || is_plain(text);
+    int icase = (q->flags & GREP_ICASE) != 0;
+    int ret = fixed ? pattern_substr(&q->pattern, text, 0)
+                    : pattern_regex(&q->pattern, text, icase ? PAT_ICASE : 0);
+    if (ret == -1) {
+        display_error("ERROR: Invalid pattern: ", (char *)text);
+        return -1;
+    }
+    // A literal is its own needle (kept folded for -i); a regex also needs checking
+    q->has_pattern = !fixed;
+    q->fold = fixed && icase;
+    if (q->fold) {
+        for (size_t k = 0; k < q->pattern.lit_len; k++) {
+            q->pattern.lit[k] = tolower((unsigned char)q->pattern.lit[k]);
+        }
+    }
+    if (q->pattern.lit_len > 0) {
+        q->needle = q->pattern.lit;
+        q->needle_len = q->pattern.lit_len;
+        pick_rare(q);
+    }
+    return i + 1;
+}
+
+void grep_free(GrepQuery *q) {
+    pattern_free(&q->pattern);
+    q->needle = NULL;
+}
+
+
+// ===== Literal search =====
+
+// Return: the first occurrence of q's needle in the n bytes at hay, or NULL
+typedef const char *(*GrepFinder)(const GrepQuery *q, const char *hay, size_t n);
+
+// Return: 1 if the m bytes at s equal the folded needle, ignoring ASCII case
+static int equal_fold(const char *s, const char *needle, size_t m) {
+    for (size_t i = 0; i < m; i++) {
+        if (tolower((unsigned char)s[i]) != (unsigned char)needle[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Return: 1 if needle occurs at s, in q's case mode
+static int needle_at(const GrepQuery *q, const char *s) {
+    return q->fold ? equal_fold(s, q->needle, q->needle_len) : memcmp(s, q->needle, q->needle_len) == 0;
+}
+
+// Tests the positions from i on one at a time
+static const char *find_tail(const GrepQuery *q, const char *hay, size_t i, size_t n) {
+    size_t m = q->needle_len;
+    size_t a = q->rare[0];
+    unsigned char want = q->needle[a];
+    for (; i + m <= n; i++) {
+        unsigned char c = hay[i + a];
+        if ((c == want || (q->fold && tolower(c) == want)) && needle_at(q, hay + i)) {
+            return hay + i;
+        }
+    }
+    return NULL;
+}
+
+static const char *find_scalar(const GrepQuery *q, const char *hay, size_t n) {
+    return q->fold ? find_tail(q, hay, 0, n) : memmem(hay, n, q->needle, q->needle_len);
+}
+
+#if defined(__x86_64__)
+
+/* The vector finders test 16 or 32 candidate positions at once: a
+ * position survives if the bytes at both of the needle's rare offsets
+ * match, and only survivors are compared in full. On text the pair is
+ * rarely matched by chance, so nearly every block is two loads, two
+ * compares and a movemask; for -i each byte is compared with both of its
+ * cases. The tail goes through the scalar test.
+ */
+static const char *find_sse2(const GrepQuery *q, const char *hay, size_t n) {
+    const char *needle = q->needle;
+    size_t m = q->needle_len;
+    if (m == 1 && !q->fold) {
+        return memchr(hay, needle[0], n);
+    }
+    size_t a = q->rare[0], b = q->rare[1];
+    const __m128i first = _mm_set1_epi8(needle[a]);
+    const __m128i second = _mm_set1_epi8(needle[b]);
+    const __m128i first_alt = _mm_set1_epi8(q->fold ? toupper((unsigned char)needle[a]) : needle[a]);
+    const __m128i second_alt = _mm_set1_epi8(q->fold ? toupper((unsigned char)needle[b]) : needle[b]);
+    size_t i = 0;
+    for (; i + m + 15 <= n; i += 16) {
+        __m128i u = _mm_loadu_si128((const __m128i *)(hay + i + a));
+        __m128i v = _mm_loadu_si128((const __m128i *)(hay + i + b));
+        __m128i x = _mm_or_si128(_mm_cmpeq_epi8(u, first), _mm_cmpeq_epi8(u, first_alt));
+        __m128i y = _mm_or_si128(_mm_cmpeq_epi8(v, second), _mm_cmpeq_epi8(v, second_alt));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(x, y));
+        while (mask != 0) {
+            size_t at = i + __builtin_ctz(mask);
+            if (needle_at(q, hay + at)) {
+                return hay + at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(q, hay, i, n);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const GrepQuery *q, const char *hay, size_t n) {
+    const char *needle = q->needle;
+    size_t m = q->needle_len;
+    if (m == 1 && !q->fold) {
+        return memchr(hay, needle[0], n);
+    }
+    size_t a = q->rare[0], b = q->rare[1];
+    const __m256i first = _mm256_set1_epi8(needle[a]);
+    const __m256i second = _mm256_set1_epi8(needle[b]);
+    const __m256i first_alt = _mm256_set1_epi8(q->fold ? toupper((unsigned char)needle[a]) : needle[a]);
+    const __m256i second_alt = _mm256_set1_epi8(q->fold ? toupper((unsigned char)needle[b]) : needle[b]);
+    size_t i = 0;
+    for (; i + m + 31 <= n; i += 32) {
+        __m256i u = _mm256_loadu_si256((const __m256i *)(hay + i + a));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(hay + i + b));
+        __m256i x = _mm256_or_si256(_mm256_cmpeq_epi8(u, first), _mm256_cmpeq_epi8(u, first_alt));
+        __m256i y = _mm256_or_si256(_mm256_cmpeq_epi8(v, second), _mm256_cmpeq_epi8(v, second_alt));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(x, y));
+        while (mask != 0) {
+            size_t at = i + __builtin_ctz(mask);
+            if (needle_at(q, hay + at)) {
+                return hay + at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(q, hay, i, n);
+}
+
+#endif
+
+static GrepFinder finder = find_scalar;
+static pthread_once_t finder_once = PTHREAD_ONCE_INIT;
+
+static void pick_finder(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    finder = __builtin_cpu_supports("avx2") ? find_avx2 : find_sse2;
+#endif
+}
+
+
+// ===== Scanning =====
+
+void grep_scan_init(GrepScan *s, const GrepQuery *q, const char *name, int label,
+                    GrepEmit emit, void *ctx) {
+    memset(s, 0, sizeof(GrepScan));
+    s->q = q;
+    s->name = name;
+    s->label = label;
+    s->emit = emit;
+    s->ctx = ctx;
+    pthread_once(&finder_once, pick_finder);
+}
+
+/* Counts the selected line of len bytes at text and prints it, prefixed by
+ * the input's name and line number as asked.
+ * Return: 0 on success, -1 if emit failed
+ */
+static int select_line(GrepScan *s, const char *text, size_t len) {
+    unsigned flags = s->q->flags;
+    s->matches++;
+    if (flags & GREP_LIST) {
+        s->done = 1;
+        return 0;
+    }
+    if (flags & GREP_COUNT) {
+        return 0;
+    }
+    if (s->label && (s->emit(s->ctx, s->name, strlen(s->name)) == -1 ||
+                     s->emit(s->ctx, ":", 1) == -1)) {
+        return -1;
+    }
+    if (flags & GREP_NUMBER) {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%lu:", s->line);
+        if (s->emit(s->ctx, num, n) == -1) {
+            return -1;
+        }
+    }
+    if (s->emit(s->ctx, text, len) == -1) {
+        return -1;
+    }
+    return s->emit(s->ctx, "\n", 1);
+}
+
+/* Searches len bytes of whole lines (the last may lack its newline). With
+ * a needle, the block is searched for it directly rather than line by
+ * line: the lines between hits are skipped without being looked at
+ * (or, with -v, selected wholesale), and -n counts their newlines with
+ * the wc kernel.
+ * Return: 0 on success, -1 if emit failed
+ */
+static int grep_block(GrepScan *s, const char *data, size_t len) {
+    const GrepQuery *q = s->q;
+    int invert = (q->flags & GREP_INVERT) != 0;
+    int number = (q->flags & GREP_NUMBER) != 0;
+    size_t pos = 0;
+    while (pos < len && !s->done) {
+        // The next line that may match starts at cand
+        size_t cand = pos;
+        if (q->needle != NULL) {
+            const char *hit = finder(q, data + pos, len - pos);
+            if (hit == NULL) {
+                cand = len;
+            } else {
+                const char *nl = memrchr(data + pos, '\n', hit - (data + pos));
+                cand = nl ? (size_t)(nl + 1 - data) : pos;
+            }
+        }
+        if (invert) {
+            while (pos < cand && !s->done) {
+                const char *nl = memchr(data + pos, '\n', cand - pos);
+                size_t end = nl ? (size_t)(nl - data) : cand;
+                s->line++;
+                if (select_line(s, data + pos, end - pos) == -1) {
+                    return -1;
+                }
+                pos = end + 1;
+            }
+        } else if (number && cand > pos) {
+            WcCounts counts = {0};
+            wc_count(&counts, data + pos, cand - pos, WC_LINES);
+            s->line += counts.lines;
+        }
+        if (cand >= len || s->done) {
+            break;
+        }
+
+        const char *nl = memchr(data + cand, '\n', len - cand);
+        size_t end = nl ? (size_t)(nl - data) : len;
+        int matched = !q->has_pattern || pattern_match(&q->pattern, data + cand, end - cand);
+        s->line++;
+        if (matched != invert && select_line(s, data + cand, end - cand) == -1) {
+            return -1;
+        }
+        pos = end + 1;
+    }
+    return 0;
+}
+
+static int grep_lines(void *ctx, const char *data, size_t len) {
+    return grep_block(ctx, data, len);
+}
+
+int grep_chunk(GrepScan *s, const char *data, size_t len) {
+    if (s->done || len == 0) {
+        return 0;
+    }
+    return carry_lines(&s->carry, data, len, grep_lines, s);
+}
+
+int grep_finish(GrepScan *s) {
+    int ret = 0;
+    if (s->carry.len > 0 && !s->done) {
+        ret = grep_block(s, s->carry.data, s->carry.len);
+    }
+    carry_free(&s->carry);
+    if (ret == -1) {
+        return -1;
+    }
+
+    unsigned flags = s->q->flags;
+    char buf[64];
+    if (flags & GREP_LIST) {
+        if (s->matches == 0) {
+            return 0;
+        }
+        const char *name = s->name ? s->name : GREP_STDIN_NAME;
+        if (s->emit(s->ctx, name, strlen(name)) == -1) {
+            return -1;
+        }
+        return s->emit(s->ctx, "\n", 1);
+    }
+    if (flags & GREP_COUNT) {
+        if (s->label && (s->emit(s->ctx, s->name, strlen(s->name)) == -1 ||
+                         s->emit(s->ctx, ":", 1) == -1)) {
+            return -1;
+        }
+        int n = snprintf(buf, sizeof(buf), "%lu\n", s->matches);
+        return s->emit(s->ctx, buf, n);
+    }
+    return 0;
+}
+
+// Stops the input once -l has its answer
+static int grep_fd_chunk(void *ctx, const char *data, size_t len) {
+    GrepScan *s = ctx;
+    return grep_chunk(s, data, len) == -1 ? -1 : s->done;
+}
+
+int grep_fd(GrepScan *s, int fd) {
+    // A mapped file is one chunk: whole lines but the last, which
+    // grep_finish takes like any partial line
+    int ret = fd_chunks(fd, GREP_READ_LEN, grep_fd_chunk, s);
+    if (grep_finish(s) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+
+// ===== Many files =====
+
+// The output of one file, held until the files before it are printed
+typedef struct {
+    char *text;
+    size_t len;
+    size_t cap;
+    int status;             // 0, or the GREP_ERR_* that stopped it
+    int done;               // Guarded by the batch's lock
+} GrepOut;
+
+// Files shared by the pool's workers, each claiming the next unclaimed one
+typedef struct {
+    char **paths;
+    size_t count;
+    const GrepQuery *q;
+    GrepOut *outs;
+    size_t next;            // Next file to claim (atomic)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // Signalled whenever a file is done
+} GrepBatch;
+
+#define GREP_ERR_OPEN 1
+#define GREP_ERR_READ 2
+
+// GrepEmit that appends to a GrepOut
+static int collect(void *ctx, const char *text, size_t len) {
+    GrepOut *out = ctx;
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(out->text, cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        out->text = grown;
+        out->cap = cap;
+    }
+    memcpy(out->text + out->len, text, len);
+    out->len += len;
+    return 0;
+}
+
+static void *grep_worker(void *arg) {
+    GrepBatch *batch = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        GrepOut *out = &batch->outs[i];
+        int fd = open(batch->paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            out->status = GREP_ERR_OPEN;
+        } else {
+            GrepScan s;
+            grep_scan_init(&s, batch->q, batch->paths[i], batch->count > 1, collect, out);
+            if (grep_fd(&s, fd) == -1) {
+                out->status = GREP_ERR_READ;
+            }
+            close(fd);
+        }
+        pthread_mutex_lock(&batch->lock);
+        out->done = 1;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+/* Searches count files on a bounded pool of threads while the calling
+ * thread prints their output in argument order, each file as soon as it
+ * and every file before it are done. As in wc_files, there are more
+ * workers than CPUs, up to GREP_MAX_THREADS, so one file's open() and
+ * page faults overlap with another's search.
+ */
+int grep_files(char **paths, size_t count, const GrepQuery *q, GrepEmit emit, void *ctx) {
+    GrepBatch batch = {.paths = paths, .count = count, .q = q};
+    batch.outs = calloc(count, sizeof(GrepOut));
+    if (batch.outs == NULL) {
+        display_error("ERROR: Memory allocation failed for grep", "");
+        return -1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers = cpus > 0 ? 2 * (size_t)cpus : 1;
+    if (nworkers < GREP_MIN_WORKERS) {
+        nworkers = GREP_MIN_WORKERS;
+    }
+    if (nworkers > GREP_MAX_THREADS) {
+        nworkers = GREP_MAX_THREADS;
+    }
+    if (nworkers > count) {
+        nworkers = count;
+    }
+    pthread_t workers[GREP_MAX_THREADS];
+    size_t started = 0;
+    while (started < nworkers &&
+           pthread_create(&workers[started], NULL, grep_worker, &batch) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        grep_worker(&batch);    // No threads: search everything here
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        GrepOut *out = &batch.outs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!out->done) {
+            pthread_cond_wait(&batch.cond, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        if (out->len > 0 && emit(ctx, out->text, out->len) == -1) {
+            // Nobody reads the rest: stop handing out files, and only join
+            // the workers, since files never claimed never become done
+            __atomic_store_n(&batch.next, count, __ATOMIC_RELAXED);
+            ret = -1;
+            break;
+        }
+        if (out->status != 0) {
+            display_error(out->status == GREP_ERR_OPEN ? "ERROR: Cannot open file: "
+                                                       : "ERROR: Cannot read input: ", paths[i]);
+            ret = -1;
+        }
+        free(out->text);
+        out->text = NULL;
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(batch.outs[i].text);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.cond);
+    free(batch.outs);
+    return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef __GREP_H__
+#define __GREP_H__
+
+#include <stddef.h>
+
+#include "io_helpers.h"
+#include "pattern.h"
+
+
+// grep options
+#define GREP_COUNT  0x1     // -c: print how many lines matched
+#define GREP_LIST   0x2     // -l: print the names of inputs with a match
+#define GREP_INVERT 0x4     // -v: select the lines that do not match
+#define GREP_ICASE  0x8     // -i: ignore case
+#define GREP_NUMBER 0x10    // -n: prefix lines with their number
+#define GREP_FIXED  0x20    // -F: the pattern is a literal string
+
+#define GREP_READ_LEN (1 << 20)     // Bytes per read() of unmappable input
+#define GREP_MAX_THREADS 16
+#define GREP_MIN_WORKERS 4          // Threads searching many files, even on one CPU
+
+
+typedef int (*GrepEmit)(void *ctx, const char *text, size_t len);
+
+/* A compiled grep pattern. Whole blocks of input are searched for needle
+ * (the literal itself, or the longest literal every regex match must
+ * contain) with a vector filter on its two rarest bytes; only the lines
+ * it hits are checked against the regex, if there is one.
+ */
+typedef struct {
+    unsigned flags;
+    Pattern pattern;
+    int has_pattern;        // Candidate lines must also match pattern
+    const char *needle;     // NULL: every line is a candidate
+    size_t needle_len;
+    int fold;               // needle is lower case and matches either case (-i -F)
+    size_t rare[2];         // Offsets in needle of the bytes the filter compares
+} GrepQuery;
+
+/* Search state of one input, which may arrive in chunks.
+ */
+typedef struct {
+    const GrepQuery *q;
+    const char *name;       // The input's name for -l, or NULL for stdin
+    int label;              // Print name before each line (several inputs)
+    GrepEmit emit;
+    void *ctx;
+    unsigned long line;     // Lines before the current position (with -n)
+    unsigned long matches;  // Selected lines so far
+    int done;               // -l has its answer: the rest can be skipped
+    LineCarry carry;        // Unfinished last line of the previous chunk
+} GrepScan;
+
+
+/* Parses the options (-c -l -v -i -n -F, and -E which is the default;
+ * letters may be combined) and the pattern of argv (argv[0] is the
+ * builtin's name) into q.
+ * Return: index of the first file operand, or -1 on an invalid option or
+ * pattern (already reported)
+ */
+int grep_parse(char **argv, GrepQuery *q);
+
+void grep_free(GrepQuery *q);
+
+/* Prepares s to search one input; name is the input's name for -l and
+ * for prefixing lines when there are several (label), or NULL.
+ */
+void grep_scan_init(GrepScan *s, const GrepQuery *q, const char *name, int label,
+                    GrepEmit emit, void *ctx);
+
+/* Searches the next len bytes of the input, which may end mid-line.
+ * Return: 0 on success, -1 if emit failed
+ */
+int grep_chunk(GrepScan *s, const char *data, size_t len);
+
+/* Ends the input: searches its unfinished last line and prints the -c or
+ * -l result.
+ * Return: 0 on success, -1 if emit failed
+ */
+int grep_finish(GrepScan *s);
+
+/* Searches the rest of fd and finishes s: a regular file is mapped and
+ * searched in one piece, anything else is read in GREP_READ_LEN blocks.
+ * Return: 0 on success, -1 on a read error or if emit failed
+ */
+int grep_fd(GrepScan *s, int fd);
+
+/* Searches count files on a pool of threads and emits each file's output
+ * whole, in argument order, as soon as it and the files before it are
+ * done. Files that cannot be read are reported and skipped.
+ * Return: 0 on success, -1 if a file failed or emit failed
+ */
+int grep_files(char **paths, size_t count, const GrepQuery *q, GrepEmit emit, void *ctx);
+
+
+#endif
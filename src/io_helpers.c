@@ -1,67 +1,793 @@
+#define _GNU_SOURCE  // For copy_file_range() and splice()
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "io_helpers.h"
 
 
 // ===== Output helpers =====
 
+__thread int io_in_fd = STDIN_FILENO;
+__thread int io_out_fd = STDOUT_FILENO;
+__thread int io_err_fd = STDERR_FILENO;
+
+// Pending output for one descriptor
+typedef struct {
+    int fd;                     // -1 while the slot is unbound
+    int line_flush;             // fd is a terminal: flush at every newline
+    size_t len;
+    char data[OUT_BUF_LEN];
+} OutBuf;
+
+// Per-thread buffers, so builtins on worker threads never share one.
+static __thread OutBuf *out_bufs = NULL;
+static __thread unsigned out_victim = 0;
+static pthread_key_t out_key;
+static pthread_once_t out_once = PTHREAD_ONCE_INIT;
+
+/* Writes every byte of the count buffers in iov to fd in as few writev()
+ * calls as the kernel allows.
+ * Return: 0 on success, -1 on error (e.g. EPIPE)
+ */
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Writes out b's pending bytes, followed by the len bytes at extra (if any)
+ * in the same writev().
+ * Return: 0 on success, -1 on error; the buffer is emptied either way
+ */
+static int flush_buf(OutBuf *b, const char *extra, size_t len) {
+    struct iovec iov[2];
+    int count = 0;
+    if (b->len > 0) {
+        iov[count++] = (struct iovec){b->data, b->len};
+    }
+    if (len > 0) {
+        iov[count++] = (struct iovec){(char *)extra, len};
+    }
+    b->len = 0;
+    return writev_all(b->fd, iov, count);
+}
+
+// Thread exit: write out and release that thread's buffers.
+static void release_bufs(void *arg) {
+    OutBuf *bufs = arg;
+    for (int i = 0; i < OUT_SLOTS; i++) {
+        if (bufs[i].fd != -1) {
+            flush_buf(&bufs[i], NULL, 0);
+        }
+    }
+    free(bufs);
+}
+
+// Forked child: the output buffered so far belongs to the parent.
+static void discard_after_fork(void) {
+    if (out_bufs != NULL) {
+        for (int i = 0; i < OUT_SLOTS; i++) {
+            out_bufs[i].fd = -1;
+            out_bufs[i].len = 0;
+        }
+    }
+}
+
+static void create_out_key(void) {
+    pthread_key_create(&out_key, release_bufs);
+    pthread_atfork(out_flush_all, NULL, discard_after_fork);
+}
+
+/* Return: the calling thread's buffer for fd, binding a slot to it (and
+ * flushing the slot's previous descriptor) if needed; NULL if the buffers
+ * could not be allocated
+ */
+static OutBuf *out_buf(int fd) {
+    if (out_bufs == NULL) {
+        pthread_once(&out_once, create_out_key);
+        out_bufs = malloc(OUT_SLOTS * sizeof(OutBuf));
+        if (out_bufs == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < OUT_SLOTS; i++) {
+            out_bufs[i].fd = -1;
+            out_bufs[i].len = 0;
+        }
+        pthread_setspecific(out_key, out_bufs);
+    }
+    OutBuf *free_slot = NULL;
+    for (int i = 0; i < OUT_SLOTS; i++) {
+        if (out_bufs[i].fd == fd) {
+            return &out_bufs[i];
+        }
+        if (out_bufs[i].fd == -1 && free_slot == NULL) {
+            free_slot = &out_bufs[i];
+        }
+    }
+    OutBuf *b = free_slot;
+    if (b == NULL) {
+        b = &out_bufs[out_victim++ % OUT_SLOTS];
+        flush_buf(b, NULL, 0);
+    }
+    b->fd = fd;
+    b->line_flush = isatty(fd);
+    b->len = 0;
+    return b;
+}
+
+/* Queues len bytes for fd. The buffer is written out with one writev()
+ * when the data does not fit (together with the data itself, so large
+ * writes are never copied), and at every newline when fd is a terminal.
+ * Return: 0 on success, -1 on a write error
+ */
+int out_write(int fd, const char *data, size_t len) {
+    OutBuf *b = out_buf(fd);
+    if (b == NULL) {
+        struct iovec iov = {(char *)data, len};
+        return writev_all(fd, &iov, 1);
+    }
+    if (b->len + len > OUT_BUF_LEN) {
+        return flush_buf(b, data, len);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    if (b->line_flush && memchr(data, '\n', len) != NULL) {
+        return flush_buf(b, NULL, 0);
+    }
+    return 0;
+}
+
+/* Writes out whatever the calling thread has buffered for fd.
+ * Return: 0 on success, -1 on a write error
+ */
+int out_flush(int fd) {
+    for (int i = 0; out_bufs != NULL && i < OUT_SLOTS; i++) {
+        if (out_bufs[i].fd == fd) {
+            return flush_buf(&out_bufs[i], NULL, 0);
+        }
+    }
+    return 0;
+}
+
+/* Writes out everything the calling thread has buffered and unbinds its
+ * buffers. Must be called before a buffered descriptor is closed or
+ * redirected, so bytes never land in whatever reuses its number.
+ */
+void out_flush_all(void) {
+    for (int i = 0; out_bufs != NULL && i < OUT_SLOTS; i++) {
+        if (out_bufs[i].fd != -1) {
+            flush_buf(&out_bufs[i], NULL, 0);
+            out_bufs[i].fd = -1;
+        }
+    }
+}
+
+/* Flushes and releases the calling thread's buffers; other threads release
+ * theirs when they exit.
+ */
+void out_free(void) {
+    if (out_bufs != NULL) {
+        out_flush_all();
+        pthread_setspecific(out_key, NULL);
+        free(out_bufs);
+        out_bufs = NULL;
+    }
+}
+
 /* Prereq: str is a NULL terminated string
  */
 void display_message(char *str) {
-    write(STDOUT_FILENO, str, strnlen(str, MAX_STR_LEN));
+    out_write(io_out_fd, str, strlen(str));
 }
 
 
-/* Prereq: pre_str, str are NULL terminated string
+/* Writes pre_str, str and a newline to stderr in one writev(), after any
+ * pending output so the two stay in order.
+ * Prereq: pre_str, str are NULL terminated string
  */
 void display_error(char *pre_str, char *str) {
-    write(STDERR_FILENO, pre_str, strnlen(pre_str, MAX_STR_LEN));
-    write(STDERR_FILENO, str, strnlen(str, MAX_STR_LEN));
-    write(STDERR_FILENO, "\n", 1);
+    out_flush_all();
+    struct iovec iov[3] = {
+        {pre_str, strlen(pre_str)},
+        {str, strlen(str)},
+        {"\n", 1},
+    };
+    writev_all(io_err_fd, iov, 3);
 }
 
 
-// ===== Input tokenizing =====
 
-/* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
- * Return: number of bytes read
+// ===== Kernel-side copies =====
+
+#define KERNEL_COPY_CHUNK (1 << 30)
+
+// In-kernel copy primitives, by the type of the output
+typedef enum {
+    COPY_RANGE,         // copy_file_range: file to file
+    COPY_SENDFILE,      // sendfile: file to file or socket
+    COPY_SPLICE,        // splice: anything to a pipe
+} CopyMethod;
+
+/* Copies the rest of in_fd to out_fd without passing the data through
+ * userspace: copy_file_range (falling back to sendfile) into a regular
+ * file, sendfile into a socket and splice into a pipe. The file offsets
+ * advance, so a caller can finish with an ordinary read/write loop.
+ * Return: bytes copied once in_fd hits EOF, or -1 if the copy must be
+ * finished in userspace
  */
-ssize_t get_input(char *in_ptr) {
-    int retval = read(STDIN_FILENO, in_ptr, MAX_STR_LEN+1); // Not a sanitizer issue since in_ptr is allocated as MAX_STR_LEN+1
-    int read_len = retval;
-    if (retval == -1) {
-        read_len = 0;
+ssize_t kernel_copy(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return -1;
     }
-    if (read_len > MAX_STR_LEN) {
-        read_len = 0;
-        retval = -1;
-        write(STDERR_FILENO, "ERROR: input line too long\n", strlen("ERROR: input line too long\n"));
-        int junk = 0;
-        while((junk = getchar()) != EOF && junk != '\n');
+    CopyMethod method;
+    if (S_ISFIFO(out_st.st_mode)) {
+        method = COPY_SPLICE;
+    } else if (!S_ISREG(in_st.st_mode)) {
+        return -1;  // copy_file_range and sendfile read from files only
+    } else if (S_ISREG(out_st.st_mode)) {
+        method = COPY_RANGE;
+    } else if (S_ISSOCK(out_st.st_mode)) {
+        method = COPY_SENDFILE;
+    } else {
+        return -1;  // Terminals and the like
     }
-    in_ptr[read_len] = '\0';
-    return retval;
+
+    ssize_t total = 0;
+    while (1) {
+        ssize_t n;
+        switch (method) {
+            case COPY_RANGE:
+                n = copy_file_range(in_fd, NULL, out_fd, NULL, KERNEL_COPY_CHUNK, 0);
+                break;
+            case COPY_SENDFILE:
+                n = sendfile(out_fd, in_fd, NULL, KERNEL_COPY_CHUNK);
+                break;
+            default:
+                n = splice(in_fd, NULL, out_fd, NULL, KERNEL_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+                break;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (method == COPY_RANGE) {
+                // Cross-filesystem, O_APPEND output or an old kernel: try sendfile.
+                method = COPY_SENDFILE;
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return total;
+        }
+        total += n;
+    }
+}
+
+
+// ===== Input reading =====
+
+void input_init(InputBuf *in, int fd) {
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    in->event_fd = -1;
 }
 
-/* Prereq: in_ptr is a string, tokens is of size >= len(in_ptr)
- * Warning: in_ptr is modified
- * Return: number of tokens.
+/* Makes get_input call on_event whenever event_fd becomes readable while
+ * it is blocked waiting for input.
  */
-size_t tokenize_input(char *in_ptr, char **tokens) {
-    // TODO: Remove unused attribute
-    char *curr_ptr = strtok(in_ptr, DELIMITERS);
-    size_t token_count = 0;
+void input_set_event(InputBuf *in, int event_fd, void (*on_event)(void)) {
+    in->event_fd = event_fd;
+    in->on_event = on_event;
+}
 
-    while (curr_ptr != NULL) {  // TODO: Fix this
-        // TODO: Fix this
-	tokens[token_count] = curr_ptr;
-	token_count++;
-	curr_ptr = strtok(NULL, DELIMITERS);
+/* Blocks until in->fd is readable, dispatching events that arrive meanwhile.
+ */
+static void input_wait(InputBuf *in) {
+    struct pollfd fds[2] = {
+        {.fd = in->fd, .events = POLLIN},
+        {.fd = in->event_fd, .events = POLLIN},
+    };
+    while (1) {
+        int ready = poll(fds, 2, -1);
+        if (ready == -1 && errno != EINTR) {
+            return;
+        }
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            in->on_event();
+        }
+        if (ready > 0 && fds[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+void input_free(InputBuf *in) {
+    free(in->data);
+    memset(in, 0, sizeof(*in));
+}
 
+/* Makes room for at least INPUT_CHUNK_LEN more bytes after tail. The partial
+ * line starting at head is moved to the front first, so the buffer only
+ * grows when a single line outgrows it.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int input_reserve(InputBuf *in) {
+    if (in->cap - in->tail > INPUT_CHUNK_LEN) {
+        return 0;
     }
-    tokens[token_count] = NULL;
-    return token_count;
+    if (in->head > 0) {
+        memmove(in->data, in->data + in->head, in->tail - in->head);
+        in->tail -= in->head;
+        in->head = 0;
+        if (in->cap - in->tail > INPUT_CHUNK_LEN) {
+            return 0;
+        }
+    }
+    size_t new_cap = in->cap ? in->cap * 2 : INPUT_CHUNK_LEN + 1;
+    while (new_cap - in->tail <= INPUT_CHUNK_LEN) {
+        new_cap *= 2;
+    }
+    char *new_data = realloc(in->data, new_cap);
+    if (new_data == NULL) {
+        display_error("ERROR: Memory allocation failed for input buffer", "");
+        return -1;
+    }
+    in->data = new_data;
+    in->cap = new_cap;
+    return 0;
+}
+
+/* Reads the next line of arbitrary length into in->line.
+ * Return: length of the line, or -1 on end of input / read error
+ */
+ssize_t get_input(InputBuf *in) {
+    size_t scan = in->head;
+
+    while (1) {
+        char *nl = (in->tail > scan) ? memchr(in->data + scan, '\n', in->tail - scan) : NULL;
+        if (nl != NULL) {
+            *nl = '\0';
+            in->line = in->data + in->head;
+            in->head = (nl - in->data) + 1;
+            return nl - in->line;
+        }
+
+        if (in->eof) {
+            if (in->tail == in->head) {
+                return -1;
+            }
+            // Last line without a trailing newline; reserve guarantees room for the '\0'.
+            in->data[in->tail] = '\0';
+            in->line = in->data + in->head;
+            ssize_t line_len = in->tail - in->head;
+            in->head = in->tail;
+            return line_len;
+        }
+
+        scan = in->tail - in->head;
+        if (input_reserve(in) == -1) {
+            return -1;
+        }
+        scan += in->head;
+
+        if (in->event_fd != -1) {
+            input_wait(in);
+        }
+        ssize_t n = read(in->fd, in->data + in->tail, in->cap - in->tail - 1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            in->eof = 1;
+        }
+        in->tail += n;
+    }
+}
+
+
+// ===== Chunked input =====
+
+// Return: 0 on success, -1 if memory runs out
+static int carry_append(LineCarry *carry, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (carry->len + len > carry->cap) {
+        size_t cap = carry->cap ? carry->cap : 256;
+        while (cap < carry->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(carry->data, cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        carry->data = grown;
+        carry->cap = cap;
+    }
+    memcpy(carry->data + carry->len, data, len);
+    carry->len += len;
+    return 0;
+}
+
+/* Hands the whole lines of the chunk data (len bytes, which may end
+ * mid-line) to block and keeps the unfinished last line in carry. Once a
+ * later chunk ends that line, it is handed to block on its own, newline
+ * included. At the end of input, what is left in carry is the caller's.
+ * Return: 0 on success, -1 if block failed or memory runs out
+ */
+int carry_lines(LineCarry *carry, const char *data, size_t len, ChunkFn block, void *ctx) {
+    if (carry->len > 0) {
+        // Finish the line the last chunk ended in
+        const char *nl = memchr(data, '\n', len);
+        size_t take = nl ? (size_t)(nl + 1 - data) : len;
+        if (carry_append(carry, data, take) == -1) {
+            return -1;
+        }
+        if (nl == NULL) {
+            return 0;
+        }
+        int ret = block(ctx, carry->data, carry->len);
+        carry->len = 0;
+        if (ret == -1) {
+            return -1;
+        }
+        data += take;
+        len -= take;
+    }
+    const char *last = memrchr(data, '\n', len);
+    size_t whole = last ? (size_t)(last + 1 - data) : 0;
+    if (whole > 0 && block(ctx, data, whole) == -1) {
+        return -1;
+    }
+    return carry_append(carry, data + whole, len - whole);
+}
+
+void carry_free(LineCarry *carry) {
+    free(carry->data);
+    carry->data = NULL;
+    carry->len = carry->cap = 0;
+}
+
+/* Maps the rest of fd if it is a non-empty regular file, and moves fd to
+ * its end, as if it had been read. The caller unmaps *size bytes.
+ * Return: the mapping, with the unread part starting at *off, or NULL if
+ * fd cannot be mapped
+ */
+char *map_rest(int fd, size_t *size, size_t *off) {
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= pos) {
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    lseek(fd, st.st_size, SEEK_SET);  // Consumed, as if read
+    *size = st.st_size;
+    *off = pos;
+    return map;
+}
+
+/* Feeds the rest of fd to chunk: a regular file is mapped and passed in
+ * one piece, anything else is read in read_len blocks.
+ * Return: 0 on success, -1 on a read error or if chunk failed
+ */
+int fd_chunks(int fd, size_t read_len, ChunkFn chunk, void *ctx) {
+    size_t size, off;
+    char *map = map_rest(fd, &size, &off);
+    if (map != NULL) {
+        int ret = chunk(ctx, map + off, size - off);
+        munmap(map, size);
+        return ret == -1 ? -1 : 0;
+    }
+
+    char *buf = malloc(read_len);
+    if (buf == NULL) {
+        return -1;
+    }
+    int ret = 0;
+    while (ret == 0) {
+        ssize_t n = read(fd, buf, read_len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+        ret = chunk(ctx, buf, n);
+    }
+    free(buf);
+    return ret == -1 ? -1 : 0;
+}
+
+
+// ===== Lexing =====
+
+#define CLS_DELIM    1
+#define CLS_OPERATOR 2
+#define CLS_SPECIAL  3  // Quotes, escapes, '$' and '`' inside words
+#define CLS_GLOB     4  // Pathname expansion metacharacters
+
+/* Character classes for the lexer; 0 means "plain word character".
+ */
+static const unsigned char LEX_CLASS[256] = {
+    [' '] = CLS_DELIM, ['\t'] = CLS_DELIM, ['\n'] = CLS_DELIM,
+    ['|'] = CLS_OPERATOR, ['&'] = CLS_OPERATOR, ['<'] = CLS_OPERATOR, ['>'] = CLS_OPERATOR,
+    ['\''] = CLS_SPECIAL, ['"'] = CLS_SPECIAL, ['\\'] = CLS_SPECIAL, ['$'] = CLS_SPECIAL,
+    ['`'] = CLS_SPECIAL,
+    ['*'] = CLS_GLOB, ['?'] = CLS_GLOB, ['['] = CLS_GLOB,
+};
+
+/* Makes room for n tokens in lx.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int lexer_reserve(Lexer *lx, size_t n) {
+    if (n <= lx->cap) {
+        return 0;
+    }
+    size_t new_cap = lx->cap ? lx->cap * 2 : 16;
+    while (new_cap < n) {
+        new_cap *= 2;
+    }
+    Token *new_toks = realloc(lx->toks, new_cap * sizeof(Token));
+    if (new_toks == NULL) {
+        display_error("ERROR: Memory allocation failed for tokens", "");
+        return -1;
+    }
+    lx->toks = new_toks;
+    lx->cap = new_cap;
+    return 0;
+}
+
+static int lexer_push(Lexer *lx, Token tok) {
+    if (lexer_reserve(lx, lx->count + 1) == -1) {
+        return -1;
+    }
+    lx->toks[lx->count++] = tok;
+    return 0;
+}
+
+/* Finds the end of the command substitution whose opening '(' of "$(" or
+ * opening '`' is at s[i]. Parentheses nest, and quotes and escapes inside
+ * are skipped, so "$(echo ')' | wc)" is one substitution.
+ * Return: index one past the closing ')' or '`', or -1 if it is unterminated
+ */
+ssize_t subst_end(const char *s, size_t len, size_t i) {
+    char open = s[i];
+    int depth = 1;
+    for (i++; i < len; i++) {
+        char c = s[i];
+        if (c == '\\') {
+            i++;
+        } else if (open == '`') {
+            if (c == '`') {
+                return i + 1;
+            }
+        } else if (c == '\'') {
+            const char *close = memchr(s + i + 1, '\'', len - i - 1);
+            if (close == NULL) {
+                return -1;
+            }
+            i = close - s;
+        } else if (c == '"') {
+            for (i++; i < len && s[i] != '"'; i++) {
+                i += s[i] == '\\';
+            }
+            if (i >= len) {
+                return -1;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/* Scans the word starting at line[i], recording what it contains in flags.
+ * Return: index one past the end of the word, or -1 on an unterminated quote
+ */
+static ssize_t lex_word(const char *line, size_t len, size_t i, unsigned *flags) {
+    while (i < len) {
+        unsigned char c = line[i];
+        unsigned char cls = LEX_CLASS[c];
+        if (cls == 0) {
+            i++;
+        } else if (cls == CLS_GLOB) {
+            *flags |= TOKF_GLOB;
+            i++;
+        } else if (cls != CLS_SPECIAL) {
+            break;
+        } else if (c == '\\') {
+            *flags |= TOKF_ESCAPED;
+            i += (i + 1 < len) ? 2 : 1;
+        } else if (c == '`' || (c == '$' && i + 1 < len && line[i + 1] == '(')) {
+            // The whole substitution, spaces and operators included, is one word
+            *flags |= TOKF_SUBST;
+            ssize_t end = subst_end(line, len, c == '$' ? i + 1 : i);
+            if (end == -1) {
+                return -1;
+            }
+            i = end;
+        } else if (c == '$') {
+            *flags |= TOKF_DOLLAR;
+            i++;
+        } else if (c == '\'') {
+            *flags |= TOKF_QUOTED;
+            const char *close = memchr(line + i + 1, '\'', len - i - 1);
+            if (close == NULL) {
+                return -1;
+            }
+            i = (close - line) + 1;
+        } else {
+            *flags |= TOKF_QUOTED;
+            i++;
+            while (i < len && line[i] != '"') {
+                if (line[i] == '\\' && i + 1 < len) {
+                    i++;
+                } else if (line[i] == '`' || (line[i] == '$' && i + 1 < len && line[i + 1] == '(')) {
+                    *flags |= TOKF_SUBST;
+                    ssize_t end = subst_end(line, len, line[i] == '$' ? i + 1 : i);
+                    if (end == -1) {
+                        return -1;
+                    }
+                    i = end;
+                    continue;
+                } else if (line[i] == '$') {
+                    *flags |= TOKF_DOLLAR;
+                }
+                i++;
+            }
+            if (i == len) {
+                return -1;
+            }
+            i++;
+        }
+    }
+    return i;
+}
+
+/* Splits line (of length len) into token views in lx->toks.
+ * Return: number of tokens, or -1 on a syntax error (e.g. unterminated quote)
+ */
+ssize_t lex_line(Lexer *lx, char *line, size_t len) {
+    lx->count = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        unsigned char c = line[i];
+        if (LEX_CLASS[c] == CLS_DELIM) {
+            i++;
+            continue;
+        }
+
+        Token tok = {line + i, 1, TOK_WORD, 0};
+        if (c == '|') {
+            tok.type = TOK_PIPE;
+        } else if (c == '&') {
+            tok.type = TOK_AMP;
+        } else if (c == '<') {
+            tok.type = TOK_REDIR_IN;
+        } else if (c == '>') {
+            tok.type = TOK_REDIR_OUT;
+            if (i + 1 < len && line[i + 1] == '>') {
+                tok.type = TOK_REDIR_APPEND;
+                tok.len = 2;
+            }
+        } else if (c == '2' && i + 1 < len && line[i + 1] == '>') {
+            tok.type = TOK_REDIR_ERR;
+            tok.len = 2;
+            if (i + 2 < len && line[i + 2] == '>') {
+                tok.type = TOK_REDIR_ERR_APPEND;
+                tok.len = 3;
+            }
+        } else {
+            ssize_t end = lex_word(line, len, i, &tok.flags);
+            if (end == -1) {
+                display_error("ERROR: Unterminated quote or substitution", "");
+                return -1;
+            }
+            tok.len = end - i;
+        }
+
+        if (lexer_push(lx, tok) == -1) {
+            return -1;
+        }
+        i += tok.len;
+    }
+    return lx->count;
+}
+
+/* Strips quotes and escapes of a word token in place and NULL terminates it.
+ * Operator tokens are returned as static strings ("|", ">", ...).
+ * Warning: the line buffer is modified
+ */
+char *token_text(Token *tok) {
+    switch (tok->type) {
+        case TOK_PIPE:             return "|";
+        case TOK_AMP:              return "&";
+        case TOK_REDIR_IN:         return "<";
+        case TOK_REDIR_OUT:        return ">";
+        case TOK_REDIR_APPEND:     return ">>";
+        case TOK_REDIR_ERR:        return "2>";
+        case TOK_REDIR_ERR_APPEND: return "2>>";
+        case TOK_WORD:             break;
+    }
+
+    char *src = tok->start;
+    char *end = tok->start + tok->len;
+    if (!(tok->flags & (TOKF_QUOTED | TOKF_ESCAPED))) {
+        *end = '\0';
+        return tok->start;
+    }
+
+    // Unquoting never lengthens a word, so it can be compacted in place.
+    char *dst = tok->start;
+    while (src < end) {
+        if (*src == '\\' && src + 1 < end) {
+            *dst++ = src[1];
+            src += 2;
+        } else if (*src == '\'') {
+            src++;
+            while (*src != '\'') {
+                *dst++ = *src++;
+            }
+            src++;
+        } else if (*src == '"') {
+            src++;
+            while (*src != '"') {
+                if (*src == '\\' && strchr("\"\\$`", src[1]) != NULL) {
+                    src++;
+                }
+                *dst++ = *src++;
+            }
+            src++;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    tok->len = dst - tok->start;
+    tok->flags &= ~(TOKF_QUOTED | TOKF_ESCAPED);
+    return tok->start;
+}
+
+void lexer_free(Lexer *lx) {
+    free(lx->toks);
+    memset(lx, 0, sizeof(*lx));
 }
@@ -6,25 +6,198 @@
 
 #define MAX_STR_LEN 128
 #define DELIMITERS " \t\n"     // Assumption: all input tokens are whitespace delimited
+#define INPUT_CHUNK_LEN 65536  // Bytes requested from the kernel per read() on stdin
 
 
-/* Prereq: pre_str, str are NULL terminated string
+/* Standard input, output and error of the calling thread (0, 1 and 2 by
+ * default). Builtins running as pipeline stages on worker threads get their
+ * pipe ends here, so builtins must do their I/O through these.
+ */
+extern __thread int io_in_fd;
+extern __thread int io_out_fd;
+extern __thread int io_err_fd;
+
+
+/* Builtin output is buffered per thread and per descriptor, and written
+ * out in large writev() calls: when a buffer fills, at every newline on a
+ * terminal, and on an explicit flush. Lengths are not limited.
+ */
+#define OUT_BUF_LEN 65536   // Bytes buffered per descriptor
+#define OUT_SLOTS 2         // Descriptors buffered per thread (stdout, stderr)
+
+/* Queues len bytes for fd, writing the buffer out when it fills.
+ * Return: 0 on success, -1 on a write error
+ */
+int out_write(int fd, const char *data, size_t len);
+
+/* Writes out whatever the calling thread has buffered for fd.
+ * Return: 0 on success, -1 on a write error
+ */
+int out_flush(int fd);
+
+/* Writes out everything the calling thread has buffered and unbinds its
+ * buffers. Must be called before a buffered descriptor is closed or
+ * redirected.
+ */
+void out_flush_all(void);
+
+/* Flushes and releases the calling thread's buffers.
+ */
+void out_free(void);
+
+/* display_message is buffered; display_error first flushes pending output,
+ * then writes unbuffered.
+ * Prereq: pre_str, str are NULL terminated string
  */
 void display_message(char *str);
 void display_error(char *pre_str, char *str);
 
 
-/* Prereq: in_ptr points to a character buffer of size > MAX_STR_LEN
- * Return: number of bytes read
+/* Copies the rest of in_fd to out_fd without passing the data through
+ * userspace: copy_file_range (falling back to sendfile) into a regular
+ * file, sendfile into a socket and splice into a pipe. The file offsets
+ * advance, so a caller can finish with an ordinary read/write loop.
+ * Return: bytes copied once in_fd hits EOF, or -1 if the copy must be
+ * finished in userspace
  */
-ssize_t get_input(char *in_ptr);
+ssize_t kernel_copy(int in_fd, int out_fd);
 
 
-/* Prereq: in_ptr is a string, tokens is of size >= len(in_ptr)
- * Warning: in_ptr is modified
- * Return: number of tokens.
+// ===== Input reading =====
+
+/* Growable line reader. Bytes are read from fd in large chunks and handed
+ * out one line at a time; the current line lives inside data and stays
+ * valid (and writable) until the next call to get_input.
+ */
+typedef struct {
+    int fd;
+    char *data;
+    size_t cap;
+    size_t head;        // First byte not yet handed out as part of a line
+    size_t tail;        // One past the last byte read from fd
+    int eof;
+    char *line;         // Current line, NULL terminated, newline stripped
+    int event_fd;       // Polled alongside fd while waiting for input (-1 for none)
+    void (*on_event)(void);
+} InputBuf;
+
+void input_init(InputBuf *in, int fd);
+
+/* Makes get_input call on_event whenever event_fd becomes readable while
+ * it is blocked waiting for input.
+ */
+void input_set_event(InputBuf *in, int event_fd, void (*on_event)(void));
+void input_free(InputBuf *in);
+
+/* Reads the next line of arbitrary length into in->line.
+ * Return: length of the line, or -1 on end of input / read error
+ */
+ssize_t get_input(InputBuf *in);
+
+
+// ===== Chunked input =====
+
+/* Receives input in pieces: ctx, then len bytes at data.
+ * Return: 0 to go on, -1 on error (1 from a chunk passed to fd_chunks
+ * stops it early)
+ */
+typedef int (*ChunkFn)(void *ctx, const char *data, size_t len);
+
+/* Unfinished last line of a chunk, held until a later chunk ends it
  */
-size_t tokenize_input(char *in_ptr, char **tokens);
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} LineCarry;
+
+/* Hands the whole lines of the chunk data (len bytes, which may end
+ * mid-line) to block and keeps the unfinished last line in carry. Once a
+ * later chunk ends that line, it is handed to block on its own, newline
+ * included. At the end of input, what is left in carry is the caller's.
+ * Return: 0 on success, -1 if block failed or memory runs out
+ */
+int carry_lines(LineCarry *carry, const char *data, size_t len, ChunkFn block, void *ctx);
+
+void carry_free(LineCarry *carry);
+
+/* Maps the rest of fd if it is a non-empty regular file, and moves fd to
+ * its end, as if it had been read. The caller unmaps *size bytes.
+ * Return: the mapping, with the unread part starting at *off, or NULL if
+ * fd cannot be mapped
+ */
+char *map_rest(int fd, size_t *size, size_t *off);
+
+/* Feeds the rest of fd to chunk: a regular file is mapped and passed in
+ * one piece, anything else is read in read_len blocks.
+ * Return: 0 on success, -1 on a read error or if chunk failed
+ */
+int fd_chunks(int fd, size_t read_len, ChunkFn chunk, void *ctx);
+
+
+// ===== Lexing =====
+
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,           // |
+    TOK_AMP,            // &
+    TOK_REDIR_IN,       // <
+    TOK_REDIR_OUT,      // >
+    TOK_REDIR_APPEND,   // >>
+    TOK_REDIR_ERR,      // 2>
+    TOK_REDIR_ERR_APPEND // 2>>
+} TokenType;
+
+// Token flags describing what a TOK_WORD view contains
+#define TOKF_QUOTED  0x1    // Contains '...' or "..." sections
+#define TOKF_ESCAPED 0x2    // Contains a backslash escape
+#define TOKF_DOLLAR  0x4    // Contains a '$' outside single quotes
+#define TOKF_SUBST   0x8    // Contains a $(...) or `...` command substitution
+#define TOKF_GLOB    0x10   // Contains an unquoted '*', '?' or '['
+#define TOKF_ASSIGN  0x20   // Has the form name=value (set by expand_tokens, before unquoting)
+
+/* A token is a view into the line buffer: no bytes are copied while lexing.
+ * Word views are raw, i.e. they still contain their quotes and escapes.
+ */
+typedef struct {
+    char *start;
+    size_t len;
+    TokenType type;
+    unsigned flags;
+} Token;
+
+/* Reusable lexer state. The token array grows geometrically and keeps its
+ * capacity across lines, so lexing does not allocate per token.
+ */
+typedef struct {
+    Token *toks;
+    size_t count;
+    size_t cap;
+} Lexer;
+
+/* Splits line (of length len) into token views in lx->toks.
+ * Return: number of tokens, or -1 on a syntax error (e.g. unterminated quote)
+ */
+ssize_t lex_line(Lexer *lx, char *line, size_t len);
+
+/* Finds the end of the command substitution whose opening '(' of "$(" or
+ * opening '`' is at s[i].
+ * Return: index one past the closing ')' or '`', or -1 if it is unterminated
+ */
+ssize_t subst_end(const char *s, size_t len, size_t i);
+
+/* Makes room for n tokens in lx.
+ * Return: 0 on success, -1 on allocation failure
+ */
+int lexer_reserve(Lexer *lx, size_t n);
+
+/* Strips quotes and escapes of a word token in place and NULL terminates it.
+ * Operator tokens are returned as static strings ("|", ">", ...).
+ * Warning: the line buffer is modified
+ */
+char *token_text(Token *tok);
+
+void lexer_free(Lexer *lx);
 
 
 #endif
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE  // For PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "io_helpers.h"
+#include "jobs.h"
+#include "trace.h"
+
+
+static int sig_fd = -1;
+static sigset_t orig_mask;
+
+// Guards everything below: builtins run as pipeline stages (wait, top,
+// parallel) reach the job table from worker threads. Recursive, so a caller
+// holding it across several calls (jobs_lock) can still use the API.
+static pthread_mutex_t jobs_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// Open-addressing table of jobs keyed by pid (linear probing, backward-shift deletion).
+static Job **pid_table = NULL;
+static size_t pid_cap = 0;
+static size_t job_total = 0;
+
+// Jobs indexed by number (slot 0 unused) plus a stack of recycled numbers.
+static Job **by_number = NULL;
+static size_t number_cap = 0;
+static int next_number = 1;
+static int *free_numbers = NULL;
+static size_t free_count = 0;
+
+// Finished jobs awaiting wait/jobs, oldest first.
+static Job *history[JOB_HISTORY_LEN];
+static size_t history_count = 0;
+
+
+/* Blocks SIGCHLD and opens a signalfd through which children are reaped
+ * from the main loop instead of a signal handler.
+ * Return: the signalfd, or -1 on error
+ */
+int jobs_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) {
+        perror("signalfd");
+    }
+    return sig_fd;
+}
+
+/* Return: the fd that becomes readable when a child changes state
+ */
+int jobs_event_fd(void) {
+    return sig_fd;
+}
+
+/* Restores the signal mask in a freshly forked child before exec.
+ */
+void jobs_child_setup(void) {
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+    signal(SIGPIPE, SIG_DFL);   // The shell ignores it, but commands expect it
+}
+
+static size_t pid_slot(pid_t pid) {
+    return ((size_t)pid * 0x9E3779B97F4A7C15ULL) >> 32 & (pid_cap - 1);
+}
+
+static int pid_table_grow(void) {
+    size_t old_cap = pid_cap;
+    Job **old_table = pid_table;
+    size_t new_cap = pid_cap ? pid_cap * 2 : JOB_TABLE_MIN_CAP;
+    Job **new_table = calloc(new_cap, sizeof(Job *));
+    if (new_table == NULL) {
+        return -1;
+    }
+    pid_table = new_table;
+    pid_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old_table[i] != NULL) {
+            size_t j = pid_slot(old_table[i]->pid);
+            while (pid_table[j] != NULL) {
+                j = (j + 1) & (pid_cap - 1);
+            }
+            pid_table[j] = old_table[i];
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+/* Return: a free job number, or -1 on allocation failure
+ */
+static int take_job_number(void) {
+    if (free_count > 0) {
+        return free_numbers[--free_count];
+    }
+    if ((size_t)next_number >= number_cap) {
+        size_t new_cap = number_cap ? number_cap * 2 : JOB_TABLE_MIN_CAP;
+        Job **new_by_number = realloc(by_number, new_cap * sizeof(Job *));
+        int *new_free = realloc(free_numbers, new_cap * sizeof(int));
+        if (new_by_number != NULL) {
+            by_number = new_by_number;
+        }
+        if (new_free != NULL) {
+            free_numbers = new_free;
+        }
+        if (new_by_number == NULL || new_free == NULL) {
+            return -1;
+        }
+        memset(by_number + number_cap, 0, (new_cap - number_cap) * sizeof(Job *));
+        number_cap = new_cap;
+    }
+    return next_number++;
+}
+
+/* Return: argv joined with single spaces in a new allocation, or NULL
+ */
+static char *join_argv(char **argv) {
+    size_t len = 1;
+    for (int i = 0; argv[i] != NULL; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    char *command = malloc(len);
+    if (command == NULL) {
+        return NULL;
+    }
+    char *p = command;
+    for (int i = 0; argv[i] != NULL; i++) {
+        size_t n = strlen(argv[i]);
+        memcpy(p, argv[i], n);
+        p += n;
+        if (argv[i + 1] != NULL) {
+            *p++ = ' ';
+        }
+    }
+    *p = '\0';
+    return command;
+}
+
+/* Starts tracking pid under a recycled job number (or the next unused one).
+ * Return: the new job, or NULL on allocation failure
+ */
+Job *job_add(pid_t pid, char **argv, unsigned flags) {
+    pthread_mutex_lock(&jobs_mutex);
+    if ((job_total + 1) * 2 > pid_cap && pid_table_grow() == -1) {
+        pthread_mutex_unlock(&jobs_mutex);
+        display_error("ERROR: Memory allocation failed for job table", "");
+        return NULL;
+    }
+    Job *job = calloc(1, sizeof(Job));
+    char *command = join_argv(argv);
+    int job_number = (job != NULL && command != NULL) ? take_job_number() : -1;
+    if (job_number == -1) {
+        pthread_mutex_unlock(&jobs_mutex);
+        display_error("ERROR: Memory allocation failed for job", "");
+        free(job);
+        free(command);
+        return NULL;
+    }
+
+    job->job_number = job_number;
+    job->pid = pid;
+    job->command = command;
+    job->flags = flags;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    size_t i = pid_slot(pid);
+    while (pid_table[i] != NULL) {
+        i = (i + 1) & (pid_cap - 1);
+    }
+    pid_table[i] = job;
+    by_number[job_number] = job;
+    job_total++;
+    pthread_mutex_unlock(&jobs_mutex);
+    return job;
+}
+
+/* Return: the job for pid, or NULL if it is not tracked
+ */
+Job *job_find_pid(pid_t pid) {
+    Job *job = NULL;
+    pthread_mutex_lock(&jobs_mutex);
+    for (size_t i = pid_slot(pid); pid_cap > 0 && pid_table[i] != NULL; i = (i + 1) & (pid_cap - 1)) {
+        if (pid_table[i]->pid == pid) {
+            job = pid_table[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+    return job;
+}
+
+/* Return: the job with job_number, or NULL if it is not tracked
+ */
+Job *job_find_number(int job_number) {
+    pthread_mutex_lock(&jobs_mutex);
+    Job *job = job_number > 0 && (size_t)job_number < number_cap ? by_number[job_number] : NULL;
+    pthread_mutex_unlock(&jobs_mutex);
+    return job;
+}
+
+/* Removes job from the pid table and recycles its job number.
+ */
+static void job_unlink(Job *job) {
+    size_t mask = pid_cap - 1;
+    size_t i = pid_slot(job->pid);
+    while (pid_table[i] != job) {
+        i = (i + 1) & mask;
+    }
+    // Backward-shift deletion keeps probe chains intact without tombstones.
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (pid_table[j] == NULL) {
+            break;
+        }
+        size_t home = pid_slot(pid_table[j]->pid);
+        if (((j - home) & mask) < ((j - i) & mask)) {
+            continue;   // Its home slot lies in (i, j], so it must stay
+        }
+        pid_table[i] = pid_table[j];
+        i = j;
+    }
+    pid_table[i] = NULL;
+
+    by_number[job->job_number] = NULL;
+    free_numbers[free_count++] = job->job_number;
+    job_total--;
+}
+
+static void job_destroy(Job *job) {
+    free(job->command);
+    free(job->launch);
+    free(job);
+}
+
+/* Stops tracking job and recycles its job number.
+ */
+void job_remove(Job *job) {
+    pthread_mutex_lock(&jobs_mutex);
+    job_unlink(job);
+    job_destroy(job);
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Moves a finished job into the history, evicting the oldest entry if full.
+ */
+static void job_retire(Job *job) {
+    job_unlink(job);
+    if (history_count == JOB_HISTORY_LEN) {
+        job_destroy(history[0]);
+        memmove(history, history + 1, (JOB_HISTORY_LEN - 1) * sizeof(Job *));
+        history_count--;
+    }
+    history[history_count++] = job;
+}
+
+/* Return: the most recent finished job with pid / job_number, or NULL
+ */
+Job *job_find_finished(pid_t pid, int job_number) {
+    Job *found = NULL;
+    pthread_mutex_lock(&jobs_mutex);
+    for (size_t i = history_count; i > 0; i--) {
+        Job *job = history[i - 1];
+        if ((pid > 0 && job->pid == pid) || (job_number > 0 && job->job_number == job_number)) {
+            found = job;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+    return found;
+}
+
+/* Drops job from the finished-job history once it has been reported.
+ */
+void job_forget(Job *job) {
+    pthread_mutex_lock(&jobs_mutex);
+    for (size_t i = 0; i < history_count; i++) {
+        if (history[i] == job) {
+            memmove(history + i, history + i + 1, (history_count - i - 1) * sizeof(Job *));
+            history_count--;
+            job_destroy(job);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Calls fn for every finished job still in the history, oldest first.
+ */
+void jobs_for_each_finished(void (*fn)(Job *job, void *ctx), void *ctx) {
+    pthread_mutex_lock(&jobs_mutex);
+    for (size_t i = 0; i < history_count; i++) {
+        fn(history[i], ctx);
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Return: number of finished jobs in the history
+ */
+size_t jobs_finished_count(void) {
+    pthread_mutex_lock(&jobs_mutex);
+    size_t count = history_count;
+    pthread_mutex_unlock(&jobs_mutex);
+    return count;
+}
+
+/* Empties the finished-job history.
+ */
+void jobs_clear_finished(void) {
+    pthread_mutex_lock(&jobs_mutex);
+    for (size_t i = 0; i < history_count; i++) {
+        job_destroy(history[i]);
+    }
+    history_count = 0;
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Formats "exit S" (or "signal N") plus CPU time, max RSS, context switches
+ * and block I/O into buf.
+ */
+void format_usage(char *buf, size_t size, int status, const struct rusage *usage) {
+    int code = WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status);
+    snprintf(buf, size,
+             "%s %d user %ld.%03lds sys %ld.%03lds maxrss %ldKB ctxsw %ld/%ld io %ld/%ld",
+             WIFSIGNALED(status) ? "signal" : "exit", code,
+             (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000,
+             (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000,
+             usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+             usage->ru_inblock, usage->ru_oublock);
+}
+
+/* Waits for a specific child (retrying on EINTR) and collects its usage.
+ * Return: pid, or -1 on error
+ */
+pid_t wait_child(pid_t pid, int *status, struct rusage *usage) {
+    pid_t ret;
+    TRACE_BEGIN(wait_span);
+    do {
+        ret = wait4(pid, status, 0, usage);
+    } while (ret == -1 && errno == EINTR);
+    TRACE_END(wait_span, "waitpid", NULL);
+    return ret;
+}
+
+/* Prints the "Done" notice for a finished background job.
+ */
+static void report_done(Job *job) {
+    char msg[128];
+    if (WIFSIGNALED(job->status)) {
+        // Process was terminated by a signal.
+        snprintf(msg, sizeof(msg), "[%d]+  Done: ", job->job_number);
+        display_message(msg);
+        display_message(job->command);
+        display_message("\n");
+    } else {
+        // Process exited normally.
+        snprintf(msg, sizeof(msg), "[%d]+  Done\n", job->job_number);
+        display_message(msg);
+    }
+}
+
+/* Reaps job if it has exited, collecting its resource usage.
+ * Prereq: jobs_mutex is held
+ */
+static void reap_job(Job *job) {
+    int status;
+    struct rusage usage;
+    if (job->done || wait4(job->pid, &status, WNOHANG, &usage) <= 0) {
+        return;
+    }
+    TRACE_INSTANT("reap", job->command);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->wall = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+    job->done = 1;
+    job->status = status;
+    job->usage = usage;
+    if (!(job->flags & JOB_QUIET)) {
+        report_done(job);
+        job_retire(job);
+    }
+}
+
+/* Reaps every tracked job that has exited, collecting its resource usage.
+ * Finished jobs print their "Done" notice and move to the finished-job
+ * history unless they are JOB_QUIET, in which case they are only marked done
+ * for their owner to collect. Jobs are reaped by pid, so each exit costs a
+ * hash lookup rather than a pass over every job. Only tracked pids are
+ * waited for: a foreground child may be exiting while a pipeline stage
+ * reaps, and its status belongs to whoever is blocked in wait_child().
+ */
+void jobs_reap(void) {
+    pthread_mutex_lock(&jobs_mutex);
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    while (sig_fd != -1 && (n = read(sig_fd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < n / sizeof(info[0]); i++) {
+            Job *job = job_find_pid(info[i].ssi_pid);
+            if (job != NULL) {
+                reap_job(job);
+            }
+        }
+    }
+
+    // SIGCHLDs coalesce, so a record may stand for several exits: peek at
+    // the next exited child without reaping it, and take it only if it is
+    // a job. Anyone else's child is left to its waiter.
+    while (1) {
+        siginfo_t si;
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT) == -1 || si.si_pid == 0) {
+            break;
+        }
+        Job *job = job_find_pid(si.si_pid);
+        if (job == NULL || job->done) {
+            break;
+        }
+        reap_job(job);
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Blocks until some child changes state (or JOBS_EVENT_POLL_MS pass), then
+ * reaps.
+ */
+void jobs_wait_event(void) {
+    struct pollfd pfd = {.fd = sig_fd, .events = POLLIN};
+    while (poll(&pfd, 1, JOBS_EVENT_POLL_MS) == -1 && errno == EINTR) {
+    }
+    jobs_reap();
+}
+
+void jobs_lock(void) {
+    pthread_mutex_lock(&jobs_mutex);
+}
+
+void jobs_unlock(void) {
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Calls fn for every tracked job in job-number order.
+ */
+void jobs_for_each(void (*fn)(Job *job, void *ctx), void *ctx) {
+    pthread_mutex_lock(&jobs_mutex);
+    for (int n = 1; n < next_number; n++) {
+        if (by_number[n] != NULL) {
+            fn(by_number[n], ctx);
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/* Return: number of tracked jobs
+ */
+size_t jobs_count(void) {
+    pthread_mutex_lock(&jobs_mutex);
+    size_t count = job_total;
+    pthread_mutex_unlock(&jobs_mutex);
+    return count;
+}
+
+/* Frees the job table on exit.
+ */
+void jobs_free(void) {
+    for (int n = 1; n < next_number; n++) {
+        if (by_number[n] != NULL) {
+            job_destroy(by_number[n]);
+        }
+    }
+    jobs_clear_finished();
+    free(pid_table);
+    free(by_number);
+    free(free_numbers);
+    pid_table = NULL;
+    by_number = NULL;
+    free_numbers = NULL;
+    pid_cap = number_cap = job_total = free_count = 0;
+    next_number = 1;
+    if (sig_fd != -1) {
+        close(sig_fd);
+        sig_fd = -1;
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+
+#define JOB_TABLE_MIN_CAP 64   // Initial pid-table size; always a power of two
+#define JOB_HISTORY_LEN 64     // Finished jobs kept for wait/jobs until reported
+#define USAGE_STR_LEN 192      // Buffer size for format_usage
+#define JOBS_EVENT_POLL_MS 100 // Longest wait for a SIGCHLD another thread may have drained
+
+// Job flags
+#define JOB_QUIET 0x1   // Reaped without a "Done" notice (the owner reports it)
+
+
+/* A tracked child process. Jobs live in a pid-keyed hash table and are
+ * also indexed by job number, so both lookups are O(1).
+ */
+typedef struct Job {
+    int job_number;
+    pid_t pid;
+    char *command;      // Space separated argv, owned by the job
+    unsigned flags;
+    int done;
+    int status;         // waitpid() status once done
+    struct rusage usage;        // From wait4() once done
+    struct timespec started;    // CLOCK_MONOTONIC at launch
+    double wall;                // Seconds from launch to exit once done
+    struct LaunchOpts *launch;  // Options the job was started with by 'run' (owned), or NULL
+} Job;
+
+
+/* Blocks SIGCHLD and opens a signalfd through which children are reaped
+ * from the main loop instead of a signal handler.
+ * Return: the signalfd, or -1 on error
+ */
+int jobs_init(void);
+
+/* Return: the fd that becomes readable when a child changes state
+ */
+int jobs_event_fd(void);
+
+/* Restores the signal mask (and SIGPIPE) in a freshly forked child before
+ * exec.
+ */
+void jobs_child_setup(void);
+
+/* Starts tracking pid under a recycled job number (or the next unused one).
+ * Return: the new job, or NULL on allocation failure
+ */
+Job *job_add(pid_t pid, char **argv, unsigned flags);
+
+/* Return: the job for pid / job_number, or NULL if it is not tracked
+ */
+Job *job_find_pid(pid_t pid);
+Job *job_find_number(int job_number);
+
+/* Stops tracking job and recycles its job number.
+ */
+void job_remove(Job *job);
+
+/* Reaps every tracked job that has exited, collecting its resource usage.
+ * Finished jobs print their "Done" notice and move to the finished-job
+ * history unless they are JOB_QUIET, in which case they are only marked done
+ * for their owner to collect. Untracked children are left to their waiters.
+ */
+void jobs_reap(void);
+
+/* Blocks until some child changes state (or JOBS_EVENT_POLL_MS pass), then
+ * reaps.
+ */
+void jobs_wait_event(void);
+
+/* Holds the job table across several calls, so that a Job found by one is
+ * not reaped and freed by another thread before the caller is done with it.
+ * Every other function here takes the lock itself.
+ */
+void jobs_lock(void);
+void jobs_unlock(void);
+
+/* Waits for a specific child (retrying on EINTR) and collects its usage.
+ * Return: pid, or -1 on error
+ */
+pid_t wait_child(pid_t pid, int *status, struct rusage *usage);
+
+/* Return: the most recent finished job with pid / job_number, or NULL
+ */
+Job *job_find_finished(pid_t pid, int job_number);
+
+/* Drops job from the finished-job history once it has been reported.
+ */
+void job_forget(Job *job);
+
+/* Calls fn for every finished job still in the history, oldest first.
+ */
+void jobs_for_each_finished(void (*fn)(Job *job, void *ctx), void *ctx);
+
+/* Return: number of finished jobs in the history
+ */
+size_t jobs_finished_count(void);
+
+/* Empties the finished-job history.
+ */
+void jobs_clear_finished(void);
+
+/* Formats "exit S" (or "signal N") plus CPU time, max RSS, context switches
+ * and block I/O into buf.
+ */
+void format_usage(char *buf, size_t size, int status, const struct rusage *usage);
+
+/* Calls fn for every tracked job in job-number order.
+ */
+void jobs_for_each(void (*fn)(Job *job, void *ctx), void *ctx);
+
+/* Return: number of tracked jobs
+ */
+size_t jobs_count(void);
+
+/* Frees the job table on exit.
+ */
+void jobs_free(void);
+
+
+#endif
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE  // For cpu_set_t and sched_setaffinity()
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "io_helpers.h"
+#include "launch.h"
+
+
+/* Parses "0,2-5,8" into set.
+ * Return: 0 on success, -1 on a malformed list
+ */
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (1) {
+        char *end;
+        if (!isdigit((unsigned char)*p)) {
+            return -1;
+        }
+        long first = strtol(p, &end, 10);
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            if (!isdigit((unsigned char)p[1])) {
+                return -1;
+            }
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+/* Formats set back into the compact "0,2-5,8" form.
+ */
+void format_cpu_list(char *buf, size_t size, const cpu_set_t *set) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        const char *sep = len > 0 ? "," : "";
+        if (last == cpu) {
+            len += snprintf(buf + len, size - len, "%s%d", sep, cpu);
+        } else {
+            len += snprintf(buf + len, size - len, "%s%d-%d", sep, cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+/* Return: bytes for a size like "512M" or "2G" (plain numbers are bytes),
+ * or 0 if it is malformed
+ */
+static rlim_t parse_size(const char *str) {
+    char *end;
+    if (!isdigit((unsigned char)str[0])) {
+        return 0;
+    }
+    double value = strtod(str, &end);
+    rlim_t scale = 1;
+    switch (*end) {
+        case 'K': case 'k': scale = 1ULL << 10; end++; break;
+        case 'M': case 'm': scale = 1ULL << 20; end++; break;
+        case 'G': case 'g': scale = 1ULL << 30; end++; break;
+        case 'T': case 't': scale = 1ULL << 40; end++; break;
+    }
+    if (*end != '\0' || value <= 0) {
+        return 0;
+    }
+    return (rlim_t)(value * scale);
+}
+
+/* Parses the leading --cpus LIST, --nice N and --mem SIZE options of argv
+ * (argv[0] is the builtin's name), up to an optional "--".
+ * Return: index of the first word of the command, or -1 on an invalid
+ * option (already reported)
+ */
+int launch_parse(char **argv, LaunchOpts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    int i = 1;
+    while (argv[i] != NULL && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        const char *value = argv[i + 1];
+        if (value == NULL) {
+            display_error("ERROR: Missing value for: ", argv[i]);
+            return -1;
+        }
+        if (strcmp(argv[i], "--cpus") == 0) {
+            if (parse_cpu_list(value, &opts->cpus) == -1) {
+                display_error("ERROR: Invalid CPU list: ", (char *)value);
+                return -1;
+            }
+            opts->has_cpus = 1;
+        } else if (strcmp(argv[i], "--nice") == 0) {
+            char *end;
+            long nice = strtol(value, &end, 10);
+            if (*end != '\0' || end == value || nice < -20 || nice > 19) {
+                display_error("ERROR: Invalid nice value: ", (char *)value);
+                return -1;
+            }
+            opts->has_nice = 1;
+            opts->nice = nice;
+        } else if (strcmp(argv[i], "--mem") == 0) {
+            opts->mem = parse_size(value);
+            if (opts->mem == 0) {
+                display_error("ERROR: Invalid memory size: ", (char *)value);
+                return -1;
+            }
+            opts->has_mem = 1;
+        } else {
+            display_error("ERROR: Unknown option: ", argv[i]);
+            return -1;
+        }
+        i += 2;
+    }
+    if (argv[i] == NULL) {
+        display_error("ERROR: No command provided", "");
+        return -1;
+    }
+    return i;
+}
+
+/* Applies opts to the calling process; called in the child after fork.
+ * Return: 0 on success, -1 on error (errno set)
+ */
+int launch_apply(const LaunchOpts *opts) {
+    if (opts->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &opts->cpus) == -1) {
+        return -1;
+    }
+    if (opts->has_nice && setpriority(PRIO_PROCESS, 0, opts->nice) == -1) {
+        return -1;
+    }
+    if (opts->has_mem) {
+        struct rlimit limit = {opts->mem, opts->mem};
+        if (setrlimit(RLIMIT_AS, &limit) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Formats the options that are set as e.g. "cpus 2-5, nice 10, mem 2.0G".
+ */
+void format_launch(char *buf, size_t size, const LaunchOpts *opts) {
+    size_t len = 0;
+    buf[0] = '\0';
+    if (opts->has_cpus) {
+        char cpus[CPU_LIST_LEN];
+        format_cpu_list(cpus, sizeof(cpus), &opts->cpus);
+        len += snprintf(buf + len, size - len, "cpus %s", cpus);
+    }
+    if (opts->has_nice && len < size) {
+        len += snprintf(buf + len, size - len, "%snice %d", len ? ", " : "", opts->nice);
+    }
+    if (opts->has_mem && len < size) {
+        const char *sep = len ? ", " : "";
+        if (opts->mem >= 1ULL << 30) {
+            snprintf(buf + len, size - len, "%smem %.1fG", sep, opts->mem / (double)(1ULL << 30));
+        } else {
+            snprintf(buf + len, size - len, "%smem %.1fM", sep, opts->mem / (double)(1ULL << 20));
+        }
+    }
+}
+
+/* Moves every thread of pid to the CPUs in set.
+ * Return: number of threads moved, or -1 if none could be
+ */
+int pin_process(pid_t pid, const cpu_set_t *set) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        // No /proc: the main thread is the best we can do
+        return sched_setaffinity(pid, sizeof(cpu_set_t), set) == 0 ? 1 : -1;
+    }
+    int moved = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid > 0 && sched_setaffinity(tid, sizeof(cpu_set_t), set) == 0) {
+            moved++;
+        }
+    }
+    closedir(dir);
+    return moved > 0 ? moved : -1;
+}
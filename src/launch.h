@@ -0,0 +1,54 @@
+#ifndef __LAUNCH_H__
+#define __LAUNCH_H__
+
+#include <sched.h>          // cpu_set_t needs _GNU_SOURCE in the including file
+#include <sys/resource.h>
+
+
+#define CPU_LIST_LEN 128    // Buffer size for format_cpu_list
+
+
+/* Scheduling and resource limits applied to a child before exec.
+ */
+typedef struct LaunchOpts {
+    int has_cpus;
+    cpu_set_t cpus;         // Allowed CPUs (--cpus)
+    int has_nice;
+    int nice;               // Absolute nice value (--nice)
+    int has_mem;
+    rlim_t mem;             // Address-space limit in bytes (--mem)
+} LaunchOpts;
+
+
+/* Parses "0,2-5,8" into set.
+ * Return: 0 on success, -1 on a malformed list
+ */
+int parse_cpu_list(const char *list, cpu_set_t *set);
+
+/* Formats set back into the compact "0,2-5,8" form.
+ */
+void format_cpu_list(char *buf, size_t size, const cpu_set_t *set);
+
+/* Parses the leading --cpus LIST, --nice N and --mem SIZE options of argv
+ * (argv[0] is the builtin's name), up to an optional "--".
+ * Return: index of the first word of the command, or -1 on an invalid
+ * option (already reported)
+ */
+int launch_parse(char **argv, LaunchOpts *opts);
+
+/* Applies opts to the calling process; called in the child after fork.
+ * Return: 0 on success, -1 on error (errno set)
+ */
+int launch_apply(const LaunchOpts *opts);
+
+/* Formats the options that are set as e.g. "cpus 2-5, nice 10, mem 2.0G".
+ */
+void format_launch(char *buf, size_t size, const LaunchOpts *opts);
+
+/* Moves every thread of pid to the CPUs in set.
+ * Return: number of threads moved, or -1 if none could be
+ */
+int pin_process(pid_t pid, const cpu_set_t *set);
+
+
+#endif
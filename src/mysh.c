@@ -5,26 +5,20 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include "arena.h"
 #include "builtins.h"
+#include "commands.h"
+#include "expand.h"
+#include "jobs.h"
+#include "pathexp.h"
+#include "procstat.h"
+#include "trace.h"
 #include "variables.h"
 #include "io_helpers.h"
-#define MAX_EXPANDED_LEN 128  // Maximum allowed length after expansion
 
-void execute_pipe(char **cmd1, char **cmd2);
-int start_background_process(char **cmd);
-int execute_system_command(char **cmd);
+extern char **environ;
 
 
-int is_alnum_or_underscore(char c) {
-    if ((c >= 'A' && c <= 'Z') ||  // Uppercase letters
-        (c >= 'a' && c <= 'z') ||  // Lowercase letters
-        (c >= '0' && c <= '9') ||  // Digits
-        (c == '_')) {              // Underscore
-        return 1;  // Character is alphanumeric or underscore
-    }
-    return 0;  // Character is not alphanumeric or underscore
-}
-
 void sigint_handler(int signum) {
     (void)signum; // Suppress unused parameter warning
     // Print a newline and reprint the prompt:
@@ -37,24 +31,30 @@ int main(__attribute__((unused)) int argc,
          __attribute__((unused)) char* argv[]) {
     char *prompt = "mysh$ ";
 
-    char input_buf[MAX_STR_LEN + 1];
-    input_buf[MAX_STR_LEN] = '\0';
-    char *token_arr[MAX_STR_LEN] = {NULL};
+    InputBuf input;
+    input_init(&input, STDIN_FILENO);
+    Lexer lexer = {0};
+    Arena arena = {0};  // Owns every allocation made for the current command line
 
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigemptyset(&sa.sa_mask);
+    import_environment(environ);
+    trace_init();
 
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+    if (jobs_init() == -1) {
         exit(1);
     }
+    input_set_event(&input, jobs_event_fd(), jobs_reap);
+
+    struct sigaction sa;
     sa.sa_handler = sigint_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
     if (sigaction(SIGINT, &sa, NULL) == -1) {
         perror("sigaction");
         exit(1);
     }
+    // Builtin pipeline stages run in the shell; a closed pipe must be an
+    // EPIPE error for them rather than a fatal signal for the shell.
+    signal(SIGPIPE, SIG_IGN);
 
 
 
@@ -63,154 +63,100 @@ int main(__attribute__((unused)) int argc,
 
         // Display the prompt via the display_message function.
 	display_message(prompt);
+	out_flush(io_out_fd);
+
+        arena_reset(&arena);
+        TRACE_BEGIN(read_span);
+        ssize_t ret = get_input(&input);
+        TRACE_END(read_span, "get_input", NULL);
+        if (ret == -1) {
+		break;  // End of input
+        }
+        ExecProfile profile;
+        clock_gettime(CLOCK_MONOTONIC, &profile.start);
+        TRACE_BEGIN(lex_span);
+        ssize_t lexed = lex_line(&lexer, input.line, ret);
+        TRACE_END(lex_span, "lex_line", NULL);
+        if (lexed <= 0) {
+		continue;  // Blank line or syntax error
+        }
 
-        int ret = get_input(input_buf);
-        size_t token_count = tokenize_input(input_buf, token_arr);
+	// A leading unquoted 'time' profiles the rest of the line
+	int timed = 0;
+	Token *first = &lexer.toks[0];
+	if (first->type == TOK_WORD && first->flags == 0 && first->len == 4 &&
+	    memcmp(first->start, "time", 4) == 0) {
+		if (lexed == 1) {
+			display_error("ERROR: time: No command provided", "");
+			continue;
+		}
+		memmove(lexer.toks, lexer.toks + 1, (lexed - 1) * sizeof(Token));
+		lexer.count = --lexed;
+		timed = 1;
+	}
+	profile.parse = seconds_since(&profile.start);
+	struct timespec phase;
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+
+	// Expand variables and strip quotes; results live in the arena.
+	TRACE_BEGIN(expand_span);
+	char **token_arr = expand_tokens(&arena, &lexer);
+	TRACE_END(expand_span, "expand_tokens", NULL);
+	if (token_arr == NULL) {
+		continue;
+	}
+	profile.expand = seconds_since(&phase);
+        size_t token_count = lexer.count;   // Globs may have added words
 
         // Clean exit
-        if (ret != -1 && (token_count == 0 || (strcmp("exit", token_arr[0]) == 0))) {
+        if (strcmp("exit", token_arr[0]) == 0) {
 		break;
         }
 
     	// Check for a pipe in the command
     	int pipe_index = -1;
     	for (size_t i = 0; i < token_count; i++) {
-        	if (strcmp(token_arr[i], "|") == 0) {
+        	if (lexer.toks[i].type == TOK_PIPE) {
             		pipe_index = i;
             		break;
         	}
     	}
 
-	if (token_count >= 1 && pipe_index == -1) {
-    		// Check for variable assignment (e.g., myvar=hello)
+	if (pipe_index == -1 && (lexer.toks[0].flags & TOKF_ASSIGN)) {
+    		// Variable assignment (e.g., myvar=hello or myvar=pre${other}post)
     		char *equal_sign = strchr(token_arr[0], '=');
-
-    		if (equal_sign != NULL) {
-        		*equal_sign = '\0'; // Split key and value
-	 		char *key = token_arr[0];
-        		char *value = equal_sign + 1;
-		
-		if (value[0] == '$'){
-			const char *variable_key = value + 1;
-			const char *variable_value = get_variable(variable_key);
-			value = (char *)variable_value;
-		}
-	
-
-        	set_variable(key, value);
+        	*equal_sign = '\0'; // Split key and value
+        	set_variable(token_arr[0], equal_sign + 1);
         	continue; // Skip command execution
-    		}	
 	}
 
-	// Expand variables in command arguments
-
-	int was_allocated[token_count];  // Track dynamically allocated strings
-	memset(was_allocated, 0, sizeof(was_allocated));
-	int total_expaned_len = 0; 
-
-	for (size_t i = 0; i < token_count; i++) {
-    		char *orig = token_arr[i];
-
-    		if (orig[0] == '$') {
-        		char expanded[MAX_EXPANDED_LEN] = "";
-        		size_t expanded_len = 0;
-        		size_t orig_len = strlen(orig);
-
-        		for (size_t j = 0; j < orig_len;) {
-            			if (orig[j] == '$' && strlen(orig) == 1) {
-                			expanded[1] = '$';
-                			total_expaned_len++;
-            			}
-
-            			if (orig[j] == '$' && strlen(orig) != 1) {
-                			j++; // Skip the '$'
-                			char var_name[MAX_STR_LEN] = "";
-                			size_t var_len = 0;
-
-                			// Extract the variable name
-                			while (j < orig_len && is_alnum_or_underscore(orig[j])) {
-                    				var_name[var_len++] = orig[j++];
-                			}
-
-                			var_name[var_len] = '\0';
-                			const char *var_value = get_variable(var_name);
-
-                			if (var_value) {
-                    				// Append the variable value to expanded
-                    				var_len = strlen(var_value);
-                    				size_t remaining_space = MAX_EXPANDED_LEN - total_expaned_len;
-
-                    				if (remaining_space > 0) {
-                        				size_t copy_len = (var_len < remaining_space) ? var_len : remaining_space;
-                        				strncat(expanded, var_value, copy_len);
-                        				total_expaned_len += copy_len;
-                    				}
-                			}
-
-            			} else {
-                			// Append the current character to expanded
-                			char temp[2] = {orig[j++], '\0'};
-                			strncat(expanded, temp, MAX_EXPANDED_LEN - expanded_len - 1);
-                			expanded_len++;
-            			}
-							
-        		}
-        	token_arr[i] = strdup(expanded);
-        	was_allocated[i] = 1;
-    		}
+	clock_gettime(CLOCK_MONOTONIC, &phase);
+	TRACE_BEGIN(parse_span);
+	Pipeline *pipeline = parse_pipeline(&arena, &lexer, token_arr);
+	TRACE_END(parse_span, "parse_pipeline", NULL);
+	if (pipeline == NULL) {
+		continue;
 	}
-	
-	int suc = -1;
-	if (token_count >= 1) {
-		if (token_count >= 1 && strcmp(token_arr[token_count - 1], "&") == 0) {
-    			// Background process detected
-   			token_arr[token_count - 1] = NULL; // Remove '&' from the arguments
-    			suc = start_background_process(token_arr);
-		}
-
-    		if (pipe_index != -1) {
-        		// Handle pipe execution
-        		token_arr[pipe_index] = NULL; // Split the command into two parts
-
-        		// First command: tokens before the pipe
-        		char *cmd1[pipe_index + 1];
-        		for (int i = 0; i < pipe_index; i++) {
-            			cmd1[i] = token_arr[i];
-        		}			
-        		cmd1[pipe_index] = NULL;
-
-        		// Second command: tokens after the pipe
-        		char *cmd2[token_count - pipe_index];
-        		for (size_t i = pipe_index + 1, j = 0; i < token_count; i++, j++) {
-            			cmd2[j] = token_arr[i];
-        		}
-        		cmd2[token_count - pipe_index - 1] = NULL;
-
-        		// Execute the two commands with a pipe
-        		execute_pipe(cmd1, cmd2);
-    	} else {
-        	//check for a built-in function
-        	bn_ptr builtin_fn = check_builtin(token_arr[0]);
-        	if (builtin_fn != NULL) {
-            		ssize_t err = builtin_fn(token_arr);
-            	if (err == -1) {
-                	display_error("ERROR: Builtin failed: ", token_arr[0]);
-            	}
-        	} else if (builtin_fn == NULL && suc == -1){
-            		if (execute_system_command(token_arr) == -1) {
-        		display_error("ERROR: Unknown command: ", token_arr[0]);
-        		}
-		}
-    	}
-}
-
-
-	for (size_t i = 0; i < token_count; i++) {
-    		if (was_allocated[i]) {
-        		free(token_arr[i]);
-    		}
+	profile.parse += seconds_since(&phase);
+
+	if (timed && profile_init(&profile, &arena, pipeline) == 0) {
+		exec_profile = &profile;
+		run_pipeline(pipeline);
+		exec_profile = NULL;
+		profile.total = seconds_since(&profile.start);
+		profile_report(&profile);
+	} else {
+		run_pipeline(pipeline);
 	}
 }
+    out_free();
+    path_cache_free();
+    trace_stop();
+    jobs_free();
+    proc_free();
+    arena_free(&arena);
+    lexer_free(&lexer);
+    input_free(&input);
     free_variables();
 
     return 0;
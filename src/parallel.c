@@ -0,0 +1,396 @@
+#define _GNU_SOURCE  // For pipe2()
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "builtins.h"
+#include "io_helpers.h"
+#include "jobs.h"
+
+#define PARALLEL_READ_LEN 65536
+
+
+// One invocation of the command template.
+typedef struct {
+    size_t index;           // Position in input order
+    char *arg;              // Argument substituted for {} (owned if from stdin)
+    int owns_arg;
+    Job *job;
+    int out_fd;             // Read end of the captured stdout, -1 once drained
+    char *out;              // Captured output (ordered mode)
+    size_t out_len;
+    size_t out_cap;
+    struct timespec start;
+    double wall;            // Seconds from spawn to exit
+    int status;
+    struct rusage usage;
+    int exited;
+} ParallelTask;
+
+typedef struct {
+    char **tmpl;            // Command template, NULL terminated
+    int stream;             // Pass output straight through instead of ordering it
+    size_t max_jobs;
+    char **args;            // ::: arguments, or NULL to read them from stdin
+    size_t next_arg;
+    InputBuf input;         // Argument lines read from io_in_fd
+    int child_in;           // Stdin of every task: /dev/null when stdin holds the arguments
+    ParallelTask **tasks;   // Every task started so far, by index
+    size_t task_count;
+    size_t task_cap;
+    ParallelTask **busy;    // Tasks still running or with output left to read
+    struct pollfd *fds;     // Poll set over busy (after the SIGCHLD fd), reused between waits
+    size_t busy_count;
+    size_t busy_cap;
+    size_t running;
+    size_t next_to_print;
+    int failures;
+} ParallelRun;
+
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Return: next argument (from ::: or a line of the stage's stdin), or NULL
+ * when exhausted
+ */
+static char *next_argument(ParallelRun *run, int *owned) {
+    *owned = 0;
+    if (run->args != NULL) {
+        return run->args[run->next_arg] != NULL ? run->args[run->next_arg++] : NULL;
+    }
+    ssize_t len = get_input(&run->input);
+    if (len == -1) {
+        return NULL;
+    }
+    char *line = strndup(run->input.line, len);
+    *owned = line != NULL;
+    return line;
+}
+
+/* Builds the argv for one task: every "{}" in the template is replaced by
+ * arg, or arg is appended when the template has no placeholder.
+ * Return: malloc'd NULL terminated argv, or NULL on failure
+ */
+static char **build_argv(char **tmpl, char *arg) {
+    size_t n = 0;
+    int has_placeholder = 0;
+    while (tmpl[n] != NULL) {
+        has_placeholder |= strcmp(tmpl[n], "{}") == 0;
+        n++;
+    }
+    char **argv = malloc((n + 2) * sizeof(char *));
+    if (argv == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        argv[i] = strcmp(tmpl[i], "{}") == 0 ? arg : tmpl[i];
+    }
+    if (!has_placeholder) {
+        argv[n++] = arg;
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+/* Spawns the task for the next argument.
+ * Return: 1 if a task was started, 0 when out of arguments, -1 on error
+ */
+static int start_task(ParallelRun *run) {
+    int owned;
+    char *arg = next_argument(run, &owned);
+    if (arg == NULL) {
+        return 0;
+    }
+
+    if (run->task_count == run->task_cap) {
+        size_t new_cap = run->task_cap ? run->task_cap * 2 : 64;
+        ParallelTask **new_tasks = realloc(run->tasks, new_cap * sizeof(ParallelTask *));
+        if (new_tasks == NULL) {
+            if (owned) {
+                free(arg);
+            }
+            return -1;
+        }
+        run->tasks = new_tasks;
+        run->task_cap = new_cap;
+    }
+    if (run->busy_count == run->busy_cap) {
+        size_t new_cap = run->busy_cap ? run->busy_cap * 2 : 16;
+        ParallelTask **new_busy = realloc(run->busy, new_cap * sizeof(ParallelTask *));
+        if (new_busy != NULL) {
+            run->busy = new_busy;
+        }
+        struct pollfd *new_fds = realloc(run->fds, (new_cap + 1) * sizeof(struct pollfd));
+        if (new_fds != NULL) {
+            run->fds = new_fds;
+        }
+        if (new_busy == NULL || new_fds == NULL) {
+            if (owned) {
+                free(arg);
+            }
+            return -1;
+        }
+        run->busy_cap = new_cap;
+    }
+    ParallelTask *task = calloc(1, sizeof(ParallelTask));
+    char **argv = build_argv(run->tmpl, arg);
+    if (task == NULL || argv == NULL) {
+        free(task);
+        free(argv);
+        if (owned) {
+            free(arg);
+        }
+        return -1;
+    }
+    task->index = run->task_count;
+    task->arg = arg;
+    task->owns_arg = owned;
+    task->out_fd = -1;
+
+    int pipe_fd[2] = {-1, -1};
+    if (!run->stream && pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        free(argv);
+        free(task);
+        if (owned) {
+            free(arg);
+        }
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &task->start);
+    out_flush(io_out_fd);   // --stream children write straight after it
+    pid_t pid = spawn_command(argv, NULL, run->child_in,
+                              run->stream ? io_out_fd : pipe_fd[1], NULL);
+    if (pipe_fd[1] != -1) {
+        close(pipe_fd[1]);
+    }
+    if (pid != -1) {
+        task->job = job_add(pid, argv, JOB_QUIET);
+    }
+    free(argv);
+    if (pid == -1 || task->job == NULL) {
+        if (pipe_fd[0] != -1) {
+            close(pipe_fd[0]);
+        }
+        if (owned) {
+            free(arg);
+        }
+        free(task);
+        return -1;
+    }
+    task->out_fd = pipe_fd[0];
+    run->tasks[run->task_count++] = task;
+    run->busy[run->busy_count++] = task;
+    run->running++;
+    return 1;
+}
+
+/* Reads whatever the task's stdout pipe has available into its buffer.
+ */
+static void drain_output(ParallelTask *task) {
+    if (task->out_cap - task->out_len < PARALLEL_READ_LEN) {
+        size_t new_cap = task->out_cap ? task->out_cap * 2 : PARALLEL_READ_LEN;
+        while (new_cap - task->out_len < PARALLEL_READ_LEN) {
+            new_cap *= 2;
+        }
+        char *new_out = realloc(task->out, new_cap);
+        if (new_out == NULL) {
+            return;
+        }
+        task->out = new_out;
+        task->out_cap = new_cap;
+    }
+    ssize_t n = read(task->out_fd, task->out + task->out_len, task->out_cap - task->out_len);
+    if (n > 0) {
+        task->out_len += n;
+    } else if (n == 0 || errno != EINTR) {
+        close(task->out_fd);
+        task->out_fd = -1;
+    }
+}
+
+/* Prints the output and exit report of every finished task that is next in
+ * input order, then frees them.
+ */
+static void flush_finished(ParallelRun *run) {
+    while (run->next_to_print < run->task_count) {
+        ParallelTask *task = run->tasks[run->next_to_print];
+        if (!task->exited || task->out_fd != -1) {
+            break;
+        }
+        out_write(io_out_fd, task->out, task->out_len);
+
+        char usage[USAGE_STR_LEN];
+        char report[USAGE_STR_LEN + 64];
+        format_usage(usage, sizeof(usage), task->status, &task->usage);
+        snprintf(report, sizeof(report), "parallel: [%zu] %s wall %.3fs: ",
+                 task->index + 1, usage, task->wall);
+        display_error(report, task->arg);
+
+        if (task->owns_arg) {
+            free(task->arg);
+        }
+        free(task->out);
+        free(task);
+        run->tasks[run->next_to_print++] = NULL;
+    }
+}
+
+/* Blocks until a child exits or captured output arrives, then updates the
+ * busy tasks and drops those that have exited and been drained. Only busy
+ * tasks are looked at, so a wakeup costs the jobs in flight, however many
+ * finished ones wait to be printed behind a slow one.
+ */
+static void wait_for_progress(ParallelRun *run) {
+    struct pollfd *fds = run->fds;
+    fds[0].fd = jobs_event_fd();
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < run->busy_count; i++) {
+        fds[i + 1].fd = run->busy[i]->out_fd;   // poll() skips -1
+        fds[i + 1].events = POLLIN;
+        fds[i + 1].revents = 0;
+    }
+
+    // Another stage reaping jobs may drain the SIGCHLD first: look again
+    // every JOBS_EVENT_POLL_MS regardless
+    int ready = poll(fds, run->busy_count + 1, JOBS_EVENT_POLL_MS);
+    if (ready == -1) {
+        return;
+    }
+    for (size_t i = 0; i < run->busy_count; i++) {
+        if (fds[i + 1].revents != 0) {
+            drain_output(run->busy[i]);
+        }
+    }
+    if (ready == 0 || (fds[0].revents & POLLIN)) {
+        jobs_reap();    // Not when only output arrived
+    }
+    jobs_lock();
+    size_t kept = 0;
+    for (size_t i = 0; i < run->busy_count; i++) {
+        ParallelTask *task = run->busy[i];
+        if (task->job != NULL && task->job->done) {
+            task->status = task->job->status;
+            task->usage = task->job->usage;
+            task->wall = elapsed_since(&task->start);
+            task->exited = 1;
+            if (!WIFEXITED(task->status) || WEXITSTATUS(task->status) != 0) {
+                run->failures++;
+            }
+            job_remove(task->job);
+            task->job = NULL;
+            run->running--;
+        }
+        if (!task->exited || task->out_fd != -1) {
+            run->busy[kept++] = task;
+        }
+    }
+    run->busy_count = kept;
+    jobs_unlock();
+}
+
+/*
+ * bn_parallel - Builtin function for the "parallel" command.
+ *
+ * Usage: parallel [-j N] [--stream] command [args...] [::: arg...]
+ *  - Runs command once per argument, with at most N children at a time
+ *    (default: number of online CPUs). "{}" in the command is replaced by
+ *    the argument; otherwise the argument is appended.
+ *  - Without ":::", arguments are read from stdin, one per line, and the
+ *    jobs' stdin is /dev/null.
+ *  - Output of each job is printed whole and in input order, unless
+ *    --stream is given, in which case children write straight to stdout.
+ *  - Every job's exit status and wall time are reported on stderr.
+ *
+ * Returns 0 if every job succeeded and -1 otherwise.
+ */
+ssize_t bn_parallel(char **tokens) {
+    ParallelRun run = {0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    run.max_jobs = cpus > 0 ? cpus : 1;
+
+    int i = 1;
+    while (tokens[i] != NULL && tokens[i][0] == '-') {
+        if (strcmp(tokens[i], "-j") == 0) {
+            if (tokens[i + 1] == NULL || atoi(tokens[i + 1]) < 1) {
+                display_error("ERROR: Invalid job count: ", tokens[i + 1] ? tokens[i + 1] : "");
+                return -1;
+            }
+            run.max_jobs = atoi(tokens[i + 1]);
+            i += 2;
+        } else if (strcmp(tokens[i], "--stream") == 0) {
+            run.stream = 1;
+            i++;
+        } else {
+            display_error("ERROR: Unknown option: ", tokens[i]);
+            return -1;
+        }
+    }
+    if (tokens[i] == NULL || strcmp(tokens[i], ":::") == 0) {
+        display_error("ERROR: No command provided", "");
+        return -1;
+    }
+
+    run.tmpl = &tokens[i];
+    while (tokens[i] != NULL && strcmp(tokens[i], ":::") != 0) {
+        i++;
+    }
+    run.child_in = io_in_fd;
+    if (tokens[i] != NULL) {
+        tokens[i] = NULL;       // Terminate the template
+        run.args = &tokens[i + 1];
+    } else if (isatty(io_in_fd)) {
+        display_error("ERROR: No input source provided", "");
+        return -1;
+    } else {
+        input_init(&run.input, io_in_fd);
+        run.child_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (run.child_in == -1) {
+            display_error("ERROR: Cannot open file: ", "/dev/null");
+            return -1;
+        }
+    }
+
+    int started = 1;
+    while (1) {
+        while (started == 1 && run.running < run.max_jobs) {
+            started = start_task(&run);
+        }
+        if (run.running == 0) {
+            break;
+        }
+        wait_for_progress(&run);
+        flush_finished(&run);
+    }
+    // Tasks whose pipe is still open after their exit was seen
+    for (size_t t = 0; t < run.busy_count; t++) {
+        while (run.busy[t]->out_fd != -1) {
+            drain_output(run.busy[t]);
+        }
+    }
+    flush_finished(&run);
+    free(run.tasks);
+    free(run.busy);
+    free(run.fds);
+    if (run.args == NULL) {
+        input_free(&run.input);
+        close(run.child_in);
+    }
+
+    if (started == -1) {
+        display_error("ERROR: Could not start job", "");
+        return -1;
+    }
+    return run.failures == 0 ? 0 : -1;
+}
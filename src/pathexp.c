@@ -0,0 +1,331 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dirscan.h"
+#include "pathexp.h"
+#include "pattern.h"
+
+
+// The entries of one directory as read, "." and ".." left out
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;               // Read within a second of mtime: must be read again
+    char *names;            // Every name, NULL terminated, back to back
+    size_t names_len;
+    uint32_t *offsets;      // Where each name starts in names
+    unsigned char *types;   // d_type of each entry
+    size_t count;
+    unsigned long last_use; // For evicting the least recently used listing
+} CachedDir;
+
+static CachedDir cache[PATHEXP_CACHE_DIRS];
+static size_t cache_count;
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One entry of a directory that matched a path component
+typedef struct {
+    const char *name;
+    unsigned char type;
+} Match;
+
+// State of one path_expand call
+typedef struct {
+    Arena *arena;
+    char **paths;           // Results so far
+    size_t count;
+    size_t cap;
+    char *buf;              // Path being built
+    size_t buf_cap;
+} Expansion;
+
+
+// ===== Directory cache =====
+
+static void cached_free(CachedDir *dir) {
+    free(dir->names);
+    free(dir->offsets);
+    free(dir->types);
+    memset(dir, 0, sizeof(CachedDir));
+}
+
+/* Reads the directory open in reader into dir.
+ * Return: 0 on success, -1 on a read error or if memory runs out
+ */
+static int cached_read(CachedDir *dir, DirReader *reader) {
+    size_t names_cap = 4096;
+    size_t cap = 64;
+    dir->names = malloc(names_cap);
+    dir->offsets = malloc(cap * sizeof(uint32_t));
+    dir->types = malloc(cap);
+    if (dir->names == NULL || dir->offsets == NULL || dir->types == NULL) {
+        return -1;
+    }
+    DirEntry entry;
+    int ret;
+    while ((ret = dir_next(reader, &entry)) == 1) {
+        if (dir_is_dot(entry.name)) {
+            continue;
+        }
+        size_t len = strlen(entry.name) + 1;
+        if (dir->names_len + len > names_cap) {
+            names_cap *= 2;
+            char *names = realloc(dir->names, names_cap);
+            if (names == NULL) {
+                return -1;
+            }
+            dir->names = names;
+        }
+        if (dir->count == cap) {
+            cap *= 2;
+            uint32_t *offsets = realloc(dir->offsets, cap * sizeof(uint32_t));
+            if (offsets != NULL) {
+                dir->offsets = offsets;
+            }
+            unsigned char *types = realloc(dir->types, cap);
+            if (types != NULL) {
+                dir->types = types;
+            }
+            if (offsets == NULL || types == NULL) {
+                return -1;
+            }
+        }
+        memcpy(dir->names + dir->names_len, entry.name, len);
+        dir->offsets[dir->count] = dir->names_len;
+        dir->types[dir->count] = entry.type;
+        dir->names_len += len;
+        dir->count++;
+    }
+    return ret;
+}
+
+/* Finds the listing of path, reading the directory if it is not cached or
+ * has changed since.
+ * Prereq: cache_lock is held
+ * Return: the listing (valid while the lock is held), or NULL if path is
+ * not a readable directory
+ */
+static CachedDir *dir_listing(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    CachedDir *slot = NULL;
+    for (size_t i = 0; i < cache_count; i++) {
+        CachedDir *dir = &cache[i];
+        if (dir->dev != st.st_dev || dir->ino != st.st_ino) {
+            continue;
+        }
+        if (!dir->racy && dir->mtime.tv_sec == st.st_mtim.tv_sec &&
+            dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            dir->last_use = ++cache_clock;
+            return dir;
+        }
+        slot = dir;     // Changed: read it again in place
+        break;
+    }
+    if (slot == NULL && cache_count < PATHEXP_CACHE_DIRS) {
+        slot = &cache[cache_count++];
+    } else if (slot == NULL) {
+        slot = &cache[0];
+        for (size_t i = 1; i < cache_count; i++) {
+            if (cache[i].last_use < slot->last_use) {
+                slot = &cache[i];
+            }
+        }
+    }
+    cached_free(slot);
+
+    DirReader reader;
+    if (dir_open(&reader, AT_FDCWD, path, 0) == -1) {
+        return NULL;    // slot stays empty (inode 0 matches nothing useful)
+    }
+    // Key on the directory actually read, in case path changed meanwhile
+    int ok = fstat(reader.fd, &st) == 0 && cached_read(slot, &reader) == 0;
+    dir_close(&reader);
+    if (!ok) {
+        cached_free(slot);
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->racy = st.st_mtim.tv_sec >= time(NULL) - 1;
+    slot->last_use = ++cache_clock;
+    return slot;
+}
+
+void path_cache_free(void) {
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cache_count; i++) {
+        cached_free(&cache[i]);
+    }
+    cache_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+// ===== Expansion =====
+
+// Return: 1 if the n bytes at s hold an unquoted glob metacharacter, 0 otherwise
+static int has_magic(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '\\') {
+            i++;
+        } else if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Return: 0 on success, -1 if memory runs out
+static int buf_reserve(Expansion *ex, size_t need) {
+    if (need <= ex->buf_cap) {
+        return 0;
+    }
+    size_t cap = ex->buf_cap ? ex->buf_cap : 256;
+    while (cap < need) {
+        cap *= 2;
+    }
+    char *buf = realloc(ex->buf, cap);
+    if (buf == NULL) {
+        return -1;
+    }
+    ex->buf = buf;
+    ex->buf_cap = cap;
+    return 0;
+}
+
+// Records the len bytes of ex->buf as a result
+static int add_result(Expansion *ex, size_t len) {
+    if (ex->count + 1 >= ex->cap) {
+        size_t cap = ex->cap ? ex->cap * 2 : 16;
+        char **paths = arena_realloc(ex->arena, ex->paths, ex->cap * sizeof(char *), cap * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        ex->paths = paths;
+        ex->cap = cap;
+    }
+    ex->paths[ex->count] = arena_strndup(ex->arena, ex->buf, len);
+    return ex->paths[ex->count++] == NULL ? -1 : 0;
+}
+
+/* Expands the components of pat (the rest of the pattern) below the first
+ * len bytes of ex->buf, which end in '/' unless they are empty.
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int expand_from(Expansion *ex, const char *pat, size_t len) {
+    const char *end = pat;
+    while (*end != '\0' && *end != '/') {
+        end += (*end == '\\' && end[1] != '\0') ? 2 : 1;
+    }
+    int last = *end == '\0';
+
+    if (!has_magic(pat, end - pat)) {
+        // A literal component: unquote it and move on
+        if (buf_reserve(ex, len + (end - pat) + 2) == -1) {
+            return -1;
+        }
+        for (const char *s = pat; s < end; s++) {
+            s += *s == '\\' && s + 1 < end;
+            ex->buf[len++] = *s;
+        }
+        ex->buf[len] = '\0';
+        if (last) {
+            struct stat st;
+            return (len > 0 && lstat(ex->buf, &st) == 0) ? add_result(ex, len) : 0;
+        }
+        ex->buf[len++] = '/';
+        return expand_from(ex, end + 1, len);
+    }
+
+    char *glob = arena_strndup(ex->arena, pat, end - pat);
+    Pattern p;
+    if (glob == NULL || pattern_glob(&p, glob, 0) == -1) {
+        return -1;
+    }
+    int dots = glob[0] == '.' || (glob[0] == '\\' && glob[1] == '.');
+
+    // Collect the matches under the lock, then walk them without it
+    if (buf_reserve(ex, len + 1) == -1) {
+        pattern_free(&p);
+        return -1;
+    }
+    ex->buf[len] = '\0';
+    Match *matches = NULL;
+    size_t count = 0;
+    int ret = 0;
+    pthread_mutex_lock(&cache_lock);
+    CachedDir *dir = dir_listing(len > 0 ? ex->buf : ".");
+    if (dir != NULL && dir->count > 0) {
+        matches = arena_alloc(ex->arena, dir->count * sizeof(Match));
+        ret = matches == NULL ? -1 : 0;
+        for (size_t i = 0; matches != NULL && i < dir->count; i++) {
+            const char *name = dir->names + dir->offsets[i];
+            size_t name_len = strlen(name);
+            if ((name[0] == '.' && !dots) || !pattern_match(&p, name, name_len)) {
+                continue;
+            }
+            matches[count].name = arena_strndup(ex->arena, name, name_len);
+            matches[count].type = dir->types[i];
+            if (matches[count].name == NULL) {
+                ret = -1;
+                break;
+            }
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    pattern_free(&p);
+
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        size_t name_len = strlen(matches[i].name);
+        if (buf_reserve(ex, len + name_len + 2) == -1) {
+            return -1;
+        }
+        memcpy(ex->buf + len, matches[i].name, name_len + 1);
+        if (last) {
+            ret = add_result(ex, len + name_len);
+            continue;
+        }
+        // Only directories (or links to them) lead anywhere
+        struct stat st;
+        if (matches[i].type == DT_DIR ||
+            ((matches[i].type == DT_LNK || matches[i].type == DT_UNKNOWN) &&
+             stat(ex->buf, &st) == 0 && S_ISDIR(st.st_mode))) {
+            ex->buf[len + name_len] = '/';
+            ret = expand_from(ex, end + 1, len + name_len + 1);
+        }
+    }
+    return ret;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+ssize_t path_expand(Arena *arena, const char *pattern, char ***out) {
+    Expansion ex = {.arena = arena};
+    int ret = expand_from(&ex, pattern, 0);
+    free(ex.buf);
+    if (ret == -1) {
+        return -1;
+    }
+    if (ex.count > 0) {
+        qsort(ex.paths, ex.count, sizeof(char *), compare_paths);
+        ex.paths[ex.count] = NULL;
+    }
+    *out = ex.paths;
+    return ex.count;
+}
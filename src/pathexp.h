@@ -0,0 +1,32 @@
+#ifndef __PATHEXP_H__
+#define __PATHEXP_H__
+
+#include <sys/types.h>
+
+#include "arena.h"
+
+
+#define PATHEXP_CACHE_DIRS 64   // Directory listings kept between commands
+
+
+/* Expands the glob pattern (as in the shell: "*", "?" and "[...]" within
+ * one path component, "\" quoting; names starting with '.' only match an
+ * explicit '.') into the existing paths it matches, sorted.
+ *
+ * Directory listings come from a cache keyed by (device, inode, mtime):
+ * a directory is read once and then served from memory until it changes,
+ * so repeating a glob over a large directory costs a stat() instead of a
+ * scan. A listing read within a second of its mtime is not trusted again,
+ * since a change in the same clock tick would not show in the mtime.
+ * Thread safe.
+ * Return: number of matches (NULL terminated in *out, allocated in arena),
+ * or -1 if memory runs out
+ */
+ssize_t path_expand(Arena *arena, const char *pattern, char ***out);
+
+/* Releases every cached directory listing.
+ */
+void path_cache_free(void);
+
+
+#endif
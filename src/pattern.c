@@ -0,0 +1,597 @@
+#define _GNU_SOURCE  // For memmem()
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern.h"
+
+
+// ===== Byte sets =====
+
+static void set_add(uint64_t *set, unsigned c) {
+    set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static int set_has(const uint64_t *set, unsigned c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static void set_all(uint64_t *set, int flags) {
+    memset(set, 0xff, 4 * sizeof(uint64_t));
+    if (flags & PAT_PATHNAME) {
+        set['/' >> 6] &= ~(1ULL << ('/' & 63));
+    }
+}
+
+// Adds the other case of every letter in set
+static void set_fold(uint64_t *set) {
+    for (unsigned c = 'A'; c <= 'Z'; c++) {
+        if (set_has(set, c) || set_has(set, c + 'a' - 'A')) {
+            set_add(set, c);
+            set_add(set, c + 'a' - 'A');
+        }
+    }
+}
+
+// Return: the only byte in set, or -1 if it holds none or several
+static int set_single(const uint64_t *set) {
+    int found = -1;
+    for (int w = 0; w < 4; w++) {
+        if (set[w] == 0) {
+            continue;
+        }
+        if (found != -1 || (set[w] & (set[w] - 1)) != 0) {
+            return -1;
+        }
+        found = w * 64 + __builtin_ctzll(set[w]);
+    }
+    return found;
+}
+
+
+// ===== Glob parsing =====
+
+static const struct {
+    const char *name;
+    int (*test)(int c);
+} CLASS_NAMES[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+/* Parses the bracket expression starting at glob[i] ('[') into set,
+ * folding case (before any negation) for PAT_ICASE.
+ * Return: index just past its ']', or 0 if it is unterminated (then the
+ * '[' is an ordinary byte)
+ */
+static size_t parse_class(const char *glob, size_t i, uint64_t *set, int flags) {
+    size_t j = i + 1;
+    int negate = glob[j] == '!' || glob[j] == '^';
+    if (negate) {
+        j++;
+    }
+    memset(set, 0, 4 * sizeof(uint64_t));
+    size_t first = j;
+    while (glob[j] != '\0' && (glob[j] != ']' || j == first)) {
+        if (glob[j] == '[' && glob[j + 1] == ':') {
+            const char *end = strstr(glob + j + 2, ":]");
+            size_t k = 0;
+            size_t name_len = end ? (size_t)(end - (glob + j + 2)) : 0;
+            while (k < sizeof(CLASS_NAMES) / sizeof(CLASS_NAMES[0]) &&
+                   (strlen(CLASS_NAMES[k].name) != name_len ||
+                    strncmp(CLASS_NAMES[k].name, glob + j + 2, name_len) != 0)) {
+                k++;
+            }
+            if (end != NULL && k < sizeof(CLASS_NAMES) / sizeof(CLASS_NAMES[0])) {
+                for (unsigned c = 0; c < 256; c++) {
+                    if (CLASS_NAMES[k].test(c)) {
+                        set_add(set, c);
+                    }
+                }
+                j = end + 2 - glob;
+                continue;
+            }
+        }
+        if (glob[j] == '\\' && glob[j + 1] != '\0') {
+            j++;
+        }
+        unsigned lo = (unsigned char)glob[j++];
+        unsigned hi = lo;
+        if (glob[j] == '-' && glob[j + 1] != '\0' && glob[j + 1] != ']') {
+            j++;
+            if (glob[j] == '\\' && glob[j + 1] != '\0') {
+                j++;
+            }
+            hi = (unsigned char)glob[j++];
+        }
+        for (unsigned c = lo; c <= hi; c++) {
+            set_add(set, c);
+        }
+    }
+    if (glob[j] != ']') {
+        return 0;
+    }
+    if (flags & PAT_ICASE) {
+        set_fold(set);
+    }
+    if (negate) {
+        for (int w = 0; w < 4; w++) {
+            set[w] = ~set[w];
+        }
+    }
+    return j + 1;
+}
+
+/* Turns glob into p->ops.
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int parse_glob(Pattern *p, const char *glob) {
+    p->ops = malloc((strlen(glob) + 1) * sizeof(PatternOp));
+    if (p->ops == NULL) {
+        return -1;
+    }
+    size_t i = 0;
+    size_t end;
+    while (glob[i] != '\0') {
+        PatternOp *op = &p->ops[p->nops];
+        op->kind = PAT_OP_ONE;
+        if (glob[i] == '*') {
+            size_t j = i;
+            while (glob[j] == '*') {
+                j++;
+            }
+            int twice = j - i >= 2;
+            if (twice && (p->flags & PAT_PATHNAME) && (i == 0 || glob[i - 1] == '/') && glob[j] == '/') {
+                op->kind = PAT_OP_DIRS;     // "**/": no directories, or any number of them
+                set_all(op->set, 0);
+                i = j + 1;
+                p->nops++;
+                continue;
+            }
+            op->kind = PAT_OP_STAR;
+            set_all(op->set, twice ? 0 : p->flags);
+            i = j;
+        } else if (glob[i] == '?') {
+            set_all(op->set, p->flags);
+            i++;
+        } else if (glob[i] == '[' && (end = parse_class(glob, i, op->set, p->flags)) != 0) {
+            i = end;
+            if (p->flags & PAT_PATHNAME) {
+                op->set['/' >> 6] &= ~(1ULL << ('/' & 63));
+            }
+        } else {
+            memset(op->set, 0, sizeof(op->set));
+            if (glob[i] == '\\' && glob[i + 1] != '\0') {
+                i++;
+            }
+            set_add(op->set, (unsigned char)glob[i++]);
+            if (p->flags & PAT_ICASE) {
+                set_fold(op->set);
+            }
+        }
+        p->nops++;
+    }
+    return 0;
+}
+
+/* Spots the glob shapes that need no automaton: a literal with at most a
+ * leading and a trailing "*" that may match anything. Sets p->kind (and
+ * p->lit for the literal ones).
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int classify_glob(Pattern *p) {
+    p->kind = PAT_GLOB;
+    if (p->flags & PAT_ICASE) {
+        return 0;
+    }
+    size_t first = 0;
+    size_t last = p->nops;
+    uint64_t any[4];
+    set_all(any, 0);
+    int lead = first < last && p->ops[first].kind == PAT_OP_STAR &&
+               memcmp(p->ops[first].set, any, sizeof(any)) == 0;
+    first += lead;
+    int trail = first < last && p->ops[last - 1].kind == PAT_OP_STAR &&
+                memcmp(p->ops[last - 1].set, any, sizeof(any)) == 0;
+    last -= trail;
+    for (size_t i = first; i < last; i++) {
+        if (p->ops[i].kind != PAT_OP_ONE || set_single(p->ops[i].set) == -1) {
+            return 0;
+        }
+    }
+    p->lit_len = last - first;
+    p->lit = malloc(p->lit_len + 1);
+    if (p->lit == NULL) {
+        return -1;
+    }
+    for (size_t i = first; i < last; i++) {
+        p->lit[i - first] = (char)set_single(p->ops[i].set);
+    }
+    p->lit[p->lit_len] = '\0';
+    if (lead && p->lit_len == 0) {
+        p->kind = PAT_ANY;
+    } else if (lead && trail) {
+        p->kind = PAT_SUBSTR;
+    } else if (lead) {
+        p->kind = PAT_SUFFIX;
+    } else if (trail) {
+        p->kind = PAT_PREFIX;
+    } else {
+        p->kind = PAT_LITERAL;
+    }
+    return 0;
+}
+
+
+// ===== Glob automaton =====
+
+/* NFA states are positions in p->ops (p->nops means "matched"); a set of
+ * them is a bitset of nfa_words(p) words.
+ */
+static size_t nfa_words(const Pattern *p) {
+    return (p->nops + 1 + 63) / 64;
+}
+
+// Adds pos to set, with the positions reachable from it without input
+static void nfa_enter(const Pattern *p, uint64_t *set, size_t pos) {
+    while (1) {
+        set[pos >> 6] |= 1ULL << (pos & 63);
+        if (pos == p->nops || p->ops[pos].kind == PAT_OP_ONE) {
+            return;
+        }
+        pos++;      // "*" and "**/" may match nothing
+    }
+}
+
+/* Sets to to the positions reached from the set from on byte c.
+ * Return: 1 if to is not empty, 0 otherwise
+ */
+static int nfa_step(const Pattern *p, const uint64_t *from, uint64_t *to, unsigned c) {
+    size_t words = nfa_words(p);
+    memset(to, 0, words * sizeof(uint64_t));
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = from[w]; bits != 0; bits &= bits - 1) {
+            size_t pos = w * 64 + __builtin_ctzll(bits);
+            if (pos == p->nops) {
+                continue;
+            }
+            const PatternOp *op = &p->ops[pos];
+            if (op->kind == PAT_OP_DIRS) {
+                // Stays inside "**/"; only a '/' may end it
+                to[pos >> 6] |= 1ULL << (pos & 63);
+                if (c == '/') {
+                    nfa_enter(p, to, pos + 1);
+                }
+            } else if (set_has(op->set, c)) {
+                nfa_enter(p, to, op->kind == PAT_OP_STAR ? pos : pos + 1);
+            }
+        }
+    }
+    for (size_t w = 0; w < words; w++) {
+        if (to[w] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Builds the DFA by subset construction, giving up (leaving nstates 0)
+ * beyond PAT_DFA_MAX_STATES states.
+ * Return: 0 on success or when giving up, -1 if memory runs out
+ */
+static int build_dfa(Pattern *p) {
+    size_t words = nfa_words(p);
+    size_t cap = 16;
+    uint64_t *sets = calloc(cap, words * sizeof(uint64_t));
+    uint64_t *next = malloc(words * sizeof(uint64_t));
+    p->dfa = malloc(cap * 256 * sizeof(int32_t));
+    p->accept = malloc(cap);
+    if (sets == NULL || next == NULL || p->dfa == NULL || p->accept == NULL) {
+        free(sets);
+        free(next);
+        return -1;
+    }
+    nfa_enter(p, sets, 0);
+    int nstates = 1;
+    int ret = 0;
+    for (int st = 0; st < nstates && ret == 0; st++) {
+        const uint64_t *cur = sets + st * words;
+        p->accept[st] = (cur[p->nops >> 6] >> (p->nops & 63)) & 1;
+        for (unsigned c = 0; c < 256; c++) {
+            if (!nfa_step(p, cur, next, c)) {
+                p->dfa[st * 256 + c] = -1;
+                continue;
+            }
+            int found = 0;
+            while (found < nstates && memcmp(sets + found * words, next, words * sizeof(uint64_t)) != 0) {
+                found++;
+            }
+            if (found == nstates) {
+                if (nstates == PAT_DFA_MAX_STATES) {
+                    ret = 1;
+                    break;
+                }
+                if ((size_t)nstates == cap) {
+                    cap *= 2;
+                    uint64_t *new_sets = realloc(sets, cap * words * sizeof(uint64_t));
+                    int32_t *new_dfa = realloc(p->dfa, cap * 256 * sizeof(int32_t));
+                    unsigned char *new_accept = realloc(p->accept, cap);
+                    sets = new_sets ? new_sets : sets;
+                    p->dfa = new_dfa ? new_dfa : p->dfa;
+                    p->accept = new_accept ? new_accept : p->accept;
+                    if (new_sets == NULL || new_dfa == NULL || new_accept == NULL) {
+                        ret = -1;
+                        break;
+                    }
+                }
+                memcpy(sets + nstates * words, next, words * sizeof(uint64_t));
+                nstates++;
+                cur = sets + st * words;    // sets may have moved
+            }
+            p->dfa[st * 256 + c] = found;
+        }
+    }
+    free(sets);
+    free(next);
+    if (ret != 0) {
+        free(p->dfa);
+        free(p->accept);
+        p->dfa = NULL;
+        p->accept = NULL;
+        return ret == 1 ? 0 : -1;
+    }
+    // An accepting state every byte leads back to: the rest of the input cannot matter
+    for (int st = 0; st < nstates; st++) {
+        int absorbing = p->accept[st];
+        for (unsigned c = 0; c < 256 && absorbing; c++) {
+            absorbing = p->dfa[st * 256 + c] == st;
+        }
+        p->accept[st] |= absorbing << 1;
+    }
+    p->nstates = nstates;
+    return 0;
+}
+
+// Matches by stepping the NFA, for automata too large to determinize
+static int nfa_match(const Pattern *p, const char *s, size_t len) {
+    size_t words = nfa_words(p);
+    uint64_t *cur = calloc(2 * words, sizeof(uint64_t));
+    if (cur == NULL) {
+        return 0;
+    }
+    uint64_t *next = cur + words;
+    nfa_enter(p, cur, 0);
+    int alive = 1;
+    for (size_t i = 0; i < len && alive; i++) {
+        alive = nfa_step(p, cur, next, (unsigned char)s[i]);
+        uint64_t *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    int matched = alive && ((cur[p->nops >> 6] >> (p->nops & 63)) & 1);
+    free(cur < next ? cur : next);
+    return matched;
+}
+
+
+// ===== Regex literals =====
+
+/* Finds the longest run of literal bytes every match of the extended
+ * regex re must contain. Gives up (empty result) on alternation; bytes
+ * inside groups, brackets or under "*", "?" or "{}" are never required, and
+ * only escaped metacharacters count as literal bytes (not "\<", "\w", ...).
+ * Return: the literal (malloc'd, possibly empty), or NULL if memory runs out
+ */
+static char *regex_literal(const char *re, size_t *out_len) {
+    size_t len = strlen(re);
+    char *best = calloc(1, len + 1);
+    char *cur = malloc(len + 1);
+    if (best == NULL || cur == NULL) {
+        free(best);
+        free(cur);
+        return NULL;
+    }
+    size_t best_len = 0;
+    size_t cur_len = 0;
+    int depth = 0;
+    int give_up = strchr(re, '|') != NULL;
+    for (size_t i = 0; i < len && !give_up; i++) {
+        char c = re[i];
+        int literal = 0;
+        if (c == '\\') {
+            if (re[i + 1] == '\0' || strchr(".[]()*+?{}|^$\\", re[i + 1]) == NULL) {
+                i += re[i + 1] != '\0';     // \w, \<, \1 ...: not literal
+            } else {
+                c = re[++i];
+                literal = depth == 0;
+            }
+        } else if (c == '[') {
+            size_t j = i + 1;
+            j += re[j] == '^';
+            j += re[j] == ']';
+            while (j < len && re[j] != ']') {
+                if (re[j] == '[' && (re[j + 1] == ':' || re[j + 1] == '.' || re[j + 1] == '=')) {
+                    char close[3] = {re[j + 1], ']', '\0'};
+                    const char *end = strstr(re + j + 2, close);
+                    j = end ? (size_t)(end - re) + 2 : len;
+                } else {
+                    j++;
+                }
+            }
+            i = j;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth -= depth > 0;
+        } else if (c == '*' || c == '?' || c == '{') {
+            if (depth == 0 && cur_len > 0) {
+                cur_len--;      // The byte before was optional
+            }
+            if (c == '{') {
+                const char *end = strchr(re + i, '}');
+                i = end ? (size_t)(end - re) : len;
+            }
+        } else if (c == '+' || c == '.' || c == '^' || c == '$') {
+            // "+" keeps the byte before but ends the run
+        } else {
+            literal = depth == 0;
+        }
+        if (literal) {
+            cur[cur_len++] = c;
+            int quantified = re[i + 1] == '*' || re[i + 1] == '?' || re[i + 1] == '{' || re[i + 1] == '+';
+            if (!quantified) {
+                continue;
+            }
+            if (re[i + 1] != '+') {
+                cur_len--;
+            }
+        }
+        if (cur_len > best_len) {
+            memcpy(best, cur, cur_len);
+            best_len = cur_len;
+        }
+        cur_len = 0;
+    }
+    if (!give_up && cur_len > best_len) {
+        memcpy(best, cur, cur_len);
+        best_len = cur_len;
+    }
+    best[best_len] = '\0';
+    free(cur);
+    *out_len = best_len;
+    return best;
+}
+
+
+// ===== Public interface =====
+
+int pattern_is_glob(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
+}
+
+int pattern_glob(Pattern *p, const char *glob, int flags) {
+    memset(p, 0, sizeof(Pattern));
+    p->flags = flags;
+    if (parse_glob(p, glob) == -1 || classify_glob(p) == -1 ||
+        (p->kind == PAT_GLOB && build_dfa(p) == -1)) {
+        pattern_free(p);
+        return -1;
+    }
+    return 0;
+}
+
+int pattern_substr(Pattern *p, const char *text, int flags) {
+    if (flags & PAT_ICASE) {
+        // "*text*" folded: the DFA is a case-blind string matcher
+        size_t len = strlen(text);
+        char *glob = malloc(2 * len + 3);
+        if (glob == NULL) {
+            return -1;
+        }
+        char *g = glob;
+        *g++ = '*';
+        for (size_t i = 0; i < len; i++) {
+            if (strchr("*?[\\", text[i]) != NULL) {
+                *g++ = '\\';
+            }
+            *g++ = text[i];
+        }
+        *g++ = '*';
+        *g = '\0';
+        int ret = pattern_glob(p, glob, flags & ~PAT_PATHNAME);
+        free(glob);
+        return ret;
+    }
+    memset(p, 0, sizeof(Pattern));
+    p->flags = flags;
+    p->kind = PAT_SUBSTR;
+    p->lit = strdup(text);
+    if (p->lit == NULL) {
+        return -1;
+    }
+    p->lit_len = strlen(text);
+    return 0;
+}
+
+int pattern_regex(Pattern *p, const char *text, int flags) {
+    memset(p, 0, sizeof(Pattern));
+    p->flags = flags;
+    p->kind = PAT_REGEX;
+    int cflags = REG_EXTENDED | REG_NOSUB | ((flags & PAT_ICASE) ? REG_ICASE : 0);
+    if (regcomp(&p->re, text, cflags) != 0) {
+        p->kind = PAT_ANY;  // Nothing for pattern_free to release
+        return -1;
+    }
+    if (!(flags & PAT_ICASE)) {
+        p->lit = regex_literal(text, &p->lit_len);
+        if (p->lit == NULL) {
+            pattern_free(p);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pattern_match(const Pattern *p, const char *s, size_t len) {
+    switch (p->kind) {
+    case PAT_ANY:
+        return 1;
+    case PAT_LITERAL:
+        return len == p->lit_len && memcmp(s, p->lit, len) == 0;
+    case PAT_PREFIX:
+        return len >= p->lit_len && memcmp(s, p->lit, p->lit_len) == 0;
+    case PAT_SUFFIX:
+        return len >= p->lit_len && memcmp(s + len - p->lit_len, p->lit, p->lit_len) == 0;
+    case PAT_SUBSTR:
+        return p->lit_len == 0 || memmem(s, len, p->lit, p->lit_len) != NULL;
+    case PAT_GLOB:
+        if (p->nstates == 0) {
+            return nfa_match(p, s, len);
+        } else {
+            const int32_t *dfa = p->dfa;
+            int32_t st = 0;
+            for (size_t i = 0; i < len; i++) {
+                st = dfa[st * 256 + (unsigned char)s[i]];
+                if (st < 0) {
+                    return 0;
+                }
+                if (p->accept[st] & 2) {
+                    return 1;
+                }
+            }
+            return p->accept[st] & 1;
+        }
+    case PAT_REGEX: {
+        if (p->lit_len > 0 && memmem(s, len, p->lit, p->lit_len) == NULL) {
+            return 0;
+        }
+        // regexec() wants a terminated string: REG_STARTEND is not portable,
+        // and sanitizer interceptors read up to the NUL regardless
+        char stack[PAT_REGEX_STACK_LEN];
+        char *copy = len < sizeof(stack) ? stack : malloc(len + 1);
+        if (copy == NULL) {
+            return 0;
+        }
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+        int matched = regexec(&p->re, copy, 0, NULL, 0) == 0;
+        if (copy != stack) {
+            free(copy);
+        }
+        return matched;
+    }
+    }
+    return 0;
+}
+
+void pattern_free(Pattern *p) {
+    if (p->kind == PAT_REGEX) {
+        regfree(&p->re);
+    }
+    free(p->lit);
+    free(p->ops);
+    free(p->dfa);
+    free(p->accept);
+    memset(p, 0, sizeof(Pattern));
+}
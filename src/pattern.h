@@ -0,0 +1,85 @@
+#ifndef __PATTERN_H__
+#define __PATTERN_H__
+
+#include <regex.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Pattern flags
+#define PAT_ICASE 0x1       // Letters match either case
+#define PAT_PATHNAME 0x2    // Globs: "*", "?" and classes do not match '/'; "**" does
+
+#define PAT_DFA_MAX_STATES 512  // Larger glob automata are simulated instead
+#define PAT_REGEX_STACK_LEN 1024 // Strings up to this long are terminated on the stack for regexec()
+
+
+typedef enum {
+    PAT_ANY,                // Matches everything ("*")
+    PAT_LITERAL,            // Whole string equals lit
+    PAT_PREFIX,             // Starts with lit ("foo*")
+    PAT_SUFFIX,             // Ends with lit ("*.log")
+    PAT_SUBSTR,             // Contains lit ("*foo*", or a plain substring)
+    PAT_GLOB,               // Anything else: a DFA (or its NFA) over the whole string
+    PAT_REGEX,              // POSIX extended regex, found anywhere in the string
+} PatternKind;
+
+// One step of a compiled glob: the bytes it accepts, once or any number of times
+typedef struct {
+    enum { PAT_OP_ONE, PAT_OP_STAR, PAT_OP_DIRS } kind;   // DIRS: "**/"
+    uint64_t set[4];        // 256-bit set of accepted bytes
+} PatternOp;
+
+/* A compiled pattern. Globs are analysed once: the common shapes become a
+ * single memcmp() or memmem(); the rest are built into a DFA with one
+ * 256-entry row per state, so matching costs one table lookup per byte.
+ * A regex is handed to regcomp(), with the longest literal every match
+ * must contain pulled out first and searched for with memmem() so most
+ * non-matching strings never reach regexec().
+ */
+typedef struct {
+    PatternKind kind;
+    int flags;
+    char *lit;              // Literal, prefix, suffix or substring; a regex's required literal
+    size_t lit_len;
+    // PAT_GLOB
+    PatternOp *ops;
+    size_t nops;
+    int32_t *dfa;           // dfa[state * 256 + byte]: next state, -1 for no match
+    unsigned char *accept;  // accept[state]: the string may end here
+    int nstates;            // 0: too many states, simulate the NFA instead
+    // PAT_REGEX
+    regex_t re;
+} Pattern;
+
+
+/* Return: 1 if s contains any glob metacharacter ("*", "?" or "["), 0 otherwise
+ */
+int pattern_is_glob(const char *s);
+
+/* Compiles glob, which must match a whole string: "*" and "?" match any
+ * run and any single byte, "[...]" a class ("[!...]" or "[^...]" negated,
+ * with ranges and [:alpha:]-style names) and "\" quotes the next byte.
+ * Return: 0 on success, -1 if memory runs out
+ */
+int pattern_glob(Pattern *p, const char *glob, int flags);
+
+/* Compiles a plain substring search for text.
+ * Return: 0 on success, -1 if memory runs out
+ */
+int pattern_substr(Pattern *p, const char *text, int flags);
+
+/* Compiles the POSIX extended regex text, which may match anywhere.
+ * Return: 0 on success, -1 if it is invalid or memory runs out
+ */
+int pattern_regex(Pattern *p, const char *text, int flags);
+
+/* Return: 1 if the len bytes at s match p, 0 otherwise. s need not be
+ * NULL terminated. Safe to call from several threads at once.
+ */
+int pattern_match(const Pattern *p, const char *s, size_t len);
+
+void pattern_free(Pattern *p);
+
+
+#endif
@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "procstat.h"
+
+#define PROC_STAT_LEN 1024      // /proc/<pid>/stat is a single short line
+
+
+// Cached per-process state, kept from one sample to the next.
+typedef struct {
+    pid_t pid;                  // 0 marks an empty slot
+    int stat_fd;
+    int children_fd;
+    unsigned long long ticks;   // utime + stime at the last sample
+    uint64_t sampled;           // CLOCK_MONOTONIC ns of the last sample
+    unsigned generation;        // Sample that last visited this process
+} ProcEntry;
+
+// Open-addressing table of ProcEntry keyed by pid (linear probing). Entries
+// not visited by a sample are dropped by rebuilding the table in
+// proc_sample_end, so no deletion scheme is needed.
+static ProcEntry *table = NULL;
+static size_t table_cap = 0;
+static size_t table_used = 0;
+
+static int proc_fd = -1;
+static unsigned generation = 0;
+static uint64_t sample_now = 0;
+static double boot_seconds = 0;
+static long clock_hz = 100;
+static long page_kb = 4;
+
+// Scratch buffer for children lists, grown as needed.
+static char *list_buf = NULL;
+static size_t list_cap = 0;
+
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t pid_slot(pid_t pid, size_t cap) {
+    return ((size_t)pid * 0x9E3779B97F4A7C15ULL) >> 32 & (cap - 1);
+}
+
+static void close_entry(ProcEntry *e) {
+    if (e->stat_fd != -1) {
+        close(e->stat_fd);
+    }
+    if (e->children_fd != -1) {
+        close(e->children_fd);
+    }
+}
+
+/* Moves the entries into a table of new_cap slots. With prune set, entries
+ * the current sample did not visit are closed and dropped instead.
+ * Return: 0 on success, -1 on allocation failure (the table is unchanged)
+ */
+static int rebuild_table(size_t new_cap, int prune) {
+    ProcEntry *new_table = calloc(new_cap, sizeof(ProcEntry));
+    if (new_table == NULL) {
+        return -1;
+    }
+    table_used = 0;
+    for (size_t i = 0; i < table_cap; i++) {
+        ProcEntry *e = &table[i];
+        if (e->pid == 0) {
+            continue;
+        }
+        if (prune && e->generation != generation) {
+            close_entry(e);
+            continue;
+        }
+        size_t j = pid_slot(e->pid, new_cap);
+        while (new_table[j].pid != 0) {
+            j = (j + 1) & (new_cap - 1);
+        }
+        new_table[j] = *e;
+        table_used++;
+    }
+    free(table);
+    table = new_table;
+    table_cap = new_cap;
+    return 0;
+}
+
+/* Return: the entry for pid, creating it if needed; NULL on failure
+ */
+static ProcEntry *find_entry(pid_t pid) {
+    if ((table_used + 1) * 4 > table_cap * 3) {
+        if (rebuild_table(table_cap ? table_cap * 2 : PROC_TABLE_MIN_CAP, 0) == -1) {
+            return NULL;
+        }
+    }
+    size_t i = pid_slot(pid, table_cap);
+    while (table[i].pid != 0 && table[i].pid != pid) {
+        i = (i + 1) & (table_cap - 1);
+    }
+    ProcEntry *e = &table[i];
+    if (e->pid == 0) {
+        e->pid = pid;
+        e->stat_fd = -1;
+        e->children_fd = -1;
+        e->ticks = 0;
+        e->sampled = 0;
+        e->generation = 0;
+        table_used++;
+    }
+    return e;
+}
+
+/* Re-reads the cached /proc file *fd (opening name first if needed) at
+ * offset 0. A failed read means the process is gone, or the pid was
+ * recycled, so the file is reopened once before giving up.
+ * Return: bytes read (0 for an empty file), or -1 if the process no
+ * longer exists
+ */
+static ssize_t read_proc_file(int *fd, const char *name, char *buf, size_t size) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (*fd == -1) {
+            *fd = openat(proc_fd, name, O_RDONLY | O_CLOEXEC);
+            if (*fd == -1) {
+                return -1;
+            }
+        }
+        ssize_t n = pread(*fd, buf, size, 0);
+        if (n >= 0) {
+            return n;
+        }
+        close(*fd);
+        *fd = -1;
+    }
+    return -1;
+}
+
+/* Fills info from /proc/<pid>/stat and updates the CPU% baseline in e.
+ * Return: 0 on success, -1 if the process is gone
+ */
+static int read_stat(ProcEntry *e, ProcInfo *info) {
+    char name[64];
+    char buf[PROC_STAT_LEN];
+    snprintf(name, sizeof(name), "%d/stat", e->pid);
+    ssize_t n = read_proc_file(&e->stat_fd, name, buf, sizeof(buf) - 1);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    // "pid (comm) state ppid ..."; comm may itself contain ')'.
+    char *open_paren = strchr(buf, '(');
+    char *close_paren = strrchr(buf, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren) {
+        return -1;
+    }
+    size_t comm_len = close_paren - open_paren - 1;
+    if (comm_len >= sizeof(info->comm)) {
+        comm_len = sizeof(info->comm) - 1;
+    }
+    memcpy(info->comm, open_paren + 1, comm_len);
+    info->comm[comm_len] = '\0';
+
+    // Fields 3 (state) onwards, numbered as in proc(5)
+    unsigned long long utime, stime, starttime;
+    long threads, rss;
+    int ppid;
+    if (sscanf(close_paren + 2,
+               "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %llu %*u %ld",
+               &info->state, &ppid, &utime, &stime, &threads, &starttime, &rss) != 7) {
+        return -1;
+    }
+    info->pid = e->pid;
+    info->ppid = ppid;
+    info->threads = threads;
+    info->rss_kb = rss * page_kb;
+
+    // CPU% since the previous sample, or averaged over the whole lifetime
+    // the first time a process is seen.
+    unsigned long long ticks = utime + stime;
+    if (e->sampled != 0 && sample_now > e->sampled && ticks >= e->ticks) {
+        double seconds = (sample_now - e->sampled) / 1e9;
+        info->cpu = 100.0 * (ticks - e->ticks) / clock_hz / seconds;
+    } else {
+        double alive = boot_seconds - (double)starttime / clock_hz;
+        info->cpu = alive > 0 ? 100.0 * ticks / clock_hz / alive : 0;
+    }
+    e->ticks = ticks;
+    e->sampled = sample_now;
+    return 0;
+}
+
+/* Reads the pids listed in /proc/<pid>/task/<pid>/children.
+ * Return: malloc'd array of *count pids (NULL if there are none)
+ */
+static pid_t *read_children(ProcEntry *e, size_t *count) {
+    *count = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "%d/task/%d/children", e->pid, e->pid);
+    if (list_cap == 0) {
+        list_cap = 4096;
+        list_buf = malloc(list_cap);
+        if (list_buf == NULL) {
+            list_cap = 0;
+            return NULL;
+        }
+    }
+
+    ssize_t n = read_proc_file(&e->children_fd, name, list_buf, list_cap - 1);
+    while (n == (ssize_t)list_cap - 1) {
+        // The list did not fit: grow the buffer and read it again whole
+        char *new_buf = realloc(list_buf, list_cap * 2);
+        if (new_buf == NULL) {
+            break;
+        }
+        list_buf = new_buf;
+        list_cap *= 2;
+        n = read_proc_file(&e->children_fd, name, list_buf, list_cap - 1);
+    }
+    if (n <= 0) {
+        return NULL;
+    }
+    list_buf[n] = '\0';
+
+    size_t cap = 0;
+    pid_t *pids = NULL;
+    char *p = list_buf;
+    while (1) {
+        char *end;
+        long pid = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 8;
+            pid_t *new_pids = realloc(pids, cap * sizeof(pid_t));
+            if (new_pids == NULL) {
+                break;
+            }
+            pids = new_pids;
+        }
+        pids[(*count)++] = pid;
+        p = end;
+    }
+    return pids;
+}
+
+static size_t visit(pid_t pid, int depth, void (*fn)(const ProcInfo *info, void *ctx), void *ctx) {
+    ProcEntry *e = find_entry(pid);
+    if (e == NULL || e->generation == generation) {
+        return 0;   // Out of memory, or already reported in this sample
+    }
+    ProcInfo info;
+    if (read_stat(e, &info) == -1) {
+        return 0;
+    }
+    e->generation = generation;
+    info.depth = depth;
+    fn(&info, ctx);
+
+    size_t reported = 1;
+    if (depth + 1 < PROC_MAX_DEPTH) {
+        size_t count;
+        pid_t *children = read_children(e, &count);
+        for (size_t i = 0; i < count; i++) {
+            reported += visit(children[i], depth + 1, fn, ctx);
+        }
+        free(children);
+    }
+    return reported;
+}
+
+/* Starts a new sample. Each process's /proc/<pid>/stat and children files
+ * stay open between samples and are re-read with pread(), so refreshing a
+ * large job table costs a couple of syscalls per process.
+ */
+void proc_sample_begin(void) {
+    if (proc_fd == -1) {
+        proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        long hz = sysconf(_SC_CLK_TCK);
+        long page = sysconf(_SC_PAGESIZE);
+        clock_hz = hz > 0 ? hz : 100;
+        page_kb = page > 0 ? page / 1024 : 4;
+    }
+    generation++;
+    sample_now = now_ns(CLOCK_MONOTONIC);
+    boot_seconds = now_ns(CLOCK_BOOTTIME) / 1e9;
+}
+
+/* Calls fn for root and then every descendant, depth first.
+ * Return: number of processes reported (0 if root is gone)
+ */
+size_t proc_sample_tree(pid_t root, void (*fn)(const ProcInfo *info, void *ctx), void *ctx) {
+    if (proc_fd == -1) {
+        return 0;
+    }
+    return visit(root, 0, fn, ctx);
+}
+
+/* Ends the sample, closing the files of processes that were not visited.
+ */
+void proc_sample_end(void) {
+    if (table_cap > 0) {
+        rebuild_table(table_cap, 1);
+    }
+}
+
+/* Closes every cached /proc file on exit.
+ */
+void proc_free(void) {
+    for (size_t i = 0; i < table_cap; i++) {
+        if (table[i].pid != 0) {
+            close_entry(&table[i]);
+        }
+    }
+    free(table);
+    table = NULL;
+    table_cap = 0;
+    table_used = 0;
+    free(list_buf);
+    list_buf = NULL;
+    list_cap = 0;
+    if (proc_fd != -1) {
+        close(proc_fd);
+        proc_fd = -1;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef __PROCSTAT_H__
+#define __PROCSTAT_H__
+
+#include <sys/types.h>
+
+
+#define PROC_TABLE_MIN_CAP 64   // Initial sample-cache size; always a power of two
+#define PROC_MAX_DEPTH 16       // Deepest descendant level followed below a job
+#define PROC_COMM_LEN 32
+
+
+/* One process as seen in the current sample.
+ */
+typedef struct {
+    pid_t pid;
+    pid_t ppid;
+    char state;                 // R, S, D, Z, T, ...
+    long threads;
+    double cpu;                 // Percent of one CPU since the previous sample
+    long rss_kb;
+    int depth;                  // 0 for the job itself, 1 for its children, ...
+    char comm[PROC_COMM_LEN];
+} ProcInfo;
+
+
+/* Starts a new sample. Each process's /proc/<pid>/stat and children files
+ * stay open between samples and are re-read with pread(), so refreshing a
+ * large job table costs a couple of syscalls per process.
+ */
+void proc_sample_begin(void);
+
+/* Calls fn for root and then every descendant, depth first.
+ * Return: number of processes reported (0 if root is gone)
+ */
+size_t proc_sample_tree(pid_t root, void (*fn)(const ProcInfo *info, void *ctx), void *ctx);
+
+/* Ends the sample, closing the files of processes that were not visited.
+ */
+void proc_sample_end(void);
+
+/* Closes every cached /proc file on exit.
+ */
+void proc_free(void);
+
+
+#endif
@@ -13,6 +13,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "trace.h"
+
 #define MAX_CLIENTS FD_SETSIZE
 #define BUFFER_SIZE 1024
 
@@ -132,7 +134,9 @@ void run_server(int port) {
         }
 
         // Wait indefinitely until some file descriptor becomes readable.
+        TRACE_BEGIN(select_span);
         activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
+        TRACE_END(select_span, "server_select", NULL);
         if (activity < 0) {
             if (errno == EINTR) {
                 continue;
@@ -143,6 +147,7 @@ void run_server(int port) {
 
         // Check for an incoming connection on the listening socket.
         if (FD_ISSET(listen_fd, &readfds)) {
+            TRACE_BEGIN(accept_span);
             addr_len = sizeof(client_addr);
             new_socket = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
             if (new_socket < 0) {
@@ -182,6 +187,7 @@ void run_server(int port) {
                     send(new_socket, id_message, strlen(id_message), 0);
                 }
             }
+            TRACE_END(accept_span, "server_accept", NULL);
         }
 
         // Process incoming data on client sockets.
@@ -189,6 +195,7 @@ void run_server(int port) {
             int sock = client_sockets[i];
             // If this slot is active and marked as readable.
             if (sock > 0 && FD_ISSET(sock, &readfds)) {
+                TRACE_BEGIN(client_span);
                 int bytes_read = recv(sock, buffer, sizeof(buffer) - 1, 0);
                 if (bytes_read <= 0) {
                     // The client disconnected or an error occurred.
@@ -235,6 +242,7 @@ void run_server(int port) {
                         }
                     }
                 }
+                TRACE_END(client_span, "server_message", NULL);
             }
         }
     }
@@ -247,5 +255,6 @@ void run_server(int port) {
         }
     }
     close(listen_fd);
+    trace_flush();
     printf("Server shutting down.\n");
 }
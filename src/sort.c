@@ -0,0 +1,1010 @@
+#define _GNU_SOURCE  // For qsort_r()
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "io_helpers.h"
+#include "sort.h"
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+
+// Piped input, copied; lines before indexed are in lines, the rest is a partial line
+struct SortBlock {
+    SortBlock *next;
+    size_t len;
+    size_t cap;
+    size_t indexed;
+    char data[];
+};
+
+// A mapped input file
+struct SortMap {
+    SortMap *next;
+    char *map;
+    size_t len;
+    size_t pos;             // Offset of the next line to index
+    int done;               // Every line indexed
+};
+
+
+// ===== Options =====
+
+/* Parses "N" or "N,M" (fields counted from 1) into opts.
+ * Return: 0 on success, -1 on a malformed key
+ */
+static int parse_key(const char *arg, SortOpts *opts) {
+    char *end;
+    long start = strtol(arg, &end, 10);
+    long stop = 0;
+    if (end == arg || start < 1) {
+        return -1;
+    }
+    if (*end == ',') {
+        const char *m = end + 1;
+        stop = strtol(m, &end, 10);
+        if (end == m || stop < start) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || start > 0xffff || stop > 0xffff) {
+        return -1;
+    }
+    opts->key_start = start;
+    opts->key_end = stop;
+    return 0;
+}
+
+/* Parses a -S size: a number of units (default K) with an optional b, K,
+ * M, G or T suffix.
+ * Return: 0 on success, -1 on a malformed size
+ */
+static int parse_size(const char *arg, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || arg[0] == '-') {
+        return -1;
+    }
+    const char *units = "bKMGT";
+    int shift = 10;
+    if (*end != '\0') {
+        const char *u = *end == 'b' ? units : strchr(units + 1, toupper((unsigned char)*end));
+        if (u == NULL || end[1] != '\0') {
+            return -1;
+        }
+        shift = 10 * (u - units);
+    }
+    if (n > (~0ULL >> shift)) {
+        return -1;
+    }
+    *size = n << shift;
+    return 0;
+}
+
+int sort_parse(char **argv, SortOpts *opts) {
+    memset(opts, 0, sizeof(SortOpts));
+    opts->separator = -1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->threads = cpus > 0 ? (cpus < SORT_MAX_THREADS ? cpus : SORT_MAX_THREADS) : 1;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    opts->budget = pages > 0 && page_size > 0 ? (size_t)pages * page_size / 4 : 256 << 20;
+
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        const char *opt = argv[i];
+        for (const char *f = opt + 1; *f != '\0'; f++) {
+            if (*f == 'r') {
+                opts->reverse = 1;
+                continue;
+            } else if (*f == 'n') {
+                opts->numeric = 1;
+                continue;
+            } else if (*f == 'u') {
+                opts->unique = 1;
+                continue;
+            }
+            if (strchr("ktSj", *f) == NULL) {
+                display_error("ERROR: Invalid option: ", (char *)opt);
+                return -1;
+            }
+            // The value is the rest of this word, or the next one
+            const char *arg = f[1] != '\0' ? f + 1 : argv[++i];
+            int ret = -1;
+            if (arg == NULL) {
+                display_error("ERROR: Missing argument to ", (char *)opt);
+                return -1;
+            } else if (*f == 'k') {
+                ret = parse_key(arg, opts);
+            } else if (*f == 't') {
+                opts->separator = (unsigned char)arg[0];
+                ret = arg[0] != '\0' && arg[1] == '\0' ? 0 : -1;
+            } else if (*f == 'S') {
+                ret = parse_size(arg, &opts->budget);
+            } else {
+                opts->threads = atoi(arg);
+                ret = opts->threads >= 1 && opts->threads <= SORT_MAX_THREADS ? 0 : -1;
+            }
+            if (ret == -1) {
+                display_error("ERROR: Invalid argument to sort: ", (char *)arg);
+                return -1;
+            }
+            break;
+        }
+    }
+    if (opts->budget < SORT_MIN_BUDGET) {
+        opts->budget = SORT_MIN_BUDGET;
+    }
+    return i;
+}
+
+
+// ===== Keys =====
+
+// Return: position just past the field at p (with -t, past its separator)
+static size_t skip_field(const SortOpts *o, const char *text, size_t len, size_t p) {
+    if (o->separator >= 0) {
+        const char *sep = memchr(text + p, o->separator, len - p);
+        return sep ? (size_t)(sep - text) + 1 : len;
+    }
+    // A blank-separated field starts with the blanks before it
+    while (p < len && IS_BLANK(text[p])) {
+        p++;
+    }
+    while (p < len && !IS_BLANK(text[p])) {
+        p++;
+    }
+    return p;
+}
+
+// Finds the key of the len bytes at text: the whole line, or the -k fields
+static void find_key(const SortOpts *o, const char *text, size_t len, size_t *start, size_t *end) {
+    size_t p = 0;
+    for (int f = 1; f < o->key_start && p < len; f++) {
+        p = skip_field(o, text, len, p);
+    }
+    *start = p;
+    if (o->key_end == 0) {
+        *end = len;
+        return;
+    }
+    for (int f = o->key_start; f < o->key_end && p < len; f++) {
+        p = skip_field(o, text, len, p);
+    }
+    if (o->separator >= 0) {
+        const char *sep = memchr(text + p, o->separator, len - p);
+        *end = sep ? (size_t)(sep - text) : len;
+    } else {
+        *end = skip_field(o, text, len, p);
+    }
+}
+
+/* Return: the leading number of the len bytes at s (after blanks; an
+ * optional '-', digits and a fraction; 0 if there is none) as a key that
+ * orders like the number
+ */
+static uint64_t numeric_prefix(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && IS_BLANK(s[i])) {
+        i++;
+    }
+    int neg = i < len && s[i] == '-';
+    i += neg;
+    double value = 0;
+    for (; i < len && isdigit((unsigned char)s[i]); i++) {
+        value = value * 10 + (s[i] - '0');
+    }
+    if (i < len && s[i] == '.') {
+        double scale = 0.1;
+        for (i++; i < len && isdigit((unsigned char)s[i]); i++) {
+            value += (s[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if (neg && value != 0) {
+        value = -value;
+    }
+    // IEEE 754 doubles order like integers once negatives are flipped
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+// Return: the first 8 bytes of the key, big endian and zero padded
+static uint64_t bytes_prefix(const char *s, size_t len) {
+    uint64_t prefix = 0;
+    if (len >= 8) {
+        memcpy(&prefix, s, 8);
+        return __builtin_bswap64(prefix);
+    }
+    for (size_t i = 0; i < 8; i++) {
+        prefix = (prefix << 8) | (i < len ? (unsigned char)s[i] : 0);
+    }
+    return prefix;
+}
+
+static SortLine make_line(const SortOpts *o, const char *text, size_t len, uint32_t seq) {
+    size_t start, end;
+    find_key(o, text, len, &start, &end);
+    SortLine line = {0, text, len, start, end - start, seq};
+    line.prefix = o->numeric ? numeric_prefix(text + start, end - start)
+                             : bytes_prefix(text + start, end - start);
+    return line;
+}
+
+static int compare_keys(const SortOpts *o, const SortLine *a, const SortLine *b) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    if (o->numeric) {
+        return 0;
+    }
+    // Equal prefixes: the first min(8, lengths) bytes are equal
+    size_t common = a->key_len < b->key_len ? a->key_len : b->key_len;
+    size_t skip = common < 8 ? common : 8;
+    int c = memcmp(a->text + a->key + skip, b->text + b->key + skip, common - skip);
+    if (c != 0) {
+        return c;
+    }
+    return a->key_len < b->key_len ? -1 : a->key_len > b->key_len;
+}
+
+/* Orders by key; lines with equal keys (unless -u) by their whole bytes,
+ * as sort(1) does as a last resort.
+ */
+static int compare_lines(const SortOpts *o, const SortLine *a, const SortLine *b) {
+    int c = compare_keys(o, a, b);
+    if (c == 0 && !o->unique && (o->numeric || o->key_start != 0)) {
+        size_t common = a->len < b->len ? a->len : b->len;
+        c = memcmp(a->text, b->text, common);
+        if (c == 0) {
+            c = a->len < b->len ? -1 : a->len > b->len;
+        }
+    }
+    return o->reverse ? -c : c;
+}
+
+// Sort comparison; equal lines keep their input order
+static int compare_sorted(const void *a, const void *b, void *ctx) {
+    const SortLine *x = a, *y = b;
+    int c = compare_lines(ctx, x, y);
+    return c != 0 ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+
+// ===== In-memory sort =====
+
+// One piece of a parallel sort: sort lines (through out), or merge a and b into out
+typedef struct {
+    const SortOpts *opts;
+    SortLine *lines;
+    size_t count;
+    const SortLine *a;
+    size_t na;
+    const SortLine *b;
+    size_t nb;
+    SortLine *out;
+} SortTask;
+
+// Orders by the prefix fields alone (by_prefix), or fully
+static inline int compare_step(const SortOpts *o, const SortLine *a, const SortLine *b, int by_prefix) {
+    if (by_prefix) {
+        int c = (a->prefix > b->prefix) - (a->prefix < b->prefix);
+        return o->reverse ? -c : c;
+    }
+    return compare_sorted(a, b, (void *)o);
+}
+
+// Merges the sorted a and b into out; ties go to a, so the order stays stable
+static void merge(const SortOpts *o, const SortLine *a, size_t na, const SortLine *b, size_t nb,
+                  SortLine *out, int by_prefix) {
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb) {
+        out[k++] = compare_step(o, &b[j], &a[i], by_prefix) < 0 ? b[j++] : a[i++];
+    }
+    memcpy(out + k, a + i, (na - i) * sizeof(SortLine));
+    memcpy(out + k + na - i, b + j, (nb - j) * sizeof(SortLine));
+}
+
+/* Sorts count lines with a stable bottom-up merge sort through scratch:
+ * runs of SORT_INSERTION_LEN lines are insertion sorted, then merged in
+ * rounds of doubling width. Unlike qsort_r(), the comparison is inlined.
+ */
+static void merge_sort(const SortOpts *o, SortLine *lines, SortLine *scratch, size_t count, int by_prefix) {
+    for (size_t lo = 0; lo < count; lo += SORT_INSERTION_LEN) {
+        size_t hi = lo + SORT_INSERTION_LEN < count ? lo + SORT_INSERTION_LEN : count;
+        for (size_t i = lo + 1; i < hi; i++) {
+            SortLine line = lines[i];
+            size_t j = i;
+            for (; j > lo && compare_step(o, &line, &lines[j - 1], by_prefix) < 0; j--) {
+                lines[j] = lines[j - 1];
+            }
+            lines[j] = line;
+        }
+    }
+    SortLine *from = lines, *to = scratch;
+    for (size_t width = SORT_INSERTION_LEN; width < count; width *= 2) {
+        for (size_t lo = 0; lo < count; lo += 2 * width) {
+            size_t mid = lo + width < count ? lo + width : count;
+            size_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+            merge(o, from + lo, mid - lo, from + mid, hi - mid, to + lo, by_prefix);
+        }
+        SortLine *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != lines) {
+        memcpy(lines, from, count * sizeof(SortLine));
+    }
+}
+
+/* Sorts count lines whose keys agree on their first depth bytes, and whose
+ * prefix fields hold the 8 key bytes after those. Lines are ordered by
+ * prefix alone, without touching their text; each group with equal
+ * prefixes is then sorted on its next 8 key bytes the same way, until the
+ * keys run out and the full comparison settles the rest. This reads each
+ * line's text a few times in order rather than at every comparison, and
+ * leaves the prefix fields as they were.
+ */
+static void sort_by_prefix(const SortOpts *o, SortLine *lines, SortLine *scratch, size_t count, size_t depth) {
+    merge_sort(o, lines, scratch, count, 1);
+    size_t end;
+    for (size_t start = 0; start < count; start = end) {
+        uint64_t prefix = lines[start].prefix;
+        int longer = 0;     // Some key goes on past these 8 bytes
+        for (end = start; end < count && lines[end].prefix == prefix; end++) {
+            longer |= lines[end].key_len > depth + 8;
+        }
+        if (end - start < 2) {
+            continue;
+        }
+        if (o->numeric || !longer) {
+            merge_sort(o, lines + start, scratch + start, end - start, 0);
+            continue;
+        }
+        for (size_t i = start; i < end; i++) {
+            SortLine *l = &lines[i];
+            size_t skip = l->key_len < depth + 8 ? l->key_len : depth + 8;
+            l->prefix = bytes_prefix(l->text + l->key + skip, l->key_len - skip);
+        }
+        sort_by_prefix(o, lines + start, scratch + start, end - start, depth + 8);
+        for (size_t i = start; i < end; i++) {
+            lines[i].prefix = prefix;
+        }
+    }
+}
+
+static void *sort_part(void *arg) {
+    SortTask *t = arg;
+    sort_by_prefix(t->opts, t->lines, t->out, t->count, 0);
+    return NULL;
+}
+
+static void *merge_parts(void *arg) {
+    SortTask *t = arg;
+    merge(t->opts, t->a, t->na, t->b, t->nb, t->out, 0);
+    return NULL;
+}
+
+// Runs fn on count tasks, one thread each, the first on the calling thread
+static void run_tasks(void *(*fn)(void *), SortTask *tasks, size_t count) {
+    pthread_t threads[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS];
+    for (size_t i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &tasks[i]) == 0;
+    }
+    fn(&tasks[0]);
+    for (size_t i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            fn(&tasks[i]);
+        }
+    }
+}
+
+/* Sorts count lines on up to opts->threads threads: each sorts a slice,
+ * then the sorted slices are merged pairwise, the pairs of each round in
+ * parallel, between lines and a scratch array.
+ */
+static void sort_lines(const SortOpts *opts, SortLine *lines, size_t count) {
+    size_t parts = opts->threads;
+    if (parts > count / SORT_PARALLEL_MIN) {
+        parts = count / SORT_PARALLEL_MIN;
+    }
+    if (parts == 0) {
+        parts = 1;
+    }
+    SortLine *scratch = count > 1 ? malloc(count * sizeof(SortLine)) : NULL;
+    if (scratch == NULL) {
+        qsort_r(lines, count, sizeof(SortLine), compare_sorted, (void *)opts);
+        return;
+    }
+
+    SortTask tasks[SORT_MAX_THREADS];
+    size_t bounds[SORT_MAX_THREADS + 1];
+    for (size_t i = 0; i <= parts; i++) {
+        bounds[i] = count * i / parts;
+    }
+    for (size_t i = 0; i < parts; i++) {
+        tasks[i] = (SortTask){.opts = opts, .lines = lines + bounds[i], .count = bounds[i + 1] - bounds[i],
+                              .out = scratch + bounds[i]};
+    }
+    run_tasks(sort_part, tasks, parts);
+
+    SortLine *from = lines, *to = scratch;
+    while (parts > 1) {
+        size_t pairs = parts / 2;
+        for (size_t i = 0; i < pairs; i++) {
+            size_t lo = bounds[2 * i], mid = bounds[2 * i + 1], hi = bounds[2 * i + 2];
+            tasks[i] = (SortTask){.opts = opts, .a = from + lo, .na = mid - lo,
+                                  .b = from + mid, .nb = hi - mid, .out = to + lo};
+        }
+        run_tasks(merge_parts, tasks, pairs);
+        if (parts % 2 == 1) {
+            size_t lo = bounds[parts - 1];
+            memcpy(to + lo, from + lo, (count - lo) * sizeof(SortLine));
+        }
+        for (size_t i = 0; i <= pairs; i++) {
+            bounds[i] = bounds[2 * i < parts ? 2 * i : parts];
+        }
+        bounds[(parts + 1) / 2] = count;
+        parts = (parts + 1) / 2;
+        SortLine *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != lines) {
+        memcpy(lines, from, count * sizeof(SortLine));
+    }
+    free(scratch);
+}
+
+// Emits one line and its newline
+static int emit_line(const SortLine *line, SortEmit emit, void *ctx) {
+    if (emit(ctx, line->text, line->len) == -1) {
+        return -1;
+    }
+    return emit(ctx, "\n", 1);
+}
+
+// Emits count sorted lines, dropping repeated keys for -u
+static int emit_sorted(const SortOpts *o, const SortLine *lines, size_t count, SortEmit emit, void *ctx) {
+    for (size_t i = 0; i < count; i++) {
+        if (o->unique && i > 0 && compare_keys(o, &lines[i - 1], &lines[i]) == 0) {
+            continue;
+        }
+        if (emit_line(&lines[i], emit, ctx) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// ===== Runs =====
+
+// A run being written to its temporary file
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t total;
+} RunWriter;
+
+// Return: 0 on success, -1 on a write error
+static int run_flush(RunWriter *w) {
+    size_t done = 0;
+    while (done < w->len) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    w->len = 0;
+    return 0;
+}
+
+// SortEmit into a RunWriter
+static int run_write(void *ctx, const char *text, size_t len) {
+    RunWriter *w = ctx;
+    w->total += len;
+    while (len > 0) {
+        if (w->len == SORT_WRITE_LEN && run_flush(w) == -1) {
+            return -1;
+        }
+        size_t n = SORT_WRITE_LEN - w->len < len ? SORT_WRITE_LEN - w->len : len;
+        memcpy(w->buf + w->len, text, n);
+        w->len += n;
+        text += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Creates an unlinked temporary file in $TMPDIR (default /tmp) for a run.
+ * Return: 0 on success, -1 on error
+ */
+static int run_open(RunWriter *w) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    size_t len = strlen(dir);
+    char *path = malloc(len + sizeof("/mysh-sort-XXXXXX"));
+    w->buf = malloc(SORT_WRITE_LEN);
+    if (path == NULL || w->buf == NULL) {
+        free(path);
+        free(w->buf);
+        return -1;
+    }
+    memcpy(path, dir, len);
+    memcpy(path + len, "/mysh-sort-XXXXXX", sizeof("/mysh-sort-XXXXXX"));
+    w->fd = mkostemp(path, O_CLOEXEC);
+    if (w->fd != -1) {
+        unlink(path);   // Gone once unmapped, however the shell exits
+    }
+    free(path);
+    w->len = w->total = 0;
+    if (w->fd == -1) {
+        free(w->buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Finishes w and appends its file, mapped, to s's runs.
+ * Return: 0 on success, -1 on error (the file is discarded either way on failure)
+ */
+static int run_close(Sorter *s, RunWriter *w, int ok) {
+    ok = ok && run_flush(w) == 0;
+    free(w->buf);
+    char *map = NULL;
+    if (ok && w->total > 0) {
+        map = mmap(NULL, w->total, PROT_READ, MAP_PRIVATE, w->fd, 0);
+        ok = map != MAP_FAILED;
+    }
+    close(w->fd);
+    if (!ok || map == NULL) {
+        return ok ? 0 : -1;
+    }
+    madvise(map, w->total, MADV_SEQUENTIAL);
+    if (s->nruns == s->runs_cap) {
+        size_t cap = s->runs_cap ? 2 * s->runs_cap : 16;
+        SortRun *runs = realloc(s->runs, cap * sizeof(SortRun));
+        if (runs == NULL) {
+            munmap(map, w->total);
+            return -1;
+        }
+        s->runs = runs;
+        s->runs_cap = cap;
+    }
+    s->runs[s->nruns++] = (SortRun){map, w->total};
+    return 0;
+}
+
+/* Gives up the text of the lines that were spilled: copied blocks are
+ * freed (the newest keeps its partial line), wholly indexed maps are
+ * unmapped and the indexed part of the current one is dropped from memory.
+ */
+static void release_text(Sorter *s) {
+    SortBlock *head = s->blocks;
+    if (head != NULL) {
+        SortBlock *b = head->next;
+        while (b != NULL) {
+            SortBlock *next = b->next;
+            free(b);
+            b = next;
+        }
+        memmove(head->data, head->data + head->indexed, head->len - head->indexed);
+        head->len -= head->indexed;
+        head->indexed = 0;
+        head->next = NULL;
+    }
+    SortMap **link = &s->maps;
+    while (*link != NULL) {
+        SortMap *m = *link;
+        if (m->done) {
+            munmap(m->map, m->len);
+            *link = m->next;
+            free(m);
+            continue;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        madvise(m->map, m->pos / page * page, MADV_DONTNEED);
+        link = &m->next;
+    }
+}
+
+/* Sorts the lines in memory and writes them out as a run.
+ * Return: 0 on success, -1 on error
+ */
+static int spill(Sorter *s) {
+    sort_lines(&s->opts, s->lines, s->count);
+    RunWriter w;
+    if (run_open(&w) == -1) {
+        display_error("ERROR: Cannot create temporary file for sort", "");
+        return -1;
+    }
+    int ok = emit_sorted(&s->opts, s->lines, s->count, run_write, &w) == 0;
+    if (run_close(s, &w, ok) == -1) {
+        display_error("ERROR: Cannot write temporary file for sort", "");
+        return -1;
+    }
+    s->count = 0;
+    s->bytes = 0;
+    release_text(s);
+    return 0;
+}
+
+// Return: 1 if the lines in memory, with their text, have used up the budget
+static int over_budget(const Sorter *s) {
+    return s->bytes + 2 * s->count * sizeof(SortLine) >= s->opts.budget;
+}
+
+// Return: 0 on success, -1 if memory runs out
+static int add_line(Sorter *s, const char *text, size_t len) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? 2 * s->cap : 1024;
+        SortLine *lines = realloc(s->lines, cap * sizeof(SortLine));
+        if (lines == NULL) {
+            return -1;
+        }
+        s->lines = lines;
+        s->cap = cap;
+    }
+    s->lines[s->count] = make_line(&s->opts, text, len, s->count);
+    s->count++;
+    s->bytes += len + 1;
+    return 0;
+}
+
+
+// ===== Input =====
+
+void sort_init(Sorter *s, const SortOpts *opts) {
+    memset(s, 0, sizeof(Sorter));
+    s->opts = *opts;
+    // Blocks small enough that a tight budget still holds several
+    s->block_len = opts->budget / 8 < SORT_BLOCK_LEN ? opts->budget / 8 : SORT_BLOCK_LEN;
+}
+
+/* Starts a new block for piped input, moving the partial line at the end
+ * of the current one into it.
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int new_block(Sorter *s) {
+    SortBlock *head = s->blocks;
+    size_t partial = head ? head->len - head->indexed : 0;
+    size_t cap = s->block_len > 2 * partial ? s->block_len : 2 * partial;
+    SortBlock *b = malloc(sizeof(SortBlock) + cap);
+    if (b == NULL) {
+        return -1;
+    }
+    b->len = partial;
+    b->cap = cap;
+    b->indexed = 0;
+    b->next = head;
+    if (head != NULL) {
+        memcpy(b->data, head->data + head->indexed, partial);
+        head->len = head->indexed;
+        if (head->indexed == 0) {
+            b->next = head->next;   // Held nothing but the partial line
+            free(head);
+        }
+    }
+    s->blocks = b;
+    s->bytes += sizeof(SortBlock);
+    return 0;
+}
+
+/* Indexes the whole lines of the current block, then spills if the
+ * budget is used up.
+ * Return: 0 on success, -1 on error
+ */
+static int index_block(Sorter *s) {
+    SortBlock *b = s->blocks;
+    const char *nl;
+    while ((nl = memchr(b->data + b->indexed, '\n', b->len - b->indexed)) != NULL) {
+        size_t end = nl - b->data;
+        if (add_line(s, b->data + b->indexed, end - b->indexed) == -1) {
+            return -1;
+        }
+        b->indexed = end + 1;
+    }
+    return over_budget(s) ? spill(s) : 0;
+}
+
+/* Indexes the partial line left at the end of piped input.
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int end_input(Sorter *s) {
+    SortBlock *b = s->blocks;
+    if (b == NULL || b->len == b->indexed) {
+        return 0;
+    }
+    if (add_line(s, b->data + b->indexed, b->len - b->indexed) == -1) {
+        return -1;
+    }
+    b->indexed = b->len;
+    return 0;
+}
+
+int sort_chunk(Sorter *s, const char *data, size_t len) {
+    while (len > 0) {
+        SortBlock *b = s->blocks;
+        if ((b == NULL || b->len == b->cap) && new_block(s) == -1) {
+            return -1;
+        }
+        b = s->blocks;
+        size_t n = b->cap - b->len < len ? b->cap - b->len : len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        data += n;
+        len -= n;
+        if (index_block(s) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Indexes the lines of a mapped file in place, spilling whenever the
+ * budget is used up.
+ * Return: 0 on success, -1 on error
+ */
+static int index_map(Sorter *s, SortMap *m) {
+    while (m->pos < m->len) {
+        const char *start = m->map + m->pos;
+        const char *nl = memchr(start, '\n', m->len - m->pos);
+        size_t len = nl ? (size_t)(nl - start) : m->len - m->pos;
+        if (add_line(s, start, len) == -1) {
+            return -1;
+        }
+        m->pos += len + 1;
+        if (m->pos > m->len) {
+            m->pos = m->len;
+        }
+        if (over_budget(s) && spill(s) == -1) {
+            return -1;
+        }
+    }
+    m->done = 1;
+    return 0;
+}
+
+int sort_fd(Sorter *s, int fd) {
+    // Lines are indexed in place, so the mapping lives as long as s
+    size_t size, off;
+    char *map = map_rest(fd, &size, &off);
+    if (map != NULL) {
+        SortMap *m = calloc(1, sizeof(SortMap));
+        if (m == NULL) {
+            munmap(map, size);
+            return -1;
+        }
+        m->map = map;
+        m->len = size;
+        m->pos = off;
+        m->next = s->maps;
+        s->maps = m;
+        return index_map(s, m);
+    }
+
+    // Read straight into the free end of the current block
+    for (;;) {
+        SortBlock *b = s->blocks;
+        if ((b == NULL || b->len == b->cap) && new_block(s) == -1) {
+            return -1;
+        }
+        b = s->blocks;
+        ssize_t n = read(fd, b->data + b->len, b->cap - b->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0 ? end_input(s) : -1;
+        }
+        b->len += n;
+        if (index_block(s) == -1) {
+            return -1;
+        }
+    }
+}
+
+
+// ===== Output =====
+
+// A sorted source for the final merge: a spilled run, or the lines in memory
+typedef struct {
+    const char *pos;        // Run: next line
+    const char *end;
+    const SortLine *lines;  // Memory
+    size_t count;
+    SortLine head;          // Current line
+    size_t order;           // Input order of the source, for stable ties
+} MergeSource;
+
+// Return: 1 if src has a new head line, 0 if it is exhausted
+static int source_next(const SortOpts *o, MergeSource *src) {
+    if (src->lines != NULL) {
+        if (src->count == 0) {
+            return 0;
+        }
+        src->head = *src->lines++;
+        src->count--;
+        return 1;
+    }
+    if (src->pos >= src->end) {
+        return 0;
+    }
+    const char *nl = memchr(src->pos, '\n', src->end - src->pos);
+    size_t len = nl ? (size_t)(nl - src->pos) : (size_t)(src->end - src->pos);
+    src->head = make_line(o, src->pos, len, 0);
+    src->pos += len + 1;
+    return 1;
+}
+
+static int source_before(const SortOpts *o, const MergeSource *a, const MergeSource *b) {
+    int c = compare_lines(o, &a->head, &b->head);
+    return c != 0 ? c < 0 : a->order < b->order;
+}
+
+static void heap_down(const SortOpts *o, MergeSource **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && source_before(o, heap[l], heap[least])) {
+            least = l;
+        }
+        if (r < n && source_before(o, heap[r], heap[least])) {
+            least = r;
+        }
+        if (least == i) {
+            return;
+        }
+        MergeSource *swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/* Merges count sorted sources through a binary heap, dropping repeated
+ * keys for -u.
+ * Return: 0 on success, -1 if emit failed or memory runs out
+ */
+static int merge_sources(const SortOpts *o, MergeSource *sources, size_t count, SortEmit emit, void *ctx) {
+    MergeSource **heap = malloc(count * sizeof(MergeSource *));
+    if (heap == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        sources[i].order = i;
+        if (source_next(o, &sources[i])) {
+            heap[n++] = &sources[i];
+        }
+    }
+    for (size_t i = n / 2; i-- > 0;) {
+        heap_down(o, heap, n, i);
+    }
+    SortLine last;
+    int have_last = 0;
+    int ret = 0;
+    while (n > 0) {
+        MergeSource *top = heap[0];
+        if (!o->unique || !have_last || compare_keys(o, &last, &top->head) != 0) {
+            if (emit_line(&top->head, emit, ctx) == -1) {
+                ret = -1;
+                break;
+            }
+            last = top->head;
+            have_last = 1;
+        }
+        if (!source_next(o, top)) {
+            heap[0] = heap[--n];
+        }
+        heap_down(o, heap, n, 0);
+    }
+    free(heap);
+    return ret;
+}
+
+/* Merges the first count runs into one, which takes their place.
+ * Return: 0 on success, -1 on error
+ */
+static int merge_runs(Sorter *s, size_t count) {
+    MergeSource *sources = calloc(count, sizeof(MergeSource));
+    RunWriter w;
+    if (sources == NULL || run_open(&w) == -1) {
+        free(sources);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sources[i].pos = s->runs[i].map;
+        sources[i].end = s->runs[i].map + s->runs[i].len;
+    }
+    int ok = merge_sources(&s->opts, sources, count, run_write, &w) == 0;
+    free(sources);
+    size_t before = s->nruns;
+    if (run_close(s, &w, ok) == -1) {
+        return -1;
+    }
+    // Move the merged run (if not empty) to the front, in the input order of what it holds
+    SortRun merged = s->nruns > before ? s->runs[--s->nruns] : (SortRun){NULL, 0};
+    for (size_t i = 0; i < count; i++) {
+        munmap(s->runs[i].map, s->runs[i].len);
+    }
+    size_t keep = merged.map != NULL;
+    memmove(s->runs + keep, s->runs + count, (s->nruns - count) * sizeof(SortRun));
+    s->nruns = s->nruns - count + keep;
+    if (keep) {
+        s->runs[0] = merged;
+    }
+    return 0;
+}
+
+int sort_finish(Sorter *s, SortEmit emit, void *ctx) {
+    if (end_input(s) == -1) {
+        return -1;
+    }
+    sort_lines(&s->opts, s->lines, s->count);
+    if (s->nruns == 0) {
+        return emit_sorted(&s->opts, s->lines, s->count, emit, ctx);
+    }
+
+    // Too many runs to merge at once: merge them in groups first
+    while (s->nruns + 1 > SORT_MERGE_FANIN) {
+        if (merge_runs(s, SORT_MERGE_FANIN) == -1) {
+            display_error("ERROR: Cannot write temporary file for sort", "");
+            return -1;
+        }
+    }
+    MergeSource *sources = calloc(s->nruns + 1, sizeof(MergeSource));
+    if (sources == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < s->nruns; i++) {
+        sources[i].pos = s->runs[i].map;
+        sources[i].end = s->runs[i].map + s->runs[i].len;
+    }
+    // The lines still in memory came last
+    sources[s->nruns].lines = s->lines;
+    sources[s->nruns].count = s->count;
+    int ret = merge_sources(&s->opts, sources, s->nruns + 1, emit, ctx);
+    free(sources);
+    return ret;
+}
+
+void sort_free(Sorter *s) {
+    free(s->lines);
+    while (s->blocks != NULL) {
+        SortBlock *next = s->blocks->next;
+        free(s->blocks);
+        s->blocks = next;
+    }
+    while (s->maps != NULL) {
+        SortMap *next = s->maps->next;
+        munmap(s->maps->map, s->maps->len);
+        free(s->maps);
+        s->maps = next;
+    }
+    for (size_t i = 0; i < s->nruns; i++) {
+        munmap(s->runs[i].map, s->runs[i].len);
+    }
+    free(s->runs);
+    memset(s, 0, sizeof(Sorter));
+}
@@ -0,0 +1,103 @@
+#ifndef __SORT_H__
+#define __SORT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SORT_BLOCK_LEN (4 << 20)        // Most bytes of piped input read into one block
+#define SORT_MIN_BUDGET (1 << 20)       // Smallest -S accepted
+#define SORT_PARALLEL_MIN (1 << 15)     // Fewer lines than this are sorted on one thread
+#define SORT_INSERTION_LEN 16           // Runs the merge sort starts from
+#define SORT_MAX_THREADS 64
+#define SORT_MERGE_FANIN 64             // Most runs merged at once; more take extra passes
+#define SORT_WRITE_LEN (1 << 20)        // Buffer of a run being written out
+
+
+typedef int (*SortEmit)(void *ctx, const char *text, size_t len);
+
+typedef struct {
+    int reverse;            // -r
+    int numeric;            // -n: compare the key's leading number
+    int unique;             // -u: keep the first of each run of equal keys
+    int key_start;          // -k N[,M]: key is fields N..M (1-based), 0 for the whole line
+    int key_end;            // 0: to the end of the line
+    int separator;          // -t C: field separator, -1 for blank-separated fields
+    size_t budget;          // -S: memory for lines in RAM before runs are spilled
+    int threads;            // -j
+} SortOpts;
+
+/* A line to be sorted: where it is, where its key is, and the first
+ * bytes of the key (or the key's number, for -n) packed so that most
+ * comparisons are a single integer compare that never touches the text.
+ */
+typedef struct {
+    uint64_t prefix;
+    const char *text;
+    uint32_t len;           // Without the newline
+    uint32_t key;           // Offset of the key in text
+    uint32_t key_len;
+    uint32_t seq;           // Position in input within its run, for a stable order
+} SortLine;
+
+typedef struct SortBlock SortBlock;
+typedef struct SortMap SortMap;
+
+/* A sorted run spilled to an unlinked temporary file, mapped for merging.
+ */
+typedef struct {
+    char *map;
+    size_t len;
+} SortRun;
+
+/* Lines gathered so far. The ones in memory are indexed into lines; once
+ * they (with their text) outgrow opts.budget they are sorted and spilled
+ * as a run, and the runs are merged at the end.
+ */
+typedef struct {
+    SortOpts opts;
+    SortLine *lines;
+    size_t count;
+    size_t cap;
+    size_t bytes;           // Text held for the indexed lines
+    SortBlock *blocks;      // Copied input, newest first; its unindexed tail is a partial line
+    size_t block_len;
+    SortMap *maps;          // Mapped input files
+    SortRun *runs;
+    size_t nruns;
+    size_t runs_cap;
+} Sorter;
+
+
+/* Parses the options of argv (argv[0] is the builtin's name): -r, -n, -u
+ * (which may be combined), -k N[,M], -t C, -S SIZE[bKMGT] (default unit
+ * K; default a quarter of physical memory) and -j N.
+ * Return: index of the first file operand, or -1 on an invalid option
+ * (already reported)
+ */
+int sort_parse(char **argv, SortOpts *opts);
+
+void sort_init(Sorter *s, const SortOpts *opts);
+
+/* Adds the next len bytes of piped input, which may end mid-line.
+ * Return: 0 on success, -1 if memory runs out or a run cannot be spilled
+ */
+int sort_chunk(Sorter *s, const char *data, size_t len);
+
+/* Adds the rest of fd: a regular file is mapped and its lines indexed in
+ * place, anything else is read in blocks.
+ * Return: 0 on success, -1 on a read error, if memory runs out or a run
+ * cannot be spilled
+ */
+int sort_fd(Sorter *s, int fd);
+
+/* Sorts what was added and emits it, one line per newline terminated
+ * line, merging the spilled runs if there are any.
+ * Return: 0 on success, -1 if emit failed or memory runs out
+ */
+int sort_finish(Sorter *s, SortEmit emit, void *ctx);
+
+void sort_free(Sorter *s);
+
+
+#endif
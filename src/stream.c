@@ -0,0 +1,573 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "grep.h"
+#include "io_helpers.h"
+#include "sort.h"
+#include "stream.h"
+#include "uniq.h"
+#include "wc.h"
+
+
+// ===== Fused builtin pipelines =====
+
+/* Passes len bytes of st's output to the next stage, or writes them to
+ * out_fd from the last one.
+ * Return: 0 on success, -1 on error
+ */
+int stream_emit(StreamStage *st, const char *data, size_t len) {
+    if (st->next != NULL) {
+        if (st->next->ops->chunk(st->next, data, len) == -1) {
+            st->next_failed = 1;
+            return -1;
+        }
+        return 0;
+    }
+    return out_write(st->out_fd, data, len);
+}
+
+/* Emits the whole file at path from st: mapped and handed on in
+ * STREAM_CHUNK_LEN slices, or read into a buffer when it cannot be mapped
+ * (pipes, /proc files, ...).
+ * Return: 0 on success, -1 on error
+ */
+static int emit_file(StreamStage *st, const char *path, int (*sink)(StreamStage *, const char *, size_t)) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", (char *)path);
+        return -1;
+    }
+    int ret = 0;
+    struct stat st_buf;
+    if (fstat(fd, &st_buf) == 0 && S_ISREG(st_buf.st_mode) && st_buf.st_size > 0) {
+        size_t size = st_buf.st_size;
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            for (size_t off = 0; off < size && ret == 0; off += STREAM_CHUNK_LEN) {
+                size_t len = size - off < STREAM_CHUNK_LEN ? size - off : STREAM_CHUNK_LEN;
+                ret = sink(st, map + off, len);
+            }
+            munmap(map, size);
+            close(fd);
+            return ret;
+        }
+    }
+
+    char *buf = malloc(STREAM_CHUNK_LEN);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+    ssize_t n;
+    while (ret == 0 && (n = read(fd, buf, STREAM_CHUNK_LEN)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        ret = sink(st, buf, n);
+    }
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+/* "-" is the upstream input, which passes straight through; naming it
+ * among files would interleave the two, which one loop cannot do
+ */
+static int cat_produces(char **argv) {
+    int files = 0, stdin_too = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            stdin_too = 1;
+        } else {
+            files = 1;
+        }
+    }
+    return files && stdin_too ? -1 : files;
+}
+
+static int produces_always(char **argv) {
+    (void)argv;
+    return 1;
+}
+
+static int no_finish(StreamStage *st) {
+    (void)st;
+    return 0;
+}
+
+// cat: passes chunks through untouched (no copy), or emits its file
+static int cat_chunk(StreamStage *st, const char *data, size_t len) {
+    return stream_emit(st, data, len);
+}
+
+static int cat_produce(StreamStage *st) {
+    for (int i = 1; st->argv[i] != NULL; i++) {
+        if (emit_file(st, st->argv[i], cat_chunk) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int emit_text(void *ctx, const char *text, size_t len) {
+    return stream_emit(ctx, text, len);
+}
+
+// wc: counts its input and emits the totals at the end
+typedef struct {
+    WcCounts counts;
+    unsigned what;          // 0 until the options are parsed
+    int operand;            // Index of the first file argument
+    int many;               // Several files: their rows are emitted by produce
+} WcStage;
+
+/* Return: st's state with its options parsed, or NULL if they are invalid
+ */
+static WcStage *wc_stage(StreamStage *st) {
+    WcStage *wc = st->state;
+    if (wc->what == 0) {
+        wc->operand = wc_parse_flags(st->argv, &wc->what);
+        if (wc->operand == -1) {
+            return NULL;
+        }
+    }
+    return wc;
+}
+
+static int wc_produces(char **argv) {
+    int i = 1;
+    while (argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' && strcmp(argv[i], "--") != 0) {
+        i++;
+    }
+    if (argv[i] != NULL && strcmp(argv[i], "--") == 0) {
+        i++;
+    }
+    return argv[i] != NULL;
+}
+
+static int wc_chunk(StreamStage *st, const char *data, size_t len) {
+    WcStage *wc = wc_stage(st);
+    if (wc == NULL) {
+        return -1;
+    }
+    wc_count(&wc->counts, data, len, wc->what);
+    return 0;
+}
+
+static int wc_produce(StreamStage *st) {
+    WcStage *wc = wc_stage(st);
+    if (wc == NULL) {
+        return -1;
+    }
+    if (st->argv[wc->operand + 1] != NULL) {
+        size_t count = 0;
+        while (st->argv[wc->operand + count] != NULL) {
+            count++;
+        }
+        wc->many = 1;
+        return wc_files(st->argv + wc->operand, count, wc->what, emit_text, st);
+    }
+    const char *path = st->argv[wc->operand];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", (char *)path);
+        return -1;
+    }
+    int ret = wc_count_fd(&wc->counts, fd, wc->what);
+    close(fd);
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", (char *)path);
+    }
+    return ret;
+}
+
+static int wc_finish(StreamStage *st) {
+    WcStage *wc = wc_stage(st);
+    if (wc == NULL) {
+        return -1;
+    }
+    if (wc->many) {
+        return 0;
+    }
+    char buf[256];
+    size_t len = wc_format(buf, sizeof(buf), &wc->counts, wc->what);
+    return stream_emit(st, buf, len);
+}
+
+// echo: emits its arguments
+static int echo_produce(StreamStage *st) {
+    for (int i = 1; st->argv[i] != NULL; i++) {
+        if ((i > 1 && stream_emit(st, " ", 1) == -1) ||
+            stream_emit(st, st->argv[i], strlen(st->argv[i])) == -1) {
+            return -1;
+        }
+    }
+    return stream_emit(st, "\n", 1);
+}
+
+static int echo_chunk(StreamStage *st, const char *data, size_t len) {
+    (void)st, (void)data, (void)len;
+    return 0;   // Never called: echo always produces
+}
+
+// grep: selects lines of its input, or searches its files
+typedef struct {
+    GrepQuery q;
+    GrepScan scan;
+    int operand;            // Index of the first file argument; 0 until parsed
+    int finished;           // produce already printed everything
+} GrepStage;
+
+/* Return: st's state with its options and pattern parsed, or NULL if they
+ * are invalid
+ */
+static GrepStage *grep_stage(StreamStage *st) {
+    GrepStage *grep = st->state;
+    if (grep->operand == 0) {
+        int operand = grep_parse(st->argv, &grep->q);
+        if (operand == -1) {
+            return NULL;
+        }
+        grep->operand = operand;
+        grep_scan_init(&grep->scan, &grep->q, NULL, 0, emit_text, st);
+    }
+    return grep;
+}
+
+static int grep_produces(char **argv) {
+    int i = 1;
+    while (argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' && strcmp(argv[i], "--") != 0) {
+        i++;
+    }
+    if (argv[i] != NULL && strcmp(argv[i], "--") == 0) {
+        i++;
+    }
+    return argv[i] != NULL && argv[i + 1] != NULL;
+}
+
+static int grep_chunk_stage(StreamStage *st, const char *data, size_t len) {
+    GrepStage *grep = grep_stage(st);
+    return grep != NULL ? grep_chunk(&grep->scan, data, len) : -1;
+}
+
+static int grep_produce(StreamStage *st) {
+    GrepStage *grep = grep_stage(st);
+    if (grep == NULL) {
+        return -1;
+    }
+    grep->finished = 1;
+    char **paths = st->argv + grep->operand;
+    if (paths[1] != NULL) {
+        size_t count = 0;
+        while (paths[count] != NULL) {
+            count++;
+        }
+        return grep_files(paths, count, &grep->q, emit_text, st);
+    }
+    int fd = open(paths[0], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", paths[0]);
+        return -1;
+    }
+    grep_scan_init(&grep->scan, &grep->q, paths[0], 0, emit_text, st);
+    int ret = grep_fd(&grep->scan, fd);
+    close(fd);
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", paths[0]);
+    }
+    return ret;
+}
+
+static int grep_finish_stage(StreamStage *st) {
+    GrepStage *grep = grep_stage(st);
+    if (grep == NULL) {
+        return -1;
+    }
+    return grep->finished ? 0 : grep_finish(&grep->scan);
+}
+
+static void grep_destroy(StreamStage *st) {
+    GrepStage *grep = st->state;
+    if (grep->operand > 0) {
+        carry_free(&grep->scan.carry);  // Left over if the pipeline failed midway
+        grep_free(&grep->q);
+    }
+}
+
+// sort: gathers its input (or its files), and emits it sorted at the end
+typedef struct {
+    Sorter sorter;
+    int operand;            // Index of the first file argument; 0 until parsed
+} SortStage;
+
+static SortStage *sort_stage(StreamStage *st) {
+    SortStage *sort = st->state;
+    if (sort->operand == 0) {
+        SortOpts opts;
+        int operand = sort_parse(st->argv, &opts);
+        if (operand == -1) {
+            return NULL;
+        }
+        sort->operand = operand;
+        sort_init(&sort->sorter, &opts);
+    }
+    return sort;
+}
+
+static int sort_produces(char **argv) {
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        // -k, -t, -S and -j take the rest of the word, or the next word
+        const char *f = argv[i] + 1 + strcspn(argv[i] + 1, "ktSj");
+        if (*f != '\0' && f[1] == '\0' && argv[i + 1] != NULL) {
+            i++;
+        }
+    }
+    return argv[i] != NULL;
+}
+
+static int sort_chunk_stage(StreamStage *st, const char *data, size_t len) {
+    SortStage *sort = sort_stage(st);
+    return sort != NULL ? sort_chunk(&sort->sorter, data, len) : -1;
+}
+
+static int sort_produce(StreamStage *st) {
+    SortStage *sort = sort_stage(st);
+    if (sort == NULL) {
+        return -1;
+    }
+    for (int i = sort->operand; st->argv[i] != NULL; i++) {
+        int fd = open(st->argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            display_error("ERROR: Cannot open file: ", st->argv[i]);
+            return -1;
+        }
+        int ret = sort_fd(&sort->sorter, fd);
+        close(fd);
+        if (ret == -1) {
+            display_error("ERROR: Cannot read input: ", st->argv[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int sort_finish_stage(StreamStage *st) {
+    SortStage *sort = sort_stage(st);
+    return sort != NULL ? sort_finish(&sort->sorter, emit_text, st) : -1;
+}
+
+static void sort_destroy(StreamStage *st) {
+    SortStage *sort = st->state;
+    if (sort->operand > 0) {
+        sort_free(&sort->sorter);
+    }
+}
+
+// uniq: drops repeated lines of its input, or of its file
+typedef struct {
+    UniqScan scan;
+    int operand;            // Index of the file argument; 0 until parsed
+    int finished;           // produce already printed everything
+} UniqStage;
+
+static UniqStage *uniq_stage(StreamStage *st) {
+    UniqStage *uniq = st->state;
+    if (uniq->operand == 0) {
+        unsigned flags;
+        int operand = uniq_parse(st->argv, &flags);
+        if (operand == -1) {
+            return NULL;
+        }
+        uniq->operand = operand;
+        uniq_init(&uniq->scan, flags, emit_text, st);
+    }
+    return uniq;
+}
+
+static int uniq_chunk_stage(StreamStage *st, const char *data, size_t len) {
+    UniqStage *uniq = uniq_stage(st);
+    return uniq != NULL ? uniq_chunk(&uniq->scan, data, len) : -1;
+}
+
+static int uniq_produce(StreamStage *st) {
+    UniqStage *uniq = uniq_stage(st);
+    if (uniq == NULL) {
+        return -1;
+    }
+    uniq->finished = 1;
+    const char *path = st->argv[uniq->operand];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open file: ", (char *)path);
+        return -1;
+    }
+    int ret = uniq_fd(&uniq->scan, fd);
+    close(fd);
+    if (ret == -1) {
+        display_error("ERROR: Cannot read input: ", (char *)path);
+    }
+    return ret;
+}
+
+static int uniq_finish_stage(StreamStage *st) {
+    UniqStage *uniq = uniq_stage(st);
+    if (uniq == NULL) {
+        return -1;
+    }
+    return uniq->finished ? 0 : uniq_finish(&uniq->scan);
+}
+
+static void uniq_destroy(StreamStage *st) {
+    UniqStage *uniq = st->state;
+    if (uniq->operand > 0) {
+        uniq_free(&uniq->scan);
+    }
+}
+
+static const StreamOps STREAM_OPS[] = {
+    {"cat", 0, cat_produces, cat_produce, cat_chunk, no_finish, NULL},
+    {"wc", sizeof(WcStage), wc_produces, wc_produce, wc_chunk, wc_finish, NULL},
+    {"echo", 0, produces_always, echo_produce, echo_chunk, no_finish, NULL},
+    {"grep", sizeof(GrepStage), grep_produces, grep_produce, grep_chunk_stage, grep_finish_stage,
+     grep_destroy},
+    {"sort", sizeof(SortStage), sort_produces, sort_produce, sort_chunk_stage, sort_finish_stage,
+     sort_destroy},
+    {"uniq", sizeof(UniqStage), wc_produces, uniq_produce, uniq_chunk_stage, uniq_finish_stage,
+     uniq_destroy},
+};
+
+/* Return: the streaming form of builtin name, or NULL if it has none
+ */
+const StreamOps *stream_lookup(const char *name) {
+    for (size_t i = 0; i < sizeof(STREAM_OPS) / sizeof(STREAM_OPS[0]); i++) {
+        if (strcmp(STREAM_OPS[i].name, name) == 0) {
+            return &STREAM_OPS[i];
+        }
+    }
+    return NULL;
+}
+
+/* Return: 1 if every stage of pl has a streaming form for its arguments
+ * and only the ends
+ * of the pipeline are redirected (stdin of the first, stdout/stderr of the
+ * last), 0 otherwise
+ */
+int stream_fusable(const Pipeline *pl) {
+    for (size_t i = 0; i < pl->count; i++) {
+        const StreamOps *ops = stream_lookup(pl->cmds[i].argv[0]);
+        if (ops == NULL || ops->produces(pl->cmds[i].argv) == -1) {
+            return 0;
+        }
+        for (const Redirect *r = pl->cmds[i].redirs; r != NULL; r = r->next) {
+            int at_start = i == 0 && r->fd == STDIN_FILENO;
+            int at_end = i == pl->count - 1 && r->fd != STDIN_FILENO;
+            if (!at_start && !at_end) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Runs a fusable pipeline as one in-process loop.
+ * Return: 0 on success, -1 if a stage failed
+ */
+int stream_run(const Pipeline *pl) {
+    size_t count = pl->count;
+    StreamStage stages[count];
+    const int io_fds[MAX_SAVED_FDS] = {io_in_fd, io_out_fd, io_err_fd};
+    int in_fds[MAX_SAVED_FDS] = {io_in_fd, io_out_fd, io_err_fd};
+    int out_fds[MAX_SAVED_FDS] = {io_in_fd, io_out_fd, io_err_fd};
+    int ret = -1;
+
+    memset(stages, 0, sizeof(stages));
+    if (open_redirects(pl->cmds[0].redirs, in_fds) == -1 ||
+        open_redirects(pl->cmds[count - 1].redirs, out_fds) == -1) {
+        goto done;
+    }
+    io_err_fd = out_fds[2];
+
+    // The last stage that ignores its input is where the data starts
+    size_t first = 0;
+    for (size_t i = 0; i < count; i++) {
+        StreamStage *st = &stages[i];
+        st->ops = stream_lookup(pl->cmds[i].argv[0]);
+        st->argv = pl->cmds[i].argv;
+        st->next = i + 1 < count ? &stages[i + 1] : NULL;
+        st->out_fd = out_fds[1];
+        st->state = calloc(1, st->ops->state_size ? st->ops->state_size : 1);
+        if (st->state == NULL) {
+            goto done;
+        }
+        if (st->ops->produces(st->argv) == 1) {
+            first = i;
+        }
+    }
+
+    // A failure is reported for the stage it happened in, as the threaded
+    // stages are: the stages before it only saw their output refused
+    size_t entry = first;
+    if (stages[first].ops->produces(stages[first].argv) == 1) {
+        ret = stages[first].ops->produce(&stages[first]);
+    } else if (isatty(in_fds[0])) {
+        display_error("ERROR: No input source provided", "");
+    } else {
+        char *buf = malloc(STREAM_CHUNK_LEN);
+        ret = buf != NULL ? 0 : -1;
+        ssize_t n;
+        while (ret == 0 && (n = read(in_fds[0], buf, STREAM_CHUNK_LEN)) != 0) {
+            if (n == -1) {
+                ret = errno == EINTR ? 0 : -1;
+                continue;
+            }
+            ret = stages[0].ops->chunk(&stages[0], buf, n);
+        }
+        free(buf);
+    }
+    for (size_t i = first; i < count && ret == 0; i++) {
+        entry = i;
+        ret = stages[i].ops->finish(&stages[i]);
+    }
+    if (ret == -1) {
+        while (entry + 1 < count && stages[entry].next_failed) {
+            entry++;
+        }
+        display_error("ERROR: Builtin failed: ", stages[entry].argv[0]);
+    }
+
+done:
+    out_flush_all();
+    for (size_t i = 0; i < count; i++) {
+        if (stages[i].state != NULL && stages[i].ops->destroy != NULL) {
+            stages[i].ops->destroy(&stages[i]);
+        }
+        free(stages[i].state);
+    }
+    // Close what the redirections opened
+    for (int i = 0; i < MAX_SAVED_FDS; i++) {
+        if (in_fds[i] != io_fds[i]) {
+            close(in_fds[i]);
+        }
+        if (out_fds[i] != io_fds[i]) {
+            close(out_fds[i]);
+        }
+    }
+    io_err_fd = io_fds[2];
+    return ret;
+}
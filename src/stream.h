@@ -0,0 +1,65 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "commands.h"
+
+
+#define STREAM_CHUNK_LEN (1 << 20)  // Bytes handed from stage to stage at a time
+
+
+// ===== Fused builtin pipelines =====
+
+typedef struct StreamStage StreamStage;
+
+/* Streaming form of a builtin. Instead of reading and writing descriptors,
+ * a stage is handed its input as chunks and passes its output on with
+ * stream_emit, so a chain of such builtins runs as one loop in the shell
+ * with no pipes, no syscalls between stages and no copies.
+ */
+typedef struct {
+    const char *name;
+    size_t state_size;                              // Zeroed per-stage state
+    int (*produces)(char **argv);                   // Ignores its input (e.g. cat FILE)? -1 if
+                                                    // these arguments cannot be streamed
+    int (*produce)(StreamStage *st);                // Emits the output of a producing stage
+    int (*chunk)(StreamStage *st, const char *data, size_t len);
+    int (*finish)(StreamStage *st);                 // Called once after the last chunk
+    void (*destroy)(StreamStage *st);               // Releases the state, if not NULL
+} StreamOps;
+
+struct StreamStage {
+    const StreamOps *ops;
+    char **argv;
+    void *state;
+    StreamStage *next;      // NULL for the last stage
+    int out_fd;             // Output of the last stage
+    int next_failed;        // The failure came from a later stage
+};
+
+/* Passes len bytes of st's output to the next stage, or writes them to
+ * out_fd from the last one.
+ * Return: 0 on success, -1 on error
+ */
+int stream_emit(StreamStage *st, const char *data, size_t len);
+
+/* Return: the streaming form of builtin name, or NULL if it has none
+ */
+const StreamOps *stream_lookup(const char *name);
+
+/* Return: 1 if every stage of pl has a streaming form for its arguments
+ * and only the ends
+ * of the pipeline are redirected (stdin of the first, stdout/stderr of the
+ * last), 0 otherwise
+ */
+int stream_fusable(const Pipeline *pl);
+
+/* Runs a fusable pipeline as one in-process loop.
+ * Return: 0 on success, -1 if a stage failed
+ */
+int stream_run(const Pipeline *pl);
+
+
+#endif
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE  // For gettid()
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "io_helpers.h"
+#include "trace.h"
+
+#define TRACE_WRITE_LEN 16384   // Bytes of JSON formatted per write()
+
+
+// One buffered event. Timestamps are CLOCK_MONOTONIC nanoseconds.
+typedef struct {
+    const char *name;
+    uint64_t start;
+    uint64_t dur;
+    char phase;                 // 'X' (complete) or 'i' (instant)
+    char arg[TRACE_ARG_LEN];
+} TraceRecord;
+
+// Per-thread ring, drained to the trace file whenever it fills up.
+typedef struct {
+    pid_t tid;
+    size_t count;
+    TraceRecord recs[TRACE_RING_LEN];
+} TraceRing;
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static char *trace_file = NULL;
+static __thread TraceRing *ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Copies src into dst as the body of a JSON string.
+ */
+static void json_escape(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+    for (; *src != '\0' && n + 3 < size; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else {
+            dst[n++] = c < 0x20 ? '?' : c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+/* Writes every record in r to the trace file and empties it.
+ */
+static void flush_ring(TraceRing *r) {
+    if (r->count == 0 || trace_fd == -1) {
+        r->count = 0;
+        return;
+    }
+    char buf[TRACE_WRITE_LEN];
+    size_t len = 0;
+    pid_t pid = getpid();
+    for (size_t i = 0; i < r->count; i++) {
+        const TraceRecord *rec = &r->recs[i];
+        char arg[TRACE_ARG_LEN * 2];
+        json_escape(arg, sizeof(arg), rec->arg);
+        if (len + 256 > sizeof(buf)) {
+            write_all(trace_fd, buf, len);
+            len = 0;
+        }
+        if (rec->phase == 'X') {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "{\"name\":\"%s\",\"cat\":\"mysh\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":\"%s\"}},\n",
+                            rec->name, rec->start / 1000.0, rec->dur / 1000.0, pid, r->tid, arg);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "{\"name\":\"%s\",\"cat\":\"mysh\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                            "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":\"%s\"}},\n",
+                            rec->name, rec->start / 1000.0, pid, r->tid, arg);
+        }
+    }
+    write_all(trace_fd, buf, len);
+    r->count = 0;
+}
+
+// Thread exit: drain and release that thread's ring.
+static void release_ring(void *arg) {
+    TraceRing *r = arg;
+    flush_ring(r);
+    free(r);
+}
+
+// Forked child: the records buffered so far belong to the parent.
+static void reset_after_fork(void) {
+    if (ring != NULL) {
+        ring->tid = gettid();
+        ring->count = 0;
+    }
+}
+
+static void create_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+    pthread_atfork(NULL, NULL, reset_after_fork);
+}
+
+/* Return: the calling thread's ring, allocated on first use
+ */
+static TraceRing *thread_ring(void) {
+    if (ring == NULL) {
+        ring = malloc(sizeof(TraceRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->tid = gettid();
+        ring->count = 0;
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+static TraceRecord *next_record(void) {
+    TraceRing *r = thread_ring();
+    if (r == NULL) {
+        return NULL;
+    }
+    if (r->count == TRACE_RING_LEN) {
+        flush_ring(r);
+    }
+    return &r->recs[r->count++];
+}
+
+void trace_span(const char *name, const char *arg, uint64_t start_ns) {
+    uint64_t end = trace_now();
+    TraceRecord *rec = next_record();
+    if (rec == NULL) {
+        return;
+    }
+    rec->name = name;
+    rec->start = start_ns;
+    rec->dur = end - start_ns;
+    rec->phase = 'X';
+    snprintf(rec->arg, sizeof(rec->arg), "%s", arg ? arg : "");
+}
+
+void trace_instant(const char *name, const char *arg) {
+    TraceRecord *rec = next_record();
+    if (rec == NULL) {
+        return;
+    }
+    rec->name = name;
+    rec->start = trace_now();
+    rec->dur = 0;
+    rec->phase = 'i';
+    snprintf(rec->arg, sizeof(rec->arg), "%s", arg ? arg : "");
+}
+
+void trace_flush(void) {
+    if (ring != NULL) {
+        flush_ring(ring);
+    }
+}
+
+int trace_start(const char *path) {
+    pthread_once(&ring_once, create_key);
+    trace_stop();
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        display_error("ERROR: Cannot open trace file: ", (char *)path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        write_all(fd, "[\n", 2);
+    }
+    trace_file = strdup(path);
+    trace_fd = fd;
+    trace_enabled = 1;
+    return 0;
+}
+
+void trace_stop(void) {
+    if (trace_fd == -1) {
+        return;
+    }
+    trace_enabled = 0;
+    if (ring != NULL) {
+        flush_ring(ring);
+        pthread_setspecific(ring_key, NULL);
+        free(ring);
+        ring = NULL;
+    }
+    close(trace_fd);
+    trace_fd = -1;
+    free(trace_file);
+    trace_file = NULL;
+}
+
+const char *trace_path(void) {
+    return trace_file;
+}
+
+void trace_init(void) {
+    const char *path = getenv("MYSH_TRACE");
+    if (path != NULL && path[0] != '\0') {
+        trace_start(path);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+
+#define TRACE_RING_LEN 4096     // Records buffered per thread before a flush
+#define TRACE_ARG_LEN 32        // Bytes of detail kept per record (e.g. a command name)
+
+
+/* Non-zero while tracing. Every trace point tests this first, so a
+ * disabled trace point costs a single, well-predicted branch.
+ */
+extern int trace_enabled;
+
+#define TRACE_ON() __builtin_expect(trace_enabled, 0)
+
+/* Starts a span: var holds its start time, or 0 when tracing is off.
+ */
+#define TRACE_BEGIN(var) uint64_t var = TRACE_ON() ? trace_now() : 0
+
+/* Ends the span started by TRACE_BEGIN(var). arg may be NULL.
+ */
+#define TRACE_END(var, name, arg) \
+    do { \
+        if (TRACE_ON() && (var) != 0) { \
+            trace_span((name), (arg), (var)); \
+        } \
+    } while (0)
+
+/* Records a zero-length event.
+ */
+#define TRACE_INSTANT(name, arg) \
+    do { \
+        if (TRACE_ON()) { \
+            trace_instant((name), (arg)); \
+        } \
+    } while (0)
+
+
+/* Starts tracing to the file named by $MYSH_TRACE, if it is set.
+ */
+void trace_init(void);
+
+/* Starts appending Chrome trace-event JSON to path. A new or empty file
+ * gets the opening '['; the array is left open, which the Chrome and
+ * Perfetto viewers accept, so several processes can append to one file.
+ * Return: 0 on success, -1 on error
+ */
+int trace_start(const char *path);
+
+/* Flushes the calling thread's records and stops tracing.
+ */
+void trace_stop(void);
+
+/* Writes the calling thread's buffered records to the trace file.
+ */
+void trace_flush(void);
+
+/* Return: the path being traced to, or NULL when tracing is off
+ */
+const char *trace_path(void);
+
+/* Return: CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t trace_now(void);
+
+/* Buffers a complete event from start_ns to now / an instant event in the
+ * calling thread's ring. name must be a string literal; arg is copied.
+ */
+void trace_span(const char *name, const char *arg, uint64_t start_ns);
+void trace_instant(const char *name, const char *arg);
+
+
+#endif
@@ -0,0 +1,169 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_helpers.h"
+#include "uniq.h"
+
+
+int uniq_parse(char **argv, unsigned *flags) {
+    *flags = 0;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = argv[i] + 1; *f != '\0'; f++) {
+            if (*f == 'c') {
+                *flags |= UNIQ_COUNT;
+            } else if (*f == 'd') {
+                *flags |= UNIQ_REPEATED;
+            } else if (*f == 'u') {
+                *flags |= UNIQ_SINGLE;
+            } else if (*f == 'i') {
+                *flags |= UNIQ_ICASE;
+            } else {
+                display_error("ERROR: Invalid option: ", argv[i]);
+                return -1;
+            }
+        }
+    }
+    return i;
+}
+
+void uniq_init(UniqScan *s, unsigned flags, UniqEmit emit, void *ctx) {
+    memset(s, 0, sizeof(UniqScan));
+    s->flags = flags;
+    s->emit = emit;
+    s->ctx = ctx;
+}
+
+// Return: 1 if the lines are the same (ignoring case for -i), 0 otherwise
+static int same_line(const UniqScan *s, const char *a, const char *b, size_t len) {
+    if (!(s->flags & UNIQ_ICASE)) {
+        return memcmp(a, b, len) == 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Prints the current run of repeats, if -d / -u select it
+static int flush_run(UniqScan *s) {
+    if (s->prev == NULL || ((s->flags & UNIQ_REPEATED) && s->repeats < 2) ||
+        ((s->flags & UNIQ_SINGLE) && s->repeats > 1)) {
+        return 0;
+    }
+    if (s->flags & UNIQ_COUNT) {
+        char count[32];
+        int n = snprintf(count, sizeof(count), "%7lu ", s->repeats);
+        if (s->emit(s->ctx, count, n) == -1) {
+            return -1;
+        }
+    }
+    if (s->emit(s->ctx, s->prev, s->prev_len) == -1) {
+        return -1;
+    }
+    return s->emit(s->ctx, "\n", 1);
+}
+
+static int uniq_line(UniqScan *s, const char *text, size_t len) {
+    if (s->prev != NULL && s->prev_len == len && same_line(s, s->prev, text, len)) {
+        s->repeats++;
+        return 0;
+    }
+    if (flush_run(s) == -1) {
+        return -1;
+    }
+    s->prev = text;
+    s->prev_len = len;
+    s->repeats = 1;
+    return 0;
+}
+
+// Filters len bytes of whole lines
+static int uniq_block(UniqScan *s, const char *data, size_t len) {
+    const char *end = data + len;
+    while (data < end) {
+        const char *nl = memchr(data, '\n', end - data);
+        size_t line_len = nl ? (size_t)(nl - data) : (size_t)(end - data);
+        if (uniq_line(s, data, line_len) == -1) {
+            return -1;
+        }
+        data += line_len + 1;
+    }
+    return 0;
+}
+
+/* Copies prev out of the buffer it points into, which is about to go.
+ * Return: 0 on success, -1 if memory runs out
+ */
+static int save_prev(UniqScan *s) {
+    if (s->prev == NULL || s->prev == s->saved) {
+        return 0;
+    }
+    if (s->prev_len + 1 > s->saved_cap) {
+        size_t cap = s->prev_len + 1 > 256 ? s->prev_len + 1 : 256;
+        char *saved = malloc(cap);
+        if (saved == NULL) {
+            return -1;
+        }
+        free(s->saved);
+        s->saved = saved;
+        s->saved_cap = cap;
+    }
+    memcpy(s->saved, s->prev, s->prev_len);
+    s->prev = s->saved;
+    return 0;
+}
+
+// Filters whole lines, then saves prev before their chunk goes
+static int uniq_lines(void *ctx, const char *data, size_t len) {
+    UniqScan *s = ctx;
+    return uniq_block(s, data, len) == -1 || save_prev(s) == -1 ? -1 : 0;
+}
+
+int uniq_chunk(UniqScan *s, const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    return carry_lines(&s->carry, data, len, uniq_lines, s);
+}
+
+int uniq_finish(UniqScan *s) {
+    int ret = 0;
+    if (s->carry.len > 0) {
+        ret = uniq_line(s, s->carry.data, s->carry.len);
+        s->carry.len = 0;
+    }
+    if (ret == 0) {
+        ret = flush_run(s);
+    }
+    uniq_free(s);
+    return ret;
+}
+
+static int uniq_fd_chunk(void *ctx, const char *data, size_t len) {
+    return uniq_chunk(ctx, data, len);
+}
+
+int uniq_fd(UniqScan *s, int fd) {
+    if (fd_chunks(fd, UNIQ_READ_LEN, uniq_fd_chunk, s) == -1) {
+        uniq_free(s);
+        return -1;
+    }
+    return uniq_finish(s);
+}
+
+void uniq_free(UniqScan *s) {
+    free(s->saved);
+    carry_free(&s->carry);
+    s->saved = NULL;
+    s->saved_cap = 0;
+    s->prev = NULL;
+}
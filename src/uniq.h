@@ -0,0 +1,65 @@
+#ifndef __UNIQ_H__
+#define __UNIQ_H__
+
+#include <stddef.h>
+
+#include "io_helpers.h"
+
+
+// uniq options
+#define UNIQ_COUNT    0x1   // -c: prefix lines with how many times they occur
+#define UNIQ_REPEATED 0x2   // -d: only print lines that are repeated
+#define UNIQ_SINGLE   0x4   // -u: only print lines that are not repeated
+#define UNIQ_ICASE    0x8   // -i: ignore case when comparing
+
+#define UNIQ_READ_LEN (1 << 20)     // Bytes per read() of unmappable input
+
+
+typedef int (*UniqEmit)(void *ctx, const char *text, size_t len);
+
+/* State of one uniq input, which may arrive in chunks. The line a run of
+ * repeats started with is compared where it lies in the input, and only
+ * copied when a chunk ends.
+ */
+typedef struct {
+    unsigned flags;
+    UniqEmit emit;
+    void *ctx;
+    const char *prev;       // First line of the current run of repeats, or NULL
+    size_t prev_len;
+    unsigned long repeats;
+    char *saved;            // Copy of prev once its chunk is gone
+    size_t saved_cap;
+    LineCarry carry;        // Unfinished last line of the previous chunk
+} UniqScan;
+
+
+/* Parses the options of argv (argv[0] is the builtin's name; -c, -d, -u
+ * and -i, letters may be combined) into *flags.
+ * Return: index of the first operand, or -1 on an invalid option (already
+ * reported)
+ */
+int uniq_parse(char **argv, unsigned *flags);
+
+void uniq_init(UniqScan *s, unsigned flags, UniqEmit emit, void *ctx);
+
+/* Filters the next len bytes of the input, which may end mid-line.
+ * Return: 0 on success, -1 if emit failed or memory runs out
+ */
+int uniq_chunk(UniqScan *s, const char *data, size_t len);
+
+/* Ends the input: prints the last run of repeats and releases s.
+ * Return: 0 on success, -1 if emit failed or memory runs out
+ */
+int uniq_finish(UniqScan *s);
+
+/* Filters the rest of fd and finishes s: a regular file is mapped, anything
+ * else is read in UNIQ_READ_LEN blocks.
+ * Return: 0 on success, -1 on a read error, if emit failed or memory runs out
+ */
+int uniq_fd(UniqScan *s, int fd);
+
+void uniq_free(UniqScan *s);
+
+
+#endif
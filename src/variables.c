@@ -1,96 +1,259 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#define MAX_VALUE_LENGTH 128
 
-// Structure for a variable node
-typedef struct VarNode {
-    char *key;
-    char *value;
-    struct VarNode *next;
-} VarNode;
+#include "arena.h"
+#include "variables.h"
 
-VarNode *head = NULL; // Head of the linked list
+// Open-addressing hash table of shell variables (linear probing).
+static VarSlot *table = NULL;
+static size_t table_cap = 0;     // Power of two
+static size_t table_used = 0;    // Slots holding a variable
 
-// Function to insert or update a variable
-void set_variable(const char *key, const char *value) {
-    VarNode *current = head;
-
-    // Check if the variable already exists
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            // Update existing variable
-            free(current->value);
-            current->value = strdup(value);
-            if (current->value == NULL) {
-                // Handle memory allocation failure for value
-                const char *error_msg = "ERROR: Memory allocation failed for value\n";
-                write(STDERR_FILENO, error_msg, strlen(error_msg));
-                return;
-            }
-            return;
+// Interned variable names; never reset, names live until free_variables.
+static Arena key_pool = {0};
+
+// Cached environment for spawned commands, rebuilt only when env_dirty is set.
+static Arena env_pool = {0};
+static char **env_cache = NULL;
+static int env_dirty = 1;
+static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void report_error(const char *error_msg) {
+    write(STDERR_FILENO, error_msg, strlen(error_msg));
+}
+
+// FNV-1a over the name bytes
+static uint64_t hash_name(const char *name, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Return: slot holding name, or the empty slot where it should be inserted
+ */
+static VarSlot *find_slot(const char *name, size_t len, uint64_t hash) {
+    size_t mask = table_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        VarSlot *slot = &table[i];
+        if (slot->key == NULL || (slot->hash == hash && slot->key_len == len &&
+                                  memcmp(slot->key, name, len) == 0)) {
+            return slot;
         }
-        current = current->next;
     }
+}
 
-    // Create a new variable node
-    VarNode *new_node = (VarNode *)malloc(sizeof(VarNode));
-    if (new_node == NULL) {
-        // Handle memory allocation failure for new node
-        const char *error_msg = "ERROR: Memory allocation failed for new variable node\n";
-        write(STDERR_FILENO, error_msg, strlen(error_msg));
-        return;
+/* Rehashes every variable into a table of new_cap slots.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int resize_table(size_t new_cap) {
+    VarSlot *new_table = calloc(new_cap, sizeof(VarSlot));
+    if (new_table == NULL) {
+        report_error("ERROR: Memory allocation failed for variable table\n");
+        return -1;
     }
 
-    new_node->key = strdup(key);
-    if (new_node->key == NULL) {
-        // Handle memory allocation failure for key
-        free(new_node);
-        const char *error_msg = "ERROR: Memory allocation failed for key of variable\n";
-        write(STDERR_FILENO, error_msg, strlen(error_msg));
-        return;
+    VarSlot *old_table = table;
+    size_t old_cap = table_cap;
+    table = new_table;
+    table_cap = new_cap;
+    table_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old_table[i].key != NULL) {
+            VarSlot *slot = find_slot(old_table[i].key, old_table[i].key_len, old_table[i].hash);
+            *slot = old_table[i];
+            table_used++;
+        }
     }
+    free(old_table);
+    return 0;
+}
 
-    new_node->value = strdup(value);
-    if (new_node->value == NULL) {
-        // Handle memory allocation failure for value
-        free(new_node->key);
-        free(new_node);
-        const char *error_msg = "ERROR: Memory allocation failed for value of variable\n";
-        write(STDERR_FILENO, error_msg, strlen(error_msg));
-        return;
+/* Return: slot for name, creating an empty one if needed; NULL on failure
+ */
+static VarSlot *intern_variable(const char *name, size_t len) {
+    // Keep the load factor at or below 3/4.
+    if ((table_used + 1) * 4 > table_cap * 3) {
+        size_t new_cap = table_cap ? table_cap * 2 : VAR_TABLE_MIN_CAP;
+        if (resize_table(new_cap) == -1) {
+            return NULL;
+        }
+    }
+
+    uint64_t hash = hash_name(name, len);
+    VarSlot *slot = find_slot(name, len, hash);
+    if (slot->key != NULL) {
+        return slot;
     }
 
-    new_node->next = head;
-    head = new_node;
+    char *key = arena_strndup(&key_pool, name, len);
+    if (key == NULL) {
+        return NULL;
+    }
+    table_used++;
+    slot->key = key;
+    slot->key_len = len;
+    slot->hash = hash;
+    return slot;
 }
 
+// Function to insert or update a variable
+void set_variable(const char *key, const char *value) {
+    VarSlot *slot = intern_variable(key, strlen(key));
+    if (slot == NULL) {
+        return;
+    }
+
+    // Reuse the existing buffer when the new value fits
+    size_t value_len = strlen(value);
+    if (value_len + 1 > slot->value_cap) {
+        char *new_value = malloc(value_len + 1);
+        if (new_value == NULL) {
+            report_error("ERROR: Memory allocation failed for value\n");
+            return;
+        }
+        free(slot->value);
+        slot->value = new_value;
+        slot->value_cap = value_len + 1;
+    }
+    memcpy(slot->value, value, value_len + 1);
+    slot->value_len = value_len;
+    if (slot->exported) {
+        env_dirty = 1;
+    }
+}
 
+// Function to look up a variable by a name that need not be NULL terminated
+const char *lookup_variable(const char *key, size_t key_len, size_t *value_len) {
+    if (table_cap > 0) {
+        VarSlot *slot = find_slot(key, key_len, hash_name(key, key_len));
+        if (slot->key != NULL && slot->value != NULL) {
+            *value_len = slot->value_len;
+            return slot->value;
+        }
+    }
+    *value_len = 0;
+    return ""; // Undefined variables return an empty string
+}
 
 // Function to get a variable's value
 const char *get_variable(const char *key) {
-    VarNode *current = head;
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            return current->value;
+    size_t value_len;
+    return lookup_variable(key, strlen(key), &value_len);
+}
+
+/* Marks name as exported, creating it with an empty value if needed.
+ * Return: 0 on success, -1 on error
+ */
+int export_variable(const char *key) {
+    VarSlot *slot = intern_variable(key, strlen(key));
+    if (slot == NULL) {
+        return -1;
+    }
+    if (!slot->exported) {
+        slot->exported = 1;
+        env_dirty = 1;
+    }
+    return 0;
+}
+
+/* Imports every "name=value" entry of envp as an exported variable.
+ */
+void import_environment(char **envp) {
+    for (size_t i = 0; envp[i] != NULL; i++) {
+        const char *equal_sign = strchr(envp[i], '=');
+        if (equal_sign == NULL || equal_sign == envp[i]) {
+            continue;
+        }
+        VarSlot *slot = intern_variable(envp[i], equal_sign - envp[i]);
+        if (slot == NULL) {
+            return;
+        }
+        slot->exported = 1;
+        set_variable(slot->key, equal_sign + 1);
+    }
+    env_dirty = 1;
+}
+
+/* Return: NULL terminated "name=value" array of exported variables. The
+ * array is cached and only rebuilt after an exported variable changes.
+ */
+char **variables_envp(void) {
+    // Pipeline stages on worker threads (run, parallel) spawn commands too
+    pthread_mutex_lock(&env_lock);
+    if (!env_dirty && env_cache != NULL) {
+        pthread_mutex_unlock(&env_lock);
+        return env_cache;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < table_cap; i++) {
+        if (table[i].key != NULL && table[i].exported) {
+            count++;
+        }
+    }
+
+    arena_reset(&env_pool);
+    env_cache = NULL;
+    char **envp = arena_alloc(&env_pool, (count + 1) * sizeof(char *));
+    if (envp == NULL) {
+        pthread_mutex_unlock(&env_lock);
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < table_cap; i++) {
+        VarSlot *slot = &table[i];
+        if (slot->key == NULL || !slot->exported) {
+            continue;
+        }
+        char *entry = arena_alloc(&env_pool, slot->key_len + slot->value_len + 2);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&env_lock);
+            return NULL;
+        }
+        memcpy(entry, slot->key, slot->key_len);
+        entry[slot->key_len] = '=';
+        if (slot->value_len > 0) {
+            memcpy(entry + slot->key_len + 1, slot->value, slot->value_len);
+        }
+        entry[slot->key_len + 1 + slot->value_len] = '\0';
+        envp[n++] = entry;
+    }
+    envp[n] = NULL;
+
+    env_cache = envp;
+    env_dirty = 0;
+    pthread_mutex_unlock(&env_lock);
+    return envp;
+}
+
+/* Calls fn for every variable (in table order).
+ */
+void for_each_variable(void (*fn)(const VarSlot *slot, void *ctx), void *ctx) {
+    for (size_t i = 0; i < table_cap; i++) {
+        if (table[i].key != NULL) {
+            fn(&table[i], ctx);
         }
-        current = current->next;
     }
-    return ""; // Undefined variables return an empty string
 }
 
 // Function to free all memory on exit
 void free_variables() {
-    VarNode *current = head;
-    while (current != NULL) {
-        VarNode *temp = current;
-        current = current->next;
-        
-        // Free key, value, and node itself
-        free(temp->key);
-        free(temp->value);
-        free(temp);
-    }
-    head = NULL;  //  Set head to NULL to avoid dangling pointer issues
+    for (size_t i = 0; i < table_cap; i++) {
+        free(table[i].value);
+    }
+    free(table);
+    table = NULL;
+    table_cap = 0;
+    table_used = 0;
+    arena_free(&key_pool);
+    arena_free(&env_pool);
+    env_cache = NULL;
+    env_dirty = 1;
 }
@@ -1,18 +1,44 @@
 #ifndef VARIABLES_H
 #define VARIABLES_H
 
-typedef struct VarNode {
-    char *name;
+#include <stddef.h>
+#include <stdint.h>
+
+#define VAR_TABLE_MIN_CAP 64   // Initial slot count; always a power of two
+
+// Slot of the open-addressing variable table
+typedef struct {
+    const char *key;        // Interned name, NULL for an empty slot
+    size_t key_len;
+    uint64_t hash;          // Cached so probes and rehashing skip the strings
     char *value;
-    struct VarNode *next;
-} VarNode;
+    size_t value_len;
+    size_t value_cap;       // Bytes allocated for value, so reassignment can reuse it
+    int exported;
+} VarSlot;
 
 // Function prototypes
 void set_variable(const char *name, const char *value);
 const char *get_variable(const char *name);
-void delete_variable(const char *name);
+const char *lookup_variable(const char *name, size_t name_len, size_t *value_len);
 void free_variables(void);
 
-#endif // VARIABLES_H
+/* Marks name as exported, creating it with an empty value if needed.
+ * Return: 0 on success, -1 on error
+ */
+int export_variable(const char *name);
 
+/* Imports every "name=value" entry of envp as an exported variable.
+ */
+void import_environment(char **envp);
 
+/* Return: NULL terminated "name=value" array of exported variables. The
+ * array is cached and only rebuilt after an exported variable changes.
+ */
+char **variables_envp(void);
+
+/* Calls fn for every variable (in table order).
+ */
+void for_each_variable(void (*fn)(const VarSlot *slot, void *ctx), void *ctx);
+
+#endif // VARIABLES_H
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE  // For openat() flags in dirscan
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_helpers.h"
+#include "walk.h"
+
+#define WALK_DEQUE_MIN_CAP 64
+#define WALK_SPINS 64           // Failed steal rounds before an idle thread sleeps
+#define WALK_IDLE_NS 50000      // How long it then sleeps
+
+
+typedef struct WalkNode WalkNode;
+
+// Where a subdirectory's listing goes inside its parent's (ordered mode)
+typedef struct {
+    size_t offset;
+    WalkNode *node;
+} WalkKid;
+
+// A directory: queued, being read, or (ordered mode) read and waiting to be printed
+struct WalkNode {
+    WalkNode *parent;
+    char *name;                 // Relative to the parent (the root: its path)
+    char *path;                 // From the top (paths mode only)
+    int depth;
+    int fd;                     // Open until every child has been opened
+    int refs;                   // Own read plus children not yet opened (atomic)
+    // Ordered mode only: the directory's lines and its children's positions
+    char *text;
+    size_t len;
+    size_t cap;
+    WalkKid *kids;
+    size_t nkids;
+    size_t kids_cap;
+};
+
+// Per-thread deque: the owner pushes and pops at the tail, thieves take the head
+typedef struct {
+    pthread_mutex_t lock;
+    WalkNode **items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} WalkDeque;
+
+typedef struct {
+    const WalkOpts *opts;
+    int out_fd;
+    int nthreads;
+    WalkDeque deques[WALK_MAX_THREADS];
+    size_t pending;             // Directories queued or being read (atomic)
+    int failed;                 // An allocation failed somewhere
+    int root_errno;             // Why the top directory could not be opened
+    pthread_mutex_t out_lock;   // Serializes unordered batches
+} Walk;
+
+typedef struct {
+    Walk *walk;
+    int index;
+    pthread_t thread;
+    size_t len;                 // Unordered mode: batched lines
+    char buf[OUT_BUF_LEN];
+} WalkWorker;
+
+
+// ===== Deques =====
+
+static int deque_push(WalkDeque *d, WalkNode *node) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head, (d->tail - d->head) * sizeof(WalkNode *));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t new_cap = d->cap ? d->cap * 2 : WALK_DEQUE_MIN_CAP;
+            WalkNode **new_items = realloc(d->items, new_cap * sizeof(WalkNode *));
+            if (new_items == NULL) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->items = new_items;
+            d->cap = new_cap;
+        }
+    }
+    d->items[d->tail++] = node;
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+// Owner's end: the newest directory, so each thread walks depth first
+static WalkNode *deque_pop(WalkDeque *d) {
+    pthread_mutex_lock(&d->lock);
+    WalkNode *node = d->tail > d->head ? d->items[--d->tail] : NULL;
+    pthread_mutex_unlock(&d->lock);
+    return node;
+}
+
+// Thief's end: the oldest directory, usually the largest unexplored subtree
+static WalkNode *deque_steal(WalkDeque *d) {
+    pthread_mutex_lock(&d->lock);
+    WalkNode *node = d->tail > d->head ? d->items[d->head++] : NULL;
+    pthread_mutex_unlock(&d->lock);
+    return node;
+}
+
+
+// ===== Nodes =====
+
+// Return: "dir/name" (malloc'd), or NULL if memory runs out
+static char *path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if (path != NULL) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + slash, name, name_len + 1);
+    }
+    return path;
+}
+
+static WalkNode *node_new(WalkNode *parent, const char *name, int paths) {
+    WalkNode *node = calloc(1, sizeof(WalkNode));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->name = strdup(name);
+    if (paths) {
+        node->path = parent ? path_join(parent->path, name) : strdup(name);
+    }
+    if (node->name == NULL || (paths && node->path == NULL)) {
+        free(node->name);
+        free(node->path);
+        free(node);
+        return NULL;
+    }
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 1;
+    node->fd = -1;
+    node->refs = 1;
+    return node;
+}
+
+static void node_free(WalkNode *node) {
+    free(node->name);
+    free(node->path);
+    free(node->text);
+    free(node->kids);
+    free(node);
+}
+
+// Frees an ordered-mode tree
+static void tree_free(WalkNode *node) {
+    for (size_t i = 0; i < node->nkids; i++) {
+        tree_free(node->kids[i].node);
+    }
+    node_free(node);
+}
+
+/* Drops one reference to node; the last one closes its descriptor (and,
+ * unordered, frees it: nothing else points at it by then).
+ */
+static void node_release(Walk *walk, WalkNode *node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (node->fd != -1) {
+        close(node->fd);
+        node->fd = -1;
+    }
+    if (!walk->opts->ordered) {
+        node_free(node);
+    }
+}
+
+static int grow(void **data, size_t *cap, size_t need, size_t elem, size_t min_cap) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap * 2 : min_cap;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    void *new_data = realloc(*data, new_cap * elem);
+    if (new_data == NULL) {
+        return -1;
+    }
+    *data = new_data;
+    *cap = new_cap;
+    return 0;
+}
+
+
+// ===== Output =====
+
+static void flush_worker(WalkWorker *w) {
+    if (w->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&w->walk->out_lock);
+    out_write(w->walk->out_fd, w->buf, w->len);
+    out_flush(w->walk->out_fd);
+    pthread_mutex_unlock(&w->walk->out_lock);
+    w->len = 0;
+}
+
+/* Adds the line for name, prefixed with "dir/" unless dir is NULL, to
+ * node's text (ordered) or w's batch.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int emit_name(WalkWorker *w, WalkNode *node, const char *dir, const char *name) {
+    size_t dir_len = dir ? strlen(dir) : 0;
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    size_t name_len = strlen(name);
+    size_t len = dir_len + slash + name_len + 1;
+    char *line;
+    if (w->walk->opts->ordered) {
+        if (grow((void **)&node->text, &node->cap, node->len + len, 1, 256) == -1) {
+            return -1;
+        }
+        line = node->text + node->len;
+        node->len += len;
+    } else {
+        if (w->len + len > sizeof(w->buf)) {
+            flush_worker(w);
+        }
+        if (len > sizeof(w->buf)) {
+            // A path deeper than the whole batch: write it in pieces
+            pthread_mutex_lock(&w->walk->out_lock);
+            out_write(w->walk->out_fd, dir, dir_len);
+            out_write(w->walk->out_fd, "/", slash);
+            out_write(w->walk->out_fd, name, name_len);
+            out_write(w->walk->out_fd, "\n", 1);
+            out_flush(w->walk->out_fd);
+            pthread_mutex_unlock(&w->walk->out_lock);
+            return 0;
+        }
+        line = w->buf + w->len;
+        w->len += len;
+    }
+    if (dir_len > 0) {
+        memcpy(line, dir, dir_len);
+        line[dir_len] = '/';
+    }
+    memcpy(line + dir_len + slash, name, name_len);
+    line[len - 1] = '\n';
+    return 0;
+}
+
+// Prints an ordered-mode tree depth first, each child at its recorded offset
+static void print_node(WalkNode *node, int fd) {
+    size_t pos = 0;
+    for (size_t i = 0; i < node->nkids; i++) {
+        WalkKid *kid = &node->kids[i];
+        if (kid->offset > pos) {
+            out_write(fd, node->text + pos, kid->offset - pos);
+            pos = kid->offset;
+        }
+        print_node(kid->node, fd);
+    }
+    if (node->len > pos) {
+        out_write(fd, node->text + pos, node->len - pos);
+    }
+}
+
+
+// ===== Workers =====
+
+/* Queues child, a subdirectory of node found by worker w.
+ * Return: 0 on success, -1 on allocation failure
+ */
+static int queue_child(WalkWorker *w, WalkNode *node, const char *name) {
+    Walk *walk = w->walk;
+    WalkNode *child = node_new(node, name, walk->opts->paths);
+    if (child == NULL) {
+        return -1;
+    }
+    if (walk->opts->ordered) {
+        if (grow((void **)&node->kids, &node->kids_cap, node->nkids + 1, sizeof(WalkKid), 8) == -1) {
+            node_free(child);
+            return -1;
+        }
+        node->kids[node->nkids++] = (WalkKid){node->len, child};
+    }
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+    if (deque_push(&walk->deques[w->index], child) == -1) {
+        __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+        if (walk->opts->ordered) {
+            node->nkids--;
+        }
+        node_free(child);
+        return -1;
+    }
+    return 0;
+}
+
+// Reads one directory: prints its matching names and queues its subdirectories
+static void read_node(WalkWorker *w, WalkNode *node) {
+    Walk *walk = w->walk;
+    const WalkOpts *opts = walk->opts;
+    DirReader dir;
+    int parent_fd = node->parent ? node->parent->fd : AT_FDCWD;
+    int opened = dir_open(&dir, parent_fd, node->name, node->parent != NULL);
+    if (node->parent != NULL) {
+        node_release(walk, node->parent);
+    } else if (opened == -1) {
+        walk->root_errno = errno;
+    }
+
+    if (opened == 0) {
+        node->fd = dir.fd;
+        DirEntry entry;
+        while (dir_next(&dir, &entry) == 1) {
+            WalkEntry found = {entry.name, node->path, dir.fd, entry.type, node->depth};
+            if ((opts->match == NULL || opts->match(&found, opts->ctx)) &&
+                emit_name(w, node, node->path, entry.name) == -1) {
+                walk->failed = 1;
+            }
+            if (node->depth >= opts->max_depth || dir_is_dot(entry.name) ||
+                !dir_entry_is_dir(&dir, &entry)) {
+                continue;
+            }
+            if (queue_child(w, node, entry.name) == -1) {
+                walk->failed = 1;
+            }
+        }
+        dir.fd = -1;    // The descriptor now belongs to node
+        dir_close(&dir);
+    }
+    node_release(walk, node);
+    __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELEASE);
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *w = arg;
+    Walk *walk = w->walk;
+    unsigned idle = 0;
+    while (1) {
+        WalkNode *node = deque_pop(&walk->deques[w->index]);
+        for (int k = 1; node == NULL && k < walk->nthreads; k++) {
+            node = deque_steal(&walk->deques[(w->index + k) % walk->nthreads]);
+        }
+        if (node != NULL) {
+            read_node(w, node);
+            idle = 0;
+            continue;
+        }
+        if (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        // Others are still reading directories that may yield more work
+        if (++idle < WALK_SPINS) {
+            sched_yield();
+        } else {
+            struct timespec pause = {0, WALK_IDLE_NS};
+            nanosleep(&pause, NULL);
+        }
+    }
+    flush_worker(w);
+    return NULL;
+}
+
+
+/* Lists the tree under path to out_fd on opts->threads threads.
+ * Return: 0 on success, -1 if path cannot be opened (unless opts->top is
+ * set and it is not a directory) or memory runs out
+ */
+int walk_list(const char *path, const WalkOpts *opts, int out_fd) {
+    int nthreads = opts->threads < 1 ? 1 : opts->threads;
+    if (nthreads > WALK_MAX_THREADS) {
+        nthreads = WALK_MAX_THREADS;
+    }
+    Walk *walk = calloc(1, sizeof(Walk));
+    WalkWorker *workers = calloc(nthreads, sizeof(WalkWorker));
+    WalkNode *root = node_new(NULL, path, opts->paths);
+    if (walk == NULL || workers == NULL || root == NULL) {
+        free(walk);
+        free(workers);
+        if (root != NULL) {
+            node_free(root);
+        }
+        return -1;
+    }
+    walk->opts = opts;
+    walk->out_fd = out_fd;
+    walk->nthreads = nthreads;
+    walk->pending = 1;
+    pthread_mutex_init(&walk->out_lock, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+        workers[i].walk = walk;
+        workers[i].index = i;
+    }
+    root->refs++;           // Kept until printed (ordered) or checked below
+    deque_push(&walk->deques[0], root);
+    WalkEntry top = {path, NULL, AT_FDCWD, DT_UNKNOWN, 0};
+    if (opts->top && (opts->match == NULL || opts->match(&top, opts->ctx)) &&
+        emit_name(&workers[0], root, NULL, path) == -1) {
+        walk->failed = 1;
+    }
+
+    out_flush(out_fd);      // Our own pending output goes first
+    int started = 1;
+    while (started < nthreads &&
+           pthread_create(&workers[started].thread, NULL, walk_worker, &workers[started]) == 0) {
+        started++;
+    }
+    walk_worker(&workers[0]);   // The calling thread is worker 0
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Our extra reference kept the root's descriptor open if it was opened at all;
+    // with the top listed, a top that is not a directory is no error
+    int ret = walk->failed || (root->fd == -1 && !(opts->top && walk->root_errno == ENOTDIR)) ? -1 : 0;
+    node_release(walk, root);
+    if (opts->ordered) {
+        print_node(root, out_fd);
+        tree_free(root);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&walk->deques[i].lock);
+        free(walk->deques[i].items);
+    }
+    pthread_mutex_destroy(&walk->out_lock);
+    free(workers);
+    free(walk);
+    return ret;
+}
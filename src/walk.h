@@ -0,0 +1,52 @@
+#ifndef __WALK_H__
+#define __WALK_H__
+
+#include "dirscan.h"
+
+
+#define WALK_MAX_THREADS 64
+
+
+/* An entry offered to WalkOpts.match. The top directory itself is offered
+ * with depth 0, its path as name and dir_fd AT_FDCWD.
+ */
+typedef struct {
+    const char *name;
+    const char *dir_path;   // Path of the directory holding the entry (paths mode only)
+    int dir_fd;             // The directory holding the entry, for fstatat()
+    unsigned char type;     // DT_DIR, DT_REG, ... or DT_UNKNOWN
+    int depth;              // Of the directory holding the entry (the top one is 1)
+} WalkEntry;
+
+/* A parallel listing of a directory tree: the names of every entry, down
+ * to max_depth levels (the top directory is level 1).
+ */
+typedef struct {
+    int threads;
+    int max_depth;
+    int ordered;        // Same order as a sequential depth-first walk, else as found
+    int paths;          // Print each entry's path from the top, not its bare name
+    int top;            // Offer the top directory itself to match first
+    int (*match)(const WalkEntry *entry, void *ctx);   // Which entries to print (NULL: all)
+    void *ctx;
+} WalkOpts;
+
+
+/* Lists the tree under path to out_fd on opts->threads threads. Each
+ * thread owns a deque of directories still to be read: it pushes the
+ * subdirectories it finds and pops its own newest, so it walks depth first;
+ * an idle thread steals the oldest directory of another, which tends to be
+ * the root of a large unexplored subtree. Directories are opened relative
+ * to their parent's descriptor, which stays open only until every child
+ * has been opened.
+ *
+ * Unordered output is streamed: threads write their lines in batches as
+ * they go. Ordered output is collected per directory, with the position of
+ * each subdirectory's listing, and printed depth first at the end.
+ * Return: 0 on success, -1 if path cannot be opened (unless opts->top is
+ * set and it is not a directory) or memory runs out
+ */
+int walk_list(const char *path, const WalkOpts *opts, int out_fd);
+
+
+#endif
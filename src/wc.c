@@ -0,0 +1,432 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "io_helpers.h"
+#include "wc.h"
+
+// Whitespace for word splitting
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r')
+
+
+/* Parses the leading -l, -w and -c options of argv (argv[0] is the
+ * builtin's name; letters may be combined as in -lw) into *what, which is
+ * WC_ALL when none are given.
+ * Return: index of the first operand, or -1 on an invalid option (already
+ * reported)
+ */
+int wc_parse_flags(char **argv, unsigned *what) {
+    *what = 0;
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *f = argv[i] + 1; *f != '\0'; f++) {
+            if (*f == 'l') {
+                *what |= WC_LINES;
+            } else if (*f == 'w') {
+                *what |= WC_WORDS;
+            } else if (*f == 'c') {
+                *what |= WC_CHARS;
+            } else {
+                display_error("ERROR: Invalid option: ", argv[i]);
+                return -1;
+            }
+        }
+    }
+    if (*what == 0) {
+        *what = WC_ALL;
+    }
+    return i;
+}
+
+
+// ===== Counting kernels =====
+
+// Adds the lines (and, if words is set, the words) of len bytes at p to c.
+typedef void (*WcKernel)(WcCounts *c, const unsigned char *p, size_t len, int words);
+
+static void count_scalar(WcCounts *c, const unsigned char *p, size_t len, int words) {
+    unsigned long lines = 0, nwords = 0;
+    int in_word = c->in_word;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = p[i];
+        lines += ch == '\n';
+        if (words) {
+            // A word starts at every non-whitespace byte that follows whitespace
+            int space = IS_SPACE(ch);
+            nwords += !space && !in_word;
+            in_word = !space;
+        }
+    }
+    c->lines += lines;
+    c->words += nwords;
+    if (len > 0) {
+        c->in_word = !IS_SPACE(p[len - 1]);
+    }
+}
+
+#if defined(__x86_64__)
+
+/* The vector kernels classify 64 bytes at a time into bit masks: one bit
+ * per newline, and one per whitespace byte when counting words. Word
+ * starts are the non-space bits whose previous bit (carried across blocks)
+ * is a space, so each block costs a few compares and popcounts. The tail
+ * goes through the scalar kernel.
+ */
+static void count_sse2(WcCounts *c, const unsigned char *p, size_t len, int words) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    uint64_t lines = 0, nwords = 0;
+    uint64_t prev_space = !c->in_word;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t nl_mask = 0, space_mask = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * k));
+            __m128i is_nl = _mm_cmpeq_epi8(v, nl);
+            nl_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_nl) << (16 * k);
+            if (words) {
+                __m128i space = _mm_or_si128(_mm_or_si128(is_nl, _mm_cmpeq_epi8(v, sp)),
+                                             _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, cr)));
+                space_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << (16 * k);
+            }
+        }
+        lines += __builtin_popcountll(nl_mask);
+        if (words) {
+            nwords += __builtin_popcountll(~space_mask & ((space_mask << 1) | prev_space));
+            prev_space = space_mask >> 63;
+        }
+    }
+    c->lines += lines;
+    c->words += nwords;
+    if (i > 0) {
+        c->in_word = !IS_SPACE(p[i - 1]);
+    }
+    count_scalar(c, p + i, len - i, words);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void count_avx2(WcCounts *c, const unsigned char *p, size_t len, int words) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    uint64_t lines = 0, nwords = 0;
+    uint64_t prev_space = !c->in_word;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t nl_mask = 0, space_mask = 0;
+        for (int k = 0; k < 2; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i + 32 * k));
+            __m256i is_nl = _mm256_cmpeq_epi8(v, nl);
+            nl_mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_nl) << (32 * k);
+            if (words) {
+                __m256i space = _mm256_or_si256(_mm256_or_si256(is_nl, _mm256_cmpeq_epi8(v, sp)),
+                                                _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, cr)));
+                space_mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << (32 * k);
+            }
+        }
+        lines += __builtin_popcountll(nl_mask);
+        if (words) {
+            nwords += __builtin_popcountll(~space_mask & ((space_mask << 1) | prev_space));
+            prev_space = space_mask >> 63;
+        }
+    }
+    c->lines += lines;
+    c->words += nwords;
+    if (i > 0) {
+        c->in_word = !IS_SPACE(p[i - 1]);
+    }
+    count_scalar(c, p + i, len - i, words);
+}
+
+#endif
+
+static WcKernel kernel = count_scalar;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernel(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? count_avx2 : count_sse2;
+#endif
+}
+
+/* Adds the len bytes at data to counts, computing only the counters in
+ * what. Uses the widest vector kernel the CPU supports.
+ */
+void wc_count(WcCounts *counts, const char *data, size_t len, unsigned what) {
+    pthread_once(&kernel_once, pick_kernel);
+    counts->chars += len;
+    if (what & (WC_LINES | WC_WORDS)) {
+        kernel(counts, (const unsigned char *)data, len, (what & WC_WORDS) != 0);
+    } else if (len > 0) {
+        counts->in_word = !IS_SPACE((unsigned char)data[len - 1]);
+    }
+}
+
+
+// ===== Whole inputs =====
+
+// One slice of a mapped file, counted on its own thread
+typedef struct {
+    const char *data;
+    size_t len;
+    unsigned what;
+    WcCounts counts;
+    pthread_t thread;
+    int started;
+} WcSlice;
+
+static void *count_slice(void *arg) {
+    WcSlice *slice = arg;
+    wc_count(&slice->counts, slice->data, slice->len, slice->what);
+    return NULL;
+}
+
+/* Counts len mapped bytes, split into slices of at least WC_THREAD_MIN_LEN
+ * that are counted in parallel. A slice starts inside a word exactly when
+ * the byte before it is not a space, so the per-slice word counts add up
+ * with no double counting at the seams.
+ */
+static void count_mapped(WcCounts *counts, const char *data, size_t len, unsigned what) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nslices = len / WC_THREAD_MIN_LEN;
+    if (nslices > (size_t)cpus) {
+        nslices = cpus;
+    }
+    if (nslices > WC_MAX_THREADS) {
+        nslices = WC_MAX_THREADS;
+    }
+    if (nslices <= 1 || !(what & (WC_LINES | WC_WORDS))) {
+        wc_count(counts, data, len, what);
+        return;
+    }
+
+    WcSlice slices[WC_MAX_THREADS];
+    size_t step = len / nslices;
+    for (size_t i = 0; i < nslices; i++) {
+        WcSlice *slice = &slices[i];
+        size_t start = i * step;
+        slice->data = data + start;
+        slice->len = i + 1 < nslices ? step : len - start;
+        slice->what = what;
+        memset(&slice->counts, 0, sizeof(WcCounts));
+        slice->counts.in_word = i == 0 ? counts->in_word : !IS_SPACE((unsigned char)data[start - 1]);
+        // The calling thread takes the first slice itself
+        slice->started = i > 0 && pthread_create(&slice->thread, NULL, count_slice, slice) == 0;
+    }
+    for (size_t i = 0; i < nslices; i++) {
+        WcSlice *slice = &slices[i];
+        if (slice->started) {
+            pthread_join(slice->thread, NULL);
+        } else {
+            count_slice(slice);
+        }
+        counts->words += slice->counts.words;
+        counts->chars += slice->counts.chars;
+        counts->lines += slice->counts.lines;
+    }
+    counts->in_word = slices[nslices - 1].counts.in_word;
+}
+
+typedef struct {
+    WcCounts *counts;
+    unsigned what;
+} WcChunk;
+
+// Read blocks are below WC_THREAD_MIN_LEN: only a mapped file is split
+static int wc_fd_chunk(void *ctx, const char *data, size_t len) {
+    WcChunk *chunk = ctx;
+    count_mapped(chunk->counts, data, len, chunk->what);
+    return 0;
+}
+
+/* Counts the rest of fd into counts: a regular file is mapped and split
+ * across threads, anything else is read in WC_READ_LEN blocks.
+ * Return: 0 on success, -1 on a read error
+ */
+int wc_count_fd(WcCounts *counts, int fd, unsigned what) {
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off != -1 && st.st_size >= off) {
+        size_t len = st.st_size - off;
+        if (len == 0) {
+            return 0;
+        }
+        if (what == WC_CHARS) {
+            counts->chars += len;   // Known without reading a byte
+            lseek(fd, st.st_size, SEEK_SET);
+            return 0;
+        }
+        if (len <= WC_SMALL_LEN) {
+            // Small files: one read beats setting up (and shooting down) a mapping
+            char small[WC_SMALL_LEN];
+            ssize_t n = pread(fd, small, len, off);
+            if (n >= 0) {
+                wc_count(counts, small, n, what);
+                lseek(fd, off + n, SEEK_SET);
+                return (size_t)n == len ? 0 : wc_count_fd(counts, fd, what);
+            }
+        }
+    }
+    WcChunk chunk = {counts, what};
+    return fd_chunks(fd, WC_READ_LEN, wc_fd_chunk, &chunk);
+}
+
+
+// ===== Many files =====
+
+// Files shared by the pool's workers, each claiming the next unclaimed one
+typedef struct {
+    char **paths;
+    size_t count;
+    unsigned what;
+    WcCounts *counts;
+    int *status;            // Per file: 0, or the WC_ERR_* that stopped it
+    size_t next;            // Next file to claim (atomic)
+} WcBatch;
+
+#define WC_ERR_OPEN 1
+#define WC_ERR_READ 2
+
+static void *wc_worker(void *arg) {
+    WcBatch *batch = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        int fd = open(batch->paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            batch->status[i] = WC_ERR_OPEN;
+            continue;
+        }
+        if (wc_count_fd(&batch->counts[i], fd, batch->what) == -1) {
+            batch->status[i] = WC_ERR_READ;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Formats one row of the multi-file table: the counters in what, then name.
+ * Return: length of the text
+ */
+static size_t format_row(char *buf, size_t size, const WcCounts *counts, unsigned what, const char *name) {
+    size_t len = 0;
+    if (what & WC_WORDS) {
+        len += snprintf(buf + len, size - len, "%8lu ", counts->words);
+    }
+    if ((what & WC_CHARS) && len < size) {
+        len += snprintf(buf + len, size - len, "%8lu ", counts->chars);
+    }
+    if ((what & WC_LINES) && len < size) {
+        len += snprintf(buf + len, size - len, "%8lu ", counts->lines);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "%s\n", name);
+    }
+    return len < size ? len : size - 1;
+}
+
+/* Counts count files on a bounded pool of threads, then emits one row per
+ * file in argument order (words, characters and newlines, as selected by
+ * what) and a "total" row. More workers than CPUs are started, up to
+ * WC_MAX_THREADS, so one file's open() and page faults overlap with
+ * another's counting. Files that cannot be read are reported and skipped.
+ * Return: 0 on success, -1 if a file failed or emit failed
+ */
+int wc_files(char **paths, size_t count, unsigned what,
+             int (*emit)(void *ctx, const char *text, size_t len), void *ctx) {
+    WcBatch batch = {paths, count, what, NULL, NULL, 0};
+    batch.counts = calloc(count, sizeof(WcCounts));
+    batch.status = calloc(count, sizeof(int));
+    if (batch.counts == NULL || batch.status == NULL) {
+        free(batch.counts);
+        free(batch.status);
+        display_error("ERROR: Memory allocation failed for wc", "");
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers = cpus > 0 ? 2 * (size_t)cpus : 1;
+    if (nworkers < WC_MIN_WORKERS) {
+        nworkers = WC_MIN_WORKERS;
+    }
+    if (nworkers > WC_MAX_THREADS) {
+        nworkers = WC_MAX_THREADS;
+    }
+    if (nworkers > count) {
+        nworkers = count;
+    }
+    pthread_t workers[WC_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < nworkers &&
+           pthread_create(&workers[started], NULL, wc_worker, &batch) == 0) {
+        started++;
+    }
+    wc_worker(&batch);     // The calling thread works too
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int ret = 0;
+    WcCounts total = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (batch.status[i] != 0) {
+            display_error(batch.status[i] == WC_ERR_OPEN ? "ERROR: Cannot open file: "
+                                                         : "ERROR: Cannot read input: ", paths[i]);
+            ret = -1;
+            continue;
+        }
+        char row[PATH_MAX + 128];
+        size_t len = format_row(row, sizeof(row), &batch.counts[i], what, paths[i]);
+        if (emit(ctx, row, len) == -1) {
+            ret = -1;
+            break;
+        }
+        total.words += batch.counts[i].words;
+        total.chars += batch.counts[i].chars;
+        total.lines += batch.counts[i].lines;
+    }
+    char row[128];
+    size_t len = format_row(row, sizeof(row), &total, what, "total");
+    if (emit(ctx, row, len) == -1) {
+        ret = -1;
+    }
+    free(batch.counts);
+    free(batch.status);
+    return ret;
+}
+
+/* Prints the counters in what as wc's "word count / character count /
+ * newline count" lines into buf.
+ * Return: length of the text
+ */
+size_t wc_format(char *buf, size_t size, const WcCounts *counts, unsigned what) {
+    size_t len = 0;
+    buf[0] = '\0';
+    if (what & WC_WORDS) {
+        len += snprintf(buf + len, size - len, "word count %lu\n", counts->words);
+    }
+    if ((what & WC_CHARS) && len < size) {
+        len += snprintf(buf + len, size - len, "character count %lu\n", counts->chars);
+    }
+    if ((what & WC_LINES) && len < size) {
+        len += snprintf(buf + len, size - len, "newline count %lu\n", counts->lines);
+    }
+    return len < size ? len : size - 1;
+}
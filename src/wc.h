@@ -0,0 +1,65 @@
+#ifndef __WC_H__
+#define __WC_H__
+
+#include <stddef.h>
+
+
+// Counters wc can report (-w, -c, -l); unrequested ones are not computed
+#define WC_WORDS 0x1
+#define WC_CHARS 0x2
+#define WC_LINES 0x4
+#define WC_ALL (WC_WORDS | WC_CHARS | WC_LINES)
+
+#define WC_READ_LEN (1 << 20)           // Bytes per read() of unmappable input
+#define WC_SMALL_LEN (64 << 10)         // Regular files up to this size are read, not mapped
+#define WC_THREAD_MIN_LEN (16 << 20)    // Least bytes of a file given to one counting thread
+#define WC_MAX_THREADS 16
+#define WC_MIN_WORKERS 4                // Threads counting many files, even on one CPU
+
+
+/* Running totals for wc; chunks of one input may be counted one at a time.
+ */
+typedef struct {
+    unsigned long words;
+    unsigned long chars;
+    unsigned long lines;
+    int in_word;            // The previous chunk ended inside a word
+} WcCounts;
+
+
+/* Parses the leading -l, -w and -c options of argv (argv[0] is the
+ * builtin's name; letters may be combined as in -lw) into *what, which is
+ * WC_ALL when none are given.
+ * Return: index of the first operand, or -1 on an invalid option (already
+ * reported)
+ */
+int wc_parse_flags(char **argv, unsigned *what);
+
+/* Adds the len bytes at data to counts, computing only the counters in
+ * what. Uses the widest vector kernel the CPU supports.
+ */
+void wc_count(WcCounts *counts, const char *data, size_t len, unsigned what);
+
+/* Counts the rest of fd into counts: a regular file is mapped and split
+ * across threads, anything else is read in WC_READ_LEN blocks.
+ * Return: 0 on success, -1 on a read error
+ */
+int wc_count_fd(WcCounts *counts, int fd, unsigned what);
+
+/* Counts count files on a bounded pool of threads, then emits one row per
+ * file in argument order (words, characters and newlines, as selected by
+ * what) and a "total" row. Files that cannot be read are reported and
+ * skipped.
+ * Return: 0 on success, -1 if a file failed or emit failed
+ */
+int wc_files(char **paths, size_t count, unsigned what,
+             int (*emit)(void *ctx, const char *text, size_t len), void *ctx);
+
+/* Prints the counters in what as wc's "word count / character count /
+ * newline count" lines into buf.
+ * Return: length of the text
+ */
+size_t wc_format(char *buf, size_t size, const WcCounts *counts, unsigned what);
+
+
+#endif